@@ -0,0 +1,211 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmseed.h"
+
+#include "arena.h"
+#include "stage_stats.h"
+
+#define ARENAALIGN 16
+
+/* Block headers are padded so allocations start aligned */
+#define BLOCKHEADER ((sizeof (ArenaBlock) + ARENAALIGN - 1) & ~(size_t) (ARENAALIGN - 1))
+
+void
+initArena (Arena *arena, size_t blocksize)
+{
+  memset (arena, 0, sizeof (Arena));
+  arena->blocksize = (blocksize) ? blocksize : ARENABLOCKSIZE;
+}
+
+static void *
+carveBlock (ArenaBlock *block, size_t size)
+{
+  void *ptr;
+
+  if (block->size - block->used < size)
+    return NULL;
+
+  ptr = (char *)block + BLOCKHEADER + block->used;
+  block->used += size;
+
+  return ptr;
+}
+
+/* Allocate from the current block, else from the first block with room,
+ * else from a new block. The memory is not cleared. */
+void *
+arenaAlloc (Arena *arena, size_t size)
+{
+  ArenaBlock *block;
+  void *ptr;
+
+  size = (size + ARENAALIGN - 1) & ~(size_t) (ARENAALIGN - 1);
+
+  if (arena->current && (ptr = carveBlock (arena->current, size)))
+    return ptr;
+
+  for (block = arena->blocks; block; block = block->next)
+  {
+    if ((ptr = carveBlock (block, size)))
+    {
+      arena->current = block;
+      return ptr;
+    }
+  }
+
+  size_t blocksize = (size > arena->blocksize) ? size : arena->blocksize;
+  if ((block = (ArenaBlock *)malloc (BLOCKHEADER + blocksize)) == NULL)
+  {
+    ms_log (2, "Cannot allocate arena block of %zu bytes\n", blocksize);
+    return NULL;
+  }
+  block->size = blocksize;
+  block->used = 0;
+  block->next = arena->blocks;
+
+  arena->blocks  = block;
+  arena->current = block;
+  arena->reserved += blocksize;
+  countStage (COUNT_ARENABLOCKS, 1);
+
+  return carveBlock (block, size);
+}
+
+/* Release every allocation but keep the blocks for reuse */
+void
+resetArena (Arena *arena)
+{
+  ArenaBlock *block;
+
+  for (block = arena->blocks; block; block = block->next)
+    block->used = 0;
+  arena->current = arena->blocks;
+}
+
+void
+freeArena (Arena *arena)
+{
+  ArenaBlock *block;
+
+  while ((block = arena->blocks))
+  {
+    arena->blocks = block->next;
+    free (block);
+  }
+  initArena (arena, arena->blocksize);
+}
+
+/* libmseed allocations are tagged with the arena they came from, NULL
+ * for the heap, so they can be told apart when freed or resized */
+typedef union AllocHeader
+{
+  struct
+  {
+    Arena *arena;
+    size_t size;
+  } tag;
+  max_align_t align;
+} AllocHeader;
+
+static _Thread_local Arena *currentArena = NULL;
+static pthread_once_t hooksOnce          = PTHREAD_ONCE_INIT;
+
+/* Small requests come from the arena of the calling thread, if any.
+ * Large ones, typically growing sample buffers, go to the heap where
+ * realloc can extend them without leaving copies behind. */
+static void *
+hookMalloc (size_t size)
+{
+  Arena *arena = currentArena;
+  AllocHeader *header;
+
+  if (arena && size <= arena->blocksize / 4)
+    header = (AllocHeader *)arenaAlloc (arena, sizeof (AllocHeader) + size);
+  else
+    header = (AllocHeader *)malloc (sizeof (AllocHeader) + size);
+  if (header == NULL)
+    return NULL;
+
+  header->tag.arena = (arena && size <= arena->blocksize / 4) ? arena : NULL;
+  header->tag.size  = size;
+  countStage ((header->tag.arena) ? COUNT_ARENAALLOCS : COUNT_HEAPALLOCS, 1);
+
+  return header + 1;
+}
+
+/* Arena memory is released with its arena */
+static void
+hookFree (void *ptr)
+{
+  AllocHeader *header;
+
+  if (ptr == NULL)
+    return;
+
+  header = (AllocHeader *)ptr - 1;
+  if (header->tag.arena == NULL)
+    free (header);
+}
+
+static void *
+hookRealloc (void *ptr, size_t size)
+{
+  AllocHeader *header;
+  void *moved;
+
+  if (ptr == NULL)
+    return hookMalloc (size);
+
+  header = (AllocHeader *)ptr - 1;
+  if (header->tag.arena == NULL)
+  {
+    header = (AllocHeader *)realloc (header, sizeof (AllocHeader) + size);
+    if (header == NULL)
+      return NULL;
+    countStage (COUNT_HEAPALLOCS, 1);
+    header->tag.size = size;
+    return header + 1;
+  }
+
+  if (size <= header->tag.size)
+    return ptr;
+
+  if ((moved = hookMalloc (size)) == NULL)
+    return NULL;
+  memcpy (moved, ptr, header->tag.size);
+
+  return moved;
+}
+
+static void
+setHooks (void)
+{
+  libmseed_memory.malloc  = hookMalloc;
+  libmseed_memory.realloc = hookRealloc;
+  libmseed_memory.free    = hookFree;
+}
+
+/* Route libmseed's allocations through the arena hooks. Must run before
+ * libmseed allocates anything, memory from the default allocator cannot
+ * be freed through the hooks. */
+void
+installArenaHooks (void)
+{
+  pthread_once (&hooksOnce, setHooks);
+}
+
+/* Make libmseed allocations of the calling thread come from the given
+ * arena, NULL for the heap. Returns the arena used before. */
+Arena *
+useArena (Arena *arena)
+{
+  Arena *previous = currentArena;
+
+  currentArena = arena;
+
+  return previous;
+}
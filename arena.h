@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Default size of an arena block, larger requests get a block of their own */
+#define ARENABLOCKSIZE 4194304
+
+/* A chunk of arena memory, allocations are carved from it in order */
+typedef struct ArenaBlock
+{
+  struct ArenaBlock *next;
+  size_t size;
+  size_t used;
+} ArenaBlock;
+
+/* Bump allocator whose allocations are all released at once. A reset
+ * keeps the blocks, so an arena reused across files settles at its
+ * high-water mark and stops calling malloc. */
+typedef struct Arena
+{
+  ArenaBlock *blocks;
+  ArenaBlock *current; /* Block the last allocation came from */
+  size_t blocksize;
+  size_t reserved; /* Bytes held in blocks */
+} Arena;
+
+void initArena (Arena *arena, size_t blocksize);
+void *arenaAlloc (Arena *arena, size_t size);
+void resetArena (Arena *arena);
+void freeArena (Arena *arena);
+void installArenaHooks (void);
+Arena *useArena (Arena *arena);
+
+#endif
@@ -0,0 +1,305 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmseed.h"
+
+#include "batch.h"
+#include "work_stealing.h"
+
+/* Bytes read from the start of each file to detect a miniSEED record */
+#define BATCHDETECTBYTES 512
+
+/* One input file of a batch run */
+typedef struct BatchFile
+{
+  char *path;
+  int64_t size;
+  int rv;
+  int skipped; /* Not miniSEED */
+} BatchFile;
+
+typedef struct BatchFileList
+{
+  BatchFile *files;
+  int numfiles;
+  int capacity;
+} BatchFileList;
+
+static int
+addBatchFile (BatchFileList *list, const char *path, int64_t size)
+{
+  if (list->numfiles == list->capacity)
+  {
+    int capacity     = (list->capacity) ? list->capacity * 2 : 256;
+    BatchFile *files = (BatchFile *)realloc (list->files, sizeof (BatchFile) * capacity);
+    if (files == NULL)
+    {
+      ms_log (2, "Cannot allocate batch file list\n");
+      return -1;
+    }
+    list->files    = files;
+    list->capacity = capacity;
+  }
+
+  list->files[list->numfiles].path = strdup (path);
+  list->files[list->numfiles].size = size;
+  list->files[list->numfiles].rv   = 0;
+  list->files[list->numfiles].skipped = 0;
+  if (list->files[list->numfiles].path == NULL)
+  {
+    ms_log (2, "Cannot allocate batch file path\n");
+    return -1;
+  }
+  list->numfiles++;
+
+  return 0;
+}
+
+/* Collect every regular file below a directory, e.g. an SDS archive laid
+ * out as YEAR/NET/STA/CHAN.D/NET.STA.LOC.CHAN.D.YEAR.DAY */
+static int
+walkDirectory (const char *directory, BatchFileList *list)
+{
+  DIR *dir = opendir (directory);
+  struct dirent *entry;
+  struct stat sb;
+  char *path;
+  int rv = 0;
+
+  if (dir == NULL)
+  {
+    ms_log (2, "Cannot open directory %s: %s\n", directory, strerror (errno));
+    return -1;
+  }
+
+  while (rv == 0 && (entry = readdir (dir)) != NULL)
+  {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    path = (char *)malloc (strlen (directory) + strlen (entry->d_name) + 2);
+    if (path == NULL)
+    {
+      ms_log (2, "Cannot allocate path\n");
+      rv = -1;
+      break;
+    }
+    sprintf (path, "%s/%s", directory, entry->d_name);
+
+    if (lstat (path, &sb))
+      ms_log (1, "Cannot stat %s: %s\n", path, strerror (errno));
+    else if (S_ISDIR (sb.st_mode))
+      rv = walkDirectory (path, list);
+    else if (S_ISREG (sb.st_mode))
+      rv = addBatchFile (list, path, sb.st_size);
+
+    free (path);
+  }
+  closedir (dir);
+
+  return rv;
+}
+
+/* Read one path per line, skipping blank lines and '#' comments */
+static int
+readFileList (const char *listfile, BatchFileList *list)
+{
+  FILE *file = fopen (listfile, "r");
+  char line[4096];
+  struct stat sb;
+  size_t len;
+  int rv = 0;
+
+  if (file == NULL)
+  {
+    ms_log (2, "Cannot open file list %s: %s\n", listfile, strerror (errno));
+    return -1;
+  }
+
+  while (rv == 0 && fgets (line, sizeof (line), file))
+  {
+    len = strlen (line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+      line[--len] = '\0';
+    if (len == 0 || line[0] == '#')
+      continue;
+
+    if (stat (line, &sb) || !S_ISREG (sb.st_mode))
+      ms_log (1, "Skipping %s: not a readable file\n", line);
+    else
+      rv = addBatchFile (list, line, sb.st_size);
+  }
+  fclose (file);
+
+  return rv;
+}
+
+/* Largest files first */
+static int
+compareBatchFiles (const void *a, const void *b)
+{
+  const BatchFile *fa = *(const BatchFile **)a;
+  const BatchFile *fb = *(const BatchFile **)b;
+
+  return (fa->size < fb->size) - (fa->size > fb->size);
+}
+
+/* Shared by every worker of a batch run */
+typedef struct BatchContext
+{
+  TraverseConfig config;
+  Arena *arenas; /* One per worker, reused from file to file */
+} BatchContext;
+
+/* Whether a file starts with a miniSEED record. Archive trees also hold
+ * other files, our own outputs and indexes among them, which are
+ * skipped rather than failed. */
+static int
+isMiniSEEDFile (const char *path)
+{
+  char header[BATCHDETECTBYTES];
+  FILE *file = fopen (path, "rb");
+  size_t length;
+
+  if (file == NULL)
+    return 1; /* Reported when read */
+  length = fread (header, 1, sizeof (header), file);
+  fclose (file);
+
+  return length >= MINRECLEN && ms3_detect (header, length, NULL) >= 0;
+}
+
+static void
+processBatchFile (void *item, int worker, void *context)
+{
+  BatchFile *file          = (BatchFile *)item;
+  BatchContext *batch      = (BatchContext *)context;
+  const char *outputPrefix = strrchr (file->path, '/');
+
+  /* Outputs are named after the input file without its path */
+  outputPrefix = (outputPrefix) ? outputPrefix + 1 : file->path;
+
+  if (!isMiniSEEDFile (file->path))
+  {
+    file->skipped = 1;
+    return;
+  }
+  file->rv = traverseTimeWindow (file->path, outputPrefix, &batch->config, &batch->arenas[worker]);
+  resetArena (&batch->arenas[worker]);
+}
+
+/* Process every file of a directory tree or of a file list on a fixed
+ * pool of workers, then print a summary of the run */
+int
+runBatch (const char *source, const TraverseConfig *config, int numWorkers)
+{
+  BatchFileList list = {NULL, 0, 0};
+  BatchContext batch = {{0}, NULL};
+  BatchFile **items  = NULL;
+  WorkerStats *stats = NULL;
+  struct timespec begin, end;
+  struct stat sb;
+  int64_t totalBytes = 0;
+  int failed         = 0;
+  int skipped        = 0;
+  int rv             = 0;
+  int i;
+
+  if (stat (source, &sb))
+  {
+    ms_log (2, "Cannot stat %s: %s\n", source, strerror (errno));
+    return -1;
+  }
+  if (S_ISDIR (sb.st_mode))
+    rv = walkDirectory (source, &list);
+  else
+    rv = readFileList (source, &list);
+  if (rv == 0 && list.numfiles == 0)
+  {
+    ms_log (2, "No input files found in %s\n", source);
+    rv = -1;
+  }
+
+  if (numWorkers <= 0)
+    numWorkers = (int)sysconf (_SC_NPROCESSORS_ONLN);
+  if (numWorkers > list.numfiles)
+    numWorkers = list.numfiles;
+  if (numWorkers < 1)
+    numWorkers = 1;
+
+  items        = (BatchFile **)malloc (sizeof (BatchFile *) * (list.numfiles + 1));
+  stats        = (WorkerStats *)malloc (sizeof (WorkerStats) * numWorkers);
+  batch.arenas = (Arena *)malloc (sizeof (Arena) * numWorkers);
+  if (rv == 0 && (items == NULL || stats == NULL || batch.arenas == NULL))
+  {
+    ms_log (2, "Cannot allocate batch work items\n");
+    rv = -1;
+  }
+  for (i = 0; batch.arenas && i < numWorkers; i++)
+    initArena (&batch.arenas[i], ARENABLOCKSIZE);
+
+  if (rv == 0)
+  {
+    for (i = 0; i < list.numfiles; i++)
+    {
+      items[i] = &list.files[i];
+      totalBytes += list.files[i].size;
+    }
+    qsort (items, list.numfiles, sizeof (BatchFile *), compareBatchFiles);
+
+    /* Files already run in parallel, so each one uses a single thread */
+    batch.config            = *config;
+    batch.config.numThreads = 1;
+
+    clock_gettime (CLOCK_MONOTONIC, &begin);
+    rv = runWorkStealing ((void **)items, list.numfiles, numWorkers,
+                          processBatchFile, &batch, stats);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+  }
+
+  if (rv == 0)
+  {
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    for (i = 0; i < list.numfiles; i++)
+    {
+      if (list.files[i].rv)
+        failed++;
+      skipped += list.files[i].skipped;
+    }
+
+    printf ("Batch summary: %d files, %d succeeded, %d skipped, %d failed\n",
+            list.numfiles, list.numfiles - skipped - failed, skipped, failed);
+    printf ("  %.1lf MB read in %.3lf s (%.1lf MB/s, %.1lf files/s) on %d workers\n",
+            totalBytes / 1e6, seconds, (seconds > 0) ? totalBytes / 1e6 / seconds : 0.0,
+            (seconds > 0) ? list.numfiles / seconds : 0.0, numWorkers);
+    for (i = 0; i < numWorkers; i++)
+      printf ("  worker %d: %" PRId64 " files, %" PRId64 " stolen\n",
+              i, stats[i].processed, stats[i].stolen);
+    for (i = 0; i < list.numfiles; i++)
+    {
+      if (list.files[i].rv)
+        printf ("  failed: %s\n", list.files[i].path);
+    }
+
+    if (failed)
+      rv = -1;
+  }
+
+  for (i = 0; i < list.numfiles; i++)
+    free (list.files[i].path);
+  free (list.files);
+  for (i = 0; batch.arenas && i < numWorkers; i++)
+    freeArena (&batch.arenas[i]);
+  free (batch.arenas);
+  free (items);
+  free (stats);
+
+  return rv;
+}
@@ -0,0 +1,8 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "traverse.h"
+
+int runBatch (const char *source, const TraverseConfig *config, int numWorkers);
+
+#endif
@@ -0,0 +1,314 @@
+/* Time traverseTimeWindow() over miniSEED files and the statistics
+ * kernels over synthetic samples. Every result is printed as one JSON
+ * object per line. Build and run with `make bench`. */
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmseed.h"
+
+#include "arena.h"
+#include "rms_reader.h"
+#include "sample_store.h"
+#include "stats_kernel.h"
+#include "traverse.h"
+#include "window_writer.h"
+
+/* Samples per kernel pass, large enough to leave the caches */
+#define KERNELSAMPLES 16777216
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+usage (const char *name)
+{
+  printf ("Usage: %s [-w size:overlap[,size:overlap...]] [-f r|b] [-j threads]\n"
+          "          [-n repeats] [-k] [-o output directory] [mseedfile ...]\n\n"
+          " -w  window settings to time, default 60:0,60:50,600:0\n"
+          " -f  output format written while timing, r (.rms) or b (.rmsb)\n"
+          " -j  worker threads, default one per CPU\n"
+          " -n  runs of each setting, the fastest one is reported\n"
+          " -k  also time the statistics kernels\n"
+          " -o  scratch directory for the outputs, default bench\n",
+          name);
+}
+
+/* Samples of a file, counted from its sample store */
+static int64_t
+countSamples (const char *mseedfile)
+{
+  SampleStore store;
+  Arena arena;
+  int64_t samples = 0;
+  int t;
+
+  initArena (&arena, ARENABLOCKSIZE);
+  if (loadSampleStore (mseedfile, &store, MSF_VALIDATECRC, NULL, 0, &arena, 0))
+  {
+    freeArena (&arena);
+    return -1;
+  }
+  for (t = 0; t < store.numtraces; t++)
+    samples += store.traces[t].numsamples;
+  freeSampleStore (&store);
+  freeArena (&arena);
+
+  return samples;
+}
+
+/* Windows written to the outputs starting with prefix, which are then
+ * removed. .rms files hold one header line and one line per window. */
+static int64_t
+collectWindows (const char *directory, const char *prefix)
+{
+  char path[1024];
+  struct dirent *entry;
+  int64_t windows = 0;
+  DIR *dir;
+
+  if ((dir = opendir (directory)) == NULL)
+    return -1;
+  while ((entry = readdir (dir)))
+  {
+    const char *extension = strrchr (entry->d_name, '.');
+
+    if (strncmp (entry->d_name, prefix, strlen (prefix)) || extension == NULL)
+      continue;
+    snprintf (path, sizeof (path), "%s/%s", directory, entry->d_name);
+
+    if (strcmp (extension, ".rmsb") == 0)
+    {
+      RMSReader reader;
+      if (openRMSReader (&reader, path) == 0)
+      {
+        windows += reader.numwindows;
+        closeRMSReader (&reader);
+      }
+    }
+    else if (strcmp (extension, ".rms") == 0)
+    {
+      FILE *file = fopen (path, "r");
+      int64_t lines = 0;
+      int ch;
+
+      if (file)
+      {
+        while ((ch = getc (file)) != EOF)
+          lines += (ch == '\n');
+        fclose (file);
+        windows += (lines > 0) ? lines - 1 : 0;
+      }
+    }
+    unlink (path);
+  }
+  closedir (dir);
+
+  return windows;
+}
+
+static int
+benchFile (const char *mseedfile, const char *directory, TraverseConfig *config,
+           const int *sizes, const int *overlaps, int numsettings, int repeats, Arena *arena)
+{
+  char prefix[1024];
+  struct stat st;
+  int64_t samples, windows = 0;
+  double megabytes;
+  int s, r;
+
+  if (stat (mseedfile, &st) || (samples = countSamples (mseedfile)) < 0)
+  {
+    ms_log (2, "Cannot read %s\n", mseedfile);
+    return -1;
+  }
+  megabytes = st.st_size / 1048576.0;
+  snprintf (prefix, sizeof (prefix), "%s/benchout", directory);
+
+  for (s = 0; s < numsettings; s++)
+  {
+    double best = -1.0;
+
+    config->windowSize    = sizes[s];
+    config->windowOverlap = overlaps[s];
+    for (r = 0; r < repeats; r++)
+    {
+      double start = now ();
+      double elapsed;
+
+      if (traverseTimeWindow (mseedfile, prefix, config, arena))
+      {
+        ms_log (2, "traverseTimeWindow() failed on %s\n", mseedfile);
+        return -1;
+      }
+      elapsed = now () - start;
+      resetArena (arena);
+      windows = collectWindows (directory, "benchout");
+      if (best < 0.0 || elapsed < best)
+        best = elapsed;
+    }
+
+    printf ("{\"bench\":\"traverse\",\"file\":\"%s\",\"bytes\":%lld,\"samples\":%" PRId64 ","
+            "\"window\":%d,\"overlap\":%d,\"format\":\"%s\",\"threads\":%d,"
+            "\"windows\":%" PRId64 ",\"seconds\":%.6f,\"windows_per_s\":%.1f,"
+            "\"samples_per_s\":%.1f,\"mb_per_s\":%.2f}\n",
+            mseedfile, (long long)st.st_size, samples, sizes[s], overlaps[s],
+            (config->outputFormatFlag & OUTPUTBINARY) ? "b" : "r", config->numThreads,
+            windows, best, windows / best, samples / best, megabytes / best);
+    fflush (stdout);
+  }
+
+  return 0;
+}
+
+/* Time one full pass of the kernel over each sample type */
+static void
+benchKernels (int repeats)
+{
+  static const char types[] = {'i', 'f', 'd'};
+  void *samples = malloc ((size_t)KERNELSAMPLES * sizeof (double));
+  KernelSums sums;
+  int64_t i;
+  int t, r;
+
+  if (samples == NULL)
+  {
+    ms_log (2, "Cannot allocate kernel samples\n");
+    return;
+  }
+
+  for (t = 0; t < 3; t++)
+  {
+    size_t samplesize = (types[t] == 'd') ? sizeof (double) : 4;
+    double best       = -1.0;
+
+    for (i = 0; i < KERNELSAMPLES; i++)
+    {
+      int32_t value = 20000 + rand () % 2000 - 1000;
+      if (types[t] == 'i')
+        ((int32_t *)samples)[i] = value;
+      else if (types[t] == 'f')
+        ((float *)samples)[i] = value * 0.37f;
+      else
+        ((double *)samples)[i] = value * 0.37;
+    }
+
+    for (r = 0; r < repeats; r++)
+    {
+      double start = now ();
+      double elapsed;
+
+      sumSamples (samples, types[t], KERNELSAMPLES, 20000.0, &sums);
+      elapsed = now () - start;
+      if (best < 0.0 || elapsed < best)
+        best = elapsed;
+    }
+
+    printf ("{\"bench\":\"kernel\",\"kernel\":\"%s\",\"sampletype\":\"%c\",\"samples\":%d,"
+            "\"seconds\":%.6f,\"samples_per_s\":%.1f,\"mb_per_s\":%.2f,\"check\":%g}\n",
+            statsKernelName (), types[t], KERNELSAMPLES, best, KERNELSAMPLES / best,
+            KERNELSAMPLES * samplesize / 1048576.0 / best, sums.max);
+    fflush (stdout);
+  }
+
+  free (samples);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *settings  = "60:0,60:50,600:0";
+  const char *directory = "bench";
+  int sizes[64];
+  int overlaps[64];
+  int numsettings = 0;
+  int repeats     = 3;
+  int kernels     = 0;
+  int rv          = 0;
+  TraverseConfig config;
+  Arena arena;
+  const char *setting;
+  int option;
+  int i;
+
+  installArenaHooks ();
+
+  config.outputFormatFlag = OUTPUTRMS;
+  config.numThreads       = 0;
+  config.sink             = NULL;
+  config.windowSpecs      = NULL;
+  config.numWindowSpecs   = 0;
+  config.selections       = NULL;
+  config.percentiles      = NULL;
+  config.numPercentiles   = 0;
+
+  while ((option = getopt (argc, argv, "w:f:j:n:ko:")) != -1)
+  {
+    switch (option)
+    {
+    case 'w':
+      settings = optarg;
+      break;
+    case 'f':
+      config.outputFormatFlag = (optarg[0] == 'b') ? OUTPUTBINARY : OUTPUTRMS;
+      break;
+    case 'j':
+      config.numThreads = atoi (optarg);
+      break;
+    case 'n':
+      repeats = atoi (optarg);
+      break;
+    case 'k':
+      kernels = 1;
+      break;
+    case 'o':
+      directory = optarg;
+      break;
+    default:
+      usage (argv[0]);
+      return -1;
+    }
+  }
+  if (repeats < 1)
+    repeats = 1;
+
+  /* Parse "size:overlap,size:overlap,..." */
+  for (setting = settings; *setting && numsettings < 64;)
+  {
+    if (sscanf (setting, "%d:%d", &sizes[numsettings], &overlaps[numsettings]) != 2 ||
+        sizes[numsettings] <= 0 || overlaps[numsettings] < 0 || overlaps[numsettings] >= 100)
+    {
+      usage (argv[0]);
+      return -1;
+    }
+    numsettings++;
+    setting = strchr (setting, ',');
+    if (setting == NULL)
+      break;
+    setting++;
+  }
+
+  if (kernels)
+    benchKernels (repeats);
+
+  initArena (&arena, ARENABLOCKSIZE);
+  for (i = optind; i < argc; i++)
+  {
+    if (benchFile (argv[i], directory, &config, sizes, overlaps, numsettings, repeats, &arena))
+      rv = -1;
+  }
+  freeArena (&arena);
+
+  return rv;
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Batch run over a generated tree holding, next to its miniSEED files,
+# every kind of file ms2rms writes there (record indexes, incremental
+# state and each output format) and a few others. Batch mode must only
+# read the miniSEED files and skip the rest, on a second run over its
+# own outputs as well.
+#
+# Then incremental runs over a file growing in parts, the last of them
+# with --final, must write the same outputs as a run over the whole file,
+# for a single channel and for several ones. mseedgen writes channels one
+# after the other, so the first parts of the latter hold a single one.
+set -e
+
+cd "$(dirname "$0")"
+MS2RMS=$(pwd)/../ms2rms
+TREE=data/check
+
+rm -rf "$TREE"
+mkdir -p "$TREE/XX/B000"
+./mseedgen -d 3600 -r 20 "$TREE/XX/B000/a.mseed" >/dev/null
+./mseedgen -d 3600 -r 20 -c 3 -s 2 "$TREE/XX/b.mseed" >/dev/null
+
+(
+  cd "$TREE/XX/B000"
+  "$MS2RMS" -x a.mseed
+  "$MS2RMS" a.mseed 60 0 abn
+  "$MS2RMS" a.mseed 60 0 az
+  "$MS2RMS" -i a.mseed 600 0 r
+  # As left by a run interrupted while saving its state
+  cp a.mseed.state a.mseed.state.tmp
+) >/dev/null
+(cd "$TREE/XX" && "$MS2RMS" -x b.mseed) >/dev/null
+echo "Archive of station B000" >"$TREE/README"
+: >"$TREE/XX/B000/.lock"
+: >"$TREE/XX/b.mseed.lock"
+
+for run in 1 2; do
+  (cd "$TREE" && "$MS2RMS" -b . 60 0 abnz) >"$TREE/../check.log"
+  if ! grep -q "Batch summary: .* files, 2 succeeded, .* skipped, 0 failed" "$TREE/../check.log"; then
+    cat "$TREE/../check.log"
+    echo "batch check FAILED on run $run"
+    exit 1
+  fi
+done
+echo "batch check passed"
+
+INCR=data/incr
+rm -rf "$INCR"
+mkdir -p "$INCR"
+./mseedgen -d 7200 -r 20 "$INCR/single.mseed" >/dev/null
+./mseedgen -d 7200 -r 20 -c 3 "$INCR/multi.mseed" >/dev/null
+
+for input in single multi; do
+  rm -rf "$INCR/full" "$INCR/parts"
+  mkdir "$INCR/full" "$INCR/parts"
+  cp "$INCR/$input.mseed" "$INCR/full/x.mseed"
+  (cd "$INCR/full" && "$MS2RMS" x.mseed 60 50 a) >/dev/null
+  size=$(wc -c <"$INCR/$input.mseed")
+  # Cut anywhere, records included: a partial one waits for the next run
+  for tenths in 1 3 5 8; do
+    head -c $((size * tenths / 10)) "$INCR/$input.mseed" >"$INCR/parts/x.mseed"
+    (cd "$INCR/parts" && "$MS2RMS" -i x.mseed 60 50 a) >/dev/null
+  done
+  cp "$INCR/$input.mseed" "$INCR/parts/x.mseed"
+  (cd "$INCR/parts" && "$MS2RMS" -i --final x.mseed 60 50 a) >/dev/null
+  rm "$INCR/full/x.mseed" "$INCR/parts/x.mseed"
+  if ! diff -r "$INCR/full" "$INCR/parts"; then
+    echo "incremental check FAILED on $input.mseed"
+    exit 1
+  fi
+done
+echo "incremental check passed"
@@ -0,0 +1,210 @@
+/* Write a synthetic miniSEED file for benchmarking: a sine wave with
+ * noise for each channel, packed with libmseed in the chosen encoding,
+ * with optional gaps. Build with `make bench`. */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libmseed.h"
+
+static const struct
+{
+  const char *name;
+  uint8_t encoding;
+} encodings[] = {
+    {"int32", DE_INT32},
+    {"steim1", DE_STEIM1},
+    {"steim2", DE_STEIM2},
+    {"float32", DE_FLOAT32},
+    {"float64", DE_FLOAT64},
+};
+
+static void
+usage (const char *name)
+{
+  printf ("Usage: %s [-r samprate] [-e int32|steim1|steim2|float32|float64]\n"
+          "          [-c channels] [-d seconds] [-g gaps per hour] [-G gap seconds]\n"
+          "          [-l record length] [-s seed] <output miniSEED file>\n",
+          name);
+}
+
+static void
+writeRecord (char *record, int reclen, void *handlerdata)
+{
+  if (fwrite (record, reclen, 1, (FILE *)handlerdata) != 1)
+    ms_log (2, "Cannot write record\n");
+}
+
+/* Pack samples [first, first + count) of one channel starting at time */
+static int
+packSamples (MS3Record *msr, FILE *file, nstime_t time, int64_t first, int64_t count,
+             int channel, char sampletype)
+{
+  int64_t i;
+
+  msr->datasamples = malloc ((size_t)count * ((sampletype == 'd') ? 8 : 4));
+  if (msr->datasamples == NULL)
+  {
+    ms_log (2, "Cannot allocate %lld samples\n", (long long)count);
+    return -1;
+  }
+  for (i = 0; i < count; i++)
+  {
+    double x = 1000.0 * sin ((first + i) * 0.01 + channel) + (rand () % 200) - 100 + 20000.0;
+
+    if (sampletype == 'i')
+      ((int32_t *)msr->datasamples)[i] = (int32_t)x;
+    else if (sampletype == 'f')
+      ((float *)msr->datasamples)[i] = (float)(x * 0.37);
+    else
+      ((double *)msr->datasamples)[i] = x * 0.37;
+  }
+  msr->numsamples = count;
+  msr->samplecnt  = count;
+  msr->sampletype = sampletype;
+  msr->starttime  = time;
+
+  if (msr3_pack (msr, writeRecord, file, NULL, MSF_FLUSHDATA, 0) < 0)
+  {
+    ms_log (2, "Cannot pack records of %s\n", msr->sid);
+    free (msr->datasamples);
+    msr->datasamples = NULL;
+    return -1;
+  }
+  free (msr->datasamples);
+  msr->datasamples = NULL;
+
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  double samprate     = 100.0;
+  double seconds      = 86400.0;
+  double gapsPerHour  = 0.0;
+  double gapSeconds   = 10.0;
+  int numChannels     = 1;
+  int reclen          = 4096;
+  unsigned int seed   = 1;
+  uint8_t encoding    = DE_STEIM2;
+  const char *outfile = NULL;
+  uint8_t samplesize;
+  char sampletype;
+  FILE *file;
+  int option;
+  int c, i;
+
+  while ((option = getopt (argc, argv, "r:e:c:d:g:G:l:s:")) != -1)
+  {
+    switch (option)
+    {
+    case 'r':
+      samprate = atof (optarg);
+      break;
+    case 'e':
+      for (i = 0; i < (int)(sizeof (encodings) / sizeof (encodings[0])); i++)
+      {
+        if (strcmp (optarg, encodings[i].name) == 0)
+          break;
+      }
+      if (i == (int)(sizeof (encodings) / sizeof (encodings[0])))
+      {
+        usage (argv[0]);
+        return -1;
+      }
+      encoding = encodings[i].encoding;
+      break;
+    case 'c':
+      numChannels = atoi (optarg);
+      break;
+    case 'd':
+      seconds = atof (optarg);
+      break;
+    case 'g':
+      gapsPerHour = atof (optarg);
+      break;
+    case 'G':
+      gapSeconds = atof (optarg);
+      break;
+    case 'l':
+      reclen = atoi (optarg);
+      break;
+    case 's':
+      seed = (unsigned int)atoi (optarg);
+      break;
+    default:
+      usage (argv[0]);
+      return -1;
+    }
+  }
+  if (argc - optind != 1 || samprate <= 0.0 || seconds <= 0.0 || numChannels < 1)
+  {
+    usage (argv[0]);
+    return -1;
+  }
+  outfile = argv[optind];
+
+  if (ms_encoding_sizetype (encoding, &samplesize, &sampletype))
+  {
+    ms_log (2, "Unsupported encoding %d\n", encoding);
+    return -1;
+  }
+  if ((file = fopen (outfile, "wb")) == NULL)
+  {
+    ms_log (2, "Cannot open %s\n", outfile);
+    return -1;
+  }
+  srand (seed);
+
+  for (c = 0; c < numChannels; c++)
+  {
+    MS3Record *msr = msr3_init (NULL);
+    int64_t total  = (int64_t)(seconds * samprate);
+    int64_t done   = 0;
+    /* Samples between gaps, the whole channel when there are none */
+    int64_t run    = (gapsPerHour > 0.0) ? (int64_t)(3600.0 / gapsPerHour * samprate) : total;
+    nstime_t time  = ms_time2nstime (2020, 35, 0, 0, 0, 0);
+    char station[11];
+
+    if (msr == NULL)
+    {
+      fclose (file);
+      return -1;
+    }
+    snprintf (station, sizeof (station), "B%03d", c / 3);
+    ms_nslc2sid (msr->sid, LM_SIDLEN, 0, "XX", station, "00", (c % 3 == 0) ? "HHZ" : (c % 3 == 1) ? "HHN" : "HHE");
+    msr->samprate      = samprate;
+    msr->encoding      = encoding;
+    msr->reclen        = reclen;
+    msr->formatversion = 2;
+    msr->pubversion    = 1;
+
+    if (run < 1)
+      run = 1;
+    while (done < total)
+    {
+      int64_t count = (run < total - done) ? run : total - done;
+
+      if (packSamples (msr, file, time, done, count, c, sampletype))
+      {
+        msr3_free (&msr);
+        fclose (file);
+        return -1;
+      }
+      done += count;
+      time = ms_sampletime (time, count, samprate) + (nstime_t)(gapSeconds * NSTMODULUS);
+    }
+    msr3_free (&msr);
+  }
+
+  if (fclose (file))
+  {
+    ms_log (2, "Cannot write %s\n", outfile);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Generate the benchmark files once, then time every file with each
+# window setting and the statistics kernels. Results are printed as one
+# JSON object per line and kept in bench/results.jsonl.
+#
+# Settings can be overridden from the environment, e.g.
+#   BENCH_WINDOWS=1:0,60:90 BENCH_REPEATS=5 make bench
+set -e
+
+cd "$(dirname "$0")"
+WINDOWS=${BENCH_WINDOWS:-60:0,60:50,600:0}
+REPEATS=${BENCH_REPEATS:-3}
+THREADS=${BENCH_THREADS:-0}
+DURATION=${BENCH_DURATION:-86400}
+
+mkdir -p data
+generate () {
+  name=$1
+  shift
+  [ -f data/$name.mseed ] || ./mseedgen -d "$DURATION" "$@" data/$name.mseed
+}
+
+# Name                 Options
+generate steim2_100    -e steim2 -r 100
+generate steim1_100    -e steim1 -r 100
+generate int32_100     -e int32 -r 100
+generate float32_100   -e float32 -r 100
+generate float64_100   -e float64 -r 100
+generate steim2_20_3ch -e steim2 -r 20 -c 3
+generate steim2_gaps   -e steim2 -r 100 -g 6 -G 30
+generate steim2_500    -e steim2 -r 500
+
+./bench -k -w "$WINDOWS" -n "$REPEATS" -j "$THREADS" -o data data/*.mseed | tee results.jsonl
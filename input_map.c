@@ -0,0 +1,80 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libmseed.h"
+
+#include "input_map.h"
+
+/* Map a regular file so its records can be parsed in place.
+ * Returns 0 on success, 1 when the path is not a regular file (stdin,
+ * pipes, devices) and must be read through stdio instead, -1 on error. */
+int
+openInputMap (const char *path, InputMap *map)
+{
+  struct stat sb;
+  void *buffer;
+
+  memset (map, 0, sizeof (InputMap));
+  map->fd = -1;
+
+  if (strcmp (path, "-") == 0)
+    return 1;
+  if (stat (path, &sb))
+  {
+    ms_log (2, "Error stating file %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+  if (!S_ISREG (sb.st_mode))
+    return 1;
+  if (sb.st_size == 0)
+  {
+    ms_log (2, "File %s is empty\n", path);
+    return -1;
+  }
+
+  if ((map->fd = open (path, O_RDONLY)) < 0)
+  {
+    ms_log (2, "Error opening file %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+
+  buffer = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+  if (buffer == MAP_FAILED)
+  {
+    ms_log (2, "Error mapping file %s: %s\n", path, strerror (errno));
+    close (map->fd);
+    map->fd = -1;
+    return -1;
+  }
+
+  /* Records are parsed front to back exactly once */
+  madvise (buffer, sb.st_size, MADV_SEQUENTIAL);
+  madvise (buffer, sb.st_size, MADV_WILLNEED);
+
+  map->buffer = (const char *)buffer;
+  map->length = sb.st_size;
+
+  return 0;
+}
+
+void
+closeInputMap (InputMap *map)
+{
+  if (map->buffer)
+    munmap ((void *)map->buffer, map->length);
+
+  /* Archive files are read once per run, do not let them crowd the
+   * page cache for the files still to come */
+  if (map->fd >= 0)
+  {
+    posix_fadvise (map->fd, 0, 0, POSIX_FADV_DONTNEED);
+    close (map->fd);
+  }
+
+  memset (map, 0, sizeof (InputMap));
+  map->fd = -1;
+}
@@ -0,0 +1,17 @@
+#ifndef INPUT_MAP_H
+#define INPUT_MAP_H
+
+#include <stdint.h>
+
+/* A whole input file mapped read-only into memory */
+typedef struct InputMap
+{
+  int fd;
+  const char *buffer;
+  uint64_t length;
+} InputMap;
+
+int openInputMap (const char *path, InputMap *map);
+void closeInputMap (InputMap *map);
+
+#endif
@@ -1,51 +1,329 @@
+#include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
+#include "batch.h"
+#include "pipeline.h"
+#include "quantile_sketch.h"
+#include "record_index.h"
+#include "running_stats.h"
+#include "server.h"
+#include "stage_stats.h"
+#include "stats_kernel.h"
+#include "stream.h"
 #include "traverse.h"
+#include "window_writer.h"
 
 static void
 usage ()
 {
-  printf ("Usage: ./ms2rms [mseedfile] [time window size] [window overlap] [a|r|j]\n\n");
+  printf ("Usage: ./ms2rms [-b|-s|-f|-p|-i [--final]] [-j threads] [-q percentiles] [-T] [--stats[=file]] [selections] [mseedfile] [time window size] [window overlap] [a|r|j|b|n|z]\n");
+  printf ("       ./ms2rms [-b] [-j threads] [-q percentiles] [selections] -w size:overlap[,size:overlap...] [mseedfile] [a|r|j|b|n|z]\n");
+  printf ("       ./ms2rms -x [mseedfile]\n");
+  printf ("       ./ms2rms --serve socket [-j workers] [--stats[=file]]\n\n");
   printf ("## Options ##\n"
-          " mseedfile         input miniSEED file\n"
+          " -b                batch mode, mseedfile is a directory (e.g. an SDS\n"
+          "                   archive) walked recursively or a file listing one\n"
+          "                   input path per line\n"
+          " -s                streaming mode, read records incrementally and write\n"
+          "                   each window as soon as it is complete\n"
+          " -f                streaming mode following a growing file, waiting\n"
+          "                   for new records until interrupted\n"
+          " -p                pipelined streaming mode, reading, parsing, decoding,\n"
+          "                   window statistics and writing each on a thread of\n"
+          "                   their own, for inputs on slow storage or pipes\n"
+          " -i                incremental mode for a growing file, processing only\n"
+          "                   the records appended since the last run and adding\n"
+          "                   the windows completed since to the text outputs,\n"
+          "                   with the progress kept in <mseedfile>.state\n"
+          " --final           with -i, also write the windows still open and\n"
+          "                   remove the state file, once the file is complete\n"
+          " -x                write the record index <mseedfile>.idx used to read\n"
+          "                   time ranges of the file without scanning it, and exit\n"
+          " -w size:overlap   a window setting in place of the window size and\n"
+          "                   overlap arguments, repeated or separated by commas;\n"
+          "                   several settings share one decoding pass and each\n"
+          "                   one is written to <output>.<size>_<overlap>.rms etc.\n"
+          " --serve socket    answer RMS jobs sent to a Unix domain socket until\n"
+          "                   interrupted, on a pool of -j workers (see README)\n"
+          " --select file     process only the records and time ranges listed in a\n"
+          "                   libmseed selection file, lines of\n"
+          "                   <source ID pattern> [start time] [end time]\n"
+          " --sid pattern     process only the source IDs matching a glob pattern\n"
+          " --start time      process only the samples at or after a time, e.g.\n"
+          "                   2020-02-04T00:00:00\n"
+          " --end time        process only the samples before a time\n"
+          "                   Selections are matched against the fixed headers,\n"
+          "                   records outside them are neither CRC checked nor\n"
+          "                   decoded\n"
+          " -q p[,p...]       also write these percentiles of each window, e.g.\n"
+          "                   5,50,95, after the other columns of the text\n"
+          "                   outputs; approximated by mergeable sketches, up\n"
+          "                   to 8 of them and not with -s, -f, -p or -i\n"
+          " -j threads        number of worker threads, default one per CPU\n"
+          " -T                check the statistics kernels of this CPU against\n"
+          "                   the two pass reference and the percentile sketches\n"
+          "                   against exact ranks, and exit\n"
+          " --stats[=file]    report the time spent in each stage (read, parse,\n"
+          "                   crc, decode, convert, stats, format, write), counters\n"
+          "                   and peak RSS to stderr, or as JSON to the given file\n"
+          " mseedfile         input miniSEED file, - for stdin\n"
           " time window size  desired time window size, measured in seconds\n"
           "                   and the value should always bigger than 0\n"
           " window overlap    overlap percentage between each window\n"
           "                   and the value should always samller than 100\n"
-          " a|r|j             output format indicator\n"
-          "                   the flag is described as follows:\n"
-          "                   a: all (rms and json)\n"
-          "                   r: only rms\n"
-          "                   j: only json\n");
+          " a|r|j|b|n|z       output format indicator, letters may be combined\n"
+          "                   (e.g. rb), the flags are described as follows:\n"
+          "                   a: all text formats (rms and json)\n"
+          "                   r: rms\n"
+          "                   j: json\n"
+          "                   b: rmsb, binary columns (see rms_reader.h)\n"
+          "                   n: npy, NumPy structured array\n"
+          "                   z: gzip the text formats, .rms.gz and .json.gz\n");
+  printf ("\nFiles holding several channels are written to one output per channel,\n"
+          "named <mseedfile>.<network>.<station>.<location>.<channel>.rms/.json\n");
   printf ("\nOutput format (rms): \n");
   printf ("\
 <time stamp of the first window>,<station>,<network>,<channel>,<location>,<CR><LF>\n\
-<time difference between this window to the first window>,<mean>,<SD>,<min>,<max>,<minDemean>,<maxDemean>,<CR><LF>\n\
-<time difference between this window to the first window>,<mean>,<SD>,<min>,<max>,<minDemean>,<maxDemean>,<CR><LF>\n\
+<time difference between this window to the first window>,<mean>,<SD>,<min>,<max>,<minDemean>,<maxDemean>[,<percentile>...],<CR><LF>\n\
+<time difference between this window to the first window>,<mean>,<SD>,<min>,<max>,<minDemean>,<maxDemean>[,<percentile>...],<CR><LF>\n\
 ...  \
 \n");
 }
 
+/* Selections of the --select file and the --sid, --start and --end
+ * options, which add one more selection. Left NULL without any. */
+static int
+makeSelections (MS3Selections **selections, const char *selectFile, const char *sidPattern,
+                const char *startTime, const char *endTime)
+{
+  nstime_t start = NSTUNSET;
+  nstime_t end   = NSTUNSET;
+
+  *selections = NULL;
+  if (selectFile && ms3_readselectionsfile (selections, selectFile) < 0)
+  {
+    printf ("Cannot read selection file %s\n", selectFile);
+    return -1;
+  }
+  if (sidPattern == NULL && startTime == NULL && endTime == NULL)
+    return 0;
+
+  if ((startTime && (start = ms_timestr2nstime (startTime)) == NSTERROR) ||
+      (endTime && (end = ms_timestr2nstime (endTime)) == NSTERROR))
+  {
+    printf ("Cannot parse the selection times\n");
+    return -1;
+  }
+  if (ms3_addselect (selections, (sidPattern) ? sidPattern : "*", start, end, 0))
+  {
+    printf ("Cannot add selection\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Write the sidecar record index of a file, see record_index.h */
+static int
+writeIndexFile (const char *mseedfile)
+{
+  RecordIndex index;
+  int rv;
+
+  if (buildRecordIndex (mseedfile, &index))
+    return -1;
+  rv = writeRecordIndex (mseedfile, &index);
+  printf ("%s: %" PRId64 " records of %d source IDs indexed\n", mseedfile, index.numrecords, index.numtraces);
+  freeRecordIndex (&index);
+
+  return rv;
+}
+
 int
 main (int argc, char **argv)
 {
   char *mseedfile = NULL;
   int windowSize;
   int windowOverlap;
-  char *outputFileRMS;
-  char *outputFileJSON;
-  const char *RMSExtension  = ".rms";
-  const char *JSONExtension = ".json";
-  int outputFormatFlag;
+  int outputFormatFlag   = 0;
+  int batchMode          = 0;
+  int streamMode         = 0;
+  int followMode         = 0;
+  int pipelineMode       = 0;
+  int incrementalMode    = 0;
+  int finalRun           = 0;
+  int indexMode          = 0;
+  int numWindowSpecs     = 0;
+  int numPercentiles     = 0;
+  int numThreads         = 0;
+  int reportStats        = 0;
+  const char *statsFile  = NULL;
+  const char *socketPath = NULL;
+  const char *selectFile = NULL;
+  const char *sidPattern = NULL;
+  const char *startTime  = NULL;
+  const char *endTime    = NULL;
+  MS3Selections *selections;
+  WindowSpec windowSpecs[MAXWINDOWSPECS];
+  double percentiles[MAXPERCENTILES];
+  int option;
+  TraverseConfig config;
+  static const struct option longOptions[] = {
+      {"stats", optional_argument, NULL, 'S'},
+      {"final", no_argument, NULL, 'F'},
+      {"serve", required_argument, NULL, 'D'},
+      {"select", required_argument, NULL, 'L'},
+      {"sid", required_argument, NULL, 'I'},
+      {"start", required_argument, NULL, 'A'},
+      {"end", required_argument, NULL, 'E'},
+      {NULL, 0, NULL, 0}};
+
+  /* libmseed allocates through the arena hooks from the start */
+  installArenaHooks ();
 
   /* Simplistic argument parsing */
-  if (argc != 5)
+  while ((option = getopt_long (argc, argv, "bsfpixw:q:j:T", longOptions, NULL)) != -1)
+  {
+    switch (option)
+    {
+    case 'S':
+      reportStats = 1;
+      statsFile   = optarg;
+      break;
+    case 'b':
+      batchMode = 1;
+      break;
+    case 's':
+      streamMode = 1;
+      break;
+    case 'f':
+      streamMode = 1;
+      followMode = 1;
+      break;
+    case 'p':
+      pipelineMode = 1;
+      break;
+    case 'i':
+      incrementalMode = 1;
+      break;
+    case 'F':
+      finalRun = 1;
+      break;
+    case 'D':
+      socketPath = optarg;
+      break;
+    case 'x':
+      indexMode = 1;
+      break;
+    case 'L':
+      selectFile = optarg;
+      break;
+    case 'I':
+      sidPattern = optarg;
+      break;
+    case 'A':
+      startTime = optarg;
+      break;
+    case 'E':
+      endTime = optarg;
+      break;
+    case 'w':
+      /* size:overlap, repeated or separated by commas */
+      for (const char *setting = optarg; setting; setting = strchr (setting, ','))
+      {
+        if (*setting == ',')
+          setting++;
+        if (numWindowSpecs == MAXWINDOWSPECS ||
+            sscanf (setting, "%d:%d", &windowSpecs[numWindowSpecs].windowSize,
+                    &windowSpecs[numWindowSpecs].windowOverlap) != 2)
+        {
+          usage ();
+          return -1;
+        }
+        numWindowSpecs++;
+      }
+      break;
+    case 'q':
+      /* Percentiles separated by commas */
+      for (const char *value = optarg; value; value = strchr (value, ','))
+      {
+        char *end;
+
+        if (*value == ',')
+          value++;
+        if (numPercentiles == MAXPERCENTILES)
+        {
+          usage ();
+          return -1;
+        }
+        percentiles[numPercentiles] = strtod (value, &end);
+        if (end == value || (*end != ',' && *end != '\0') ||
+            percentiles[numPercentiles] <= 0 || percentiles[numPercentiles] >= 100)
+        {
+          printf ("Percentiles should be numbers between 0 and 100\n");
+          return -1;
+        }
+        numPercentiles++;
+      }
+      break;
+    case 'j':
+      numThreads = atoi (optarg);
+      break;
+    case 'T':
+      printf ("Statistics kernel in use: %s\n", statsKernelName ());
+      return (testStatsKernel () + testRunningStats () + testQuantileSketch ()) ? -1 : 0;
+    default:
+      usage ();
+      return -1;
+    }
+  }
+  if (socketPath)
+  {
+    if (argc != optind || batchMode || streamMode || pipelineMode || incrementalMode || indexMode ||
+        numWindowSpecs || numPercentiles || selectFile || sidPattern || startTime || endTime)
+    {
+      usage ();
+      return -1;
+    }
+    if (reportStats)
+      enableStageStats ();
+    int rv = serveRequests (socketPath, numThreads);
+    if (reportStats && reportStageStats (statsFile))
+      rv = -1;
+    return rv ? -1 : 0;
+  }
+  if (indexMode)
+  {
+    if (argc - optind != 1)
+    {
+      usage ();
+      return -1;
+    }
+    return writeIndexFile (argv[optind]) ? -1 : 0;
+  }
+  if (argc - optind != ((numWindowSpecs) ? 2 : 4) || (batchMode + streamMode + pipelineMode + incrementalMode > 1) ||
+      (finalRun && !incrementalMode))
   {
     usage ();
     return -1;
   }
+  if (numWindowSpecs > 1 && (streamMode || pipelineMode || incrementalMode))
+  {
+    printf ("Several window settings are only computed over whole files\n");
+    return -1;
+  }
+  if (numPercentiles > 0 && (streamMode || pipelineMode || incrementalMode))
+  {
+    printf ("Percentiles are only computed over whole files\n");
+    return -1;
+  }
+  argv += optind - 1;
+
   /* Get file name without path */
   mseedfile  = argv[1];
   int len    = strlen (mseedfile);
@@ -60,42 +338,88 @@ main (int argc, char **argv)
     temp = &temp[strlen (temp) - l + 2];
     ssc  = strstr (temp, "/");
   }
-  size_t tempLen = strlen (temp);
 #ifdef DEBUG
-  printf ("temp str size: %ld content: %s\n", tempLen, temp);
+  printf ("temp str size: %ld content: %s\n", strlen (temp), temp);
 #endif
-  /* Get window size */
-  windowSize = atoi (argv[2]);
-  /* Get overlap percentage between each window */
-  windowOverlap = atoi (argv[3]);
-  if (windowSize <= 0)
+  if (numWindowSpecs == 0)
   {
-    printf ("This doesn't make sense because time window size is smaller than zero.\n");
-    return -1;
+    /* Get window size */
+    windowSpecs[0].windowSize = atoi (argv[2]);
+    /* Get overlap percentage between each window */
+    windowSpecs[0].windowOverlap = atoi (argv[3]);
+    numWindowSpecs               = 1;
   }
-  if (windowOverlap >= 100)
+  for (int i = 0; i < numWindowSpecs; i++)
   {
-    printf ("This doesn't make sense because if window overlap percentage is bigger of \
+    if (windowSpecs[i].windowSize <= 0)
+    {
+      printf ("This doesn't make sense because time window size is smaller than zero.\n");
+      return -1;
+    }
+    if (windowSpecs[i].windowOverlap >= 100)
+    {
+      printf ("This doesn't make sense because if window overlap percentage is bigger of \
 equal than 100 will create infinite loop\n");
-    return -1;
+      return -1;
+    }
+  }
+  windowSize    = windowSpecs[0].windowSize;
+  windowOverlap = windowSpecs[0].windowOverlap;
+
+  /* Get output file format indicators, letters may be combined */
+  for (const char *format = argv[argc - optind]; *format; format++)
+  {
+    if (*format == 'a')
+      outputFormatFlag |= OUTPUTRMS | OUTPUTJSON;
+    else if (*format == 'r')
+      outputFormatFlag |= OUTPUTRMS;
+    else if (*format == 'j')
+      outputFormatFlag |= OUTPUTJSON;
+    else if (*format == 'b')
+      outputFormatFlag |= OUTPUTBINARY;
+    else if (*format == 'n')
+      outputFormatFlag |= OUTPUTNPY;
+    else if (*format == 'z')
+      outputFormatFlag |= OUTPUTGZIP;
   }
-  /* Create output files (.rms and .json) */
-  outputFileRMS  = (char *)malloc (sizeof (char) * (1 + tempLen + strlen (RMSExtension)));
-  outputFileJSON = (char *)malloc (sizeof (char) * (1 + tempLen + strlen (JSONExtension)));
-  strcpy (outputFileRMS, temp);
-  strcat (outputFileRMS, RMSExtension);
-  strcpy (outputFileJSON, temp);
-  strcat (outputFileJSON, JSONExtension);
-  /* Get output file format indicator */
-  if (strcmp (argv[4], "a") == 0)
-    outputFormatFlag = 0;
-  else if (strcmp (argv[4], "r") == 0)
-    outputFormatFlag = 1;
-  else if (strcmp (argv[4], "j") == 0)
-    outputFormatFlag = 2;
-
-  int returnValue = traverseTimeWindow (mseedfile, outputFileRMS, outputFileJSON, windowSize, windowOverlap, outputFormatFlag);
-  //int returnValue = traverseTimeWindowLimited (mseedfile, outputFileRMS, outputFileJSON, windowSize, windowOverlap);
+  if ((outputFormatFlag & ~OUTPUTGZIP) == 0)
+    outputFormatFlag |= OUTPUTRMS | OUTPUTJSON;
+
+  /* Output files are named after the input file */
+  config.windowSize       = windowSize;
+  config.windowOverlap    = windowOverlap;
+  config.outputFormatFlag = outputFormatFlag;
+  config.numThreads       = numThreads;
+  config.sink             = NULL;
+  config.windowSpecs      = windowSpecs;
+  config.numWindowSpecs   = numWindowSpecs;
+  config.percentiles      = percentiles;
+  config.numPercentiles   = numPercentiles;
+
+  if (makeSelections (&selections, selectFile, sidPattern, startTime, endTime))
+    return -1;
+  config.selections = selections;
+
+  if (reportStats)
+    enableStageStats ();
+
+  int returnValue;
+  if (batchMode)
+    returnValue = runBatch (mseedfile, &config, numThreads);
+  else if (incrementalMode)
+    returnValue = incrementalTimeWindow (mseedfile, temp, &config, finalRun);
+  else if (streamMode)
+    returnValue = streamTimeWindow (mseedfile, (strcmp (mseedfile, "-") == 0) ? "stdin" : temp,
+                                    &config, followMode);
+  else if (pipelineMode)
+    returnValue = pipelineTimeWindow (mseedfile, (strcmp (mseedfile, "-") == 0) ? "stdin" : temp,
+                                      &config);
+  else
+    returnValue = traverseTimeWindow (mseedfile, temp, &config, NULL);
+  if (reportStats && reportStageStats (statsFile))
+    returnValue = -1;
+  if (selections)
+    ms3_freeselections (selections);
   if (returnValue < 0)
   {
     return -1;
@@ -0,0 +1,375 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmseed.h"
+
+#include "arena.h"
+#include "ms2rms.h"
+#include "record_index.h"
+#include "sample_store.h"
+#include "stream.h"
+#include "traverse.h"
+#include "window_writer.h"
+
+struct MS2RMSContext
+{
+  TraverseConfig config;
+  WindowSink sink; /* Hands windows to the callback or the array */
+  Arena arena;     /* Sample stores of whole inputs, reset after each */
+  StreamContext *stream;
+  pthread_mutex_t lock; /* Serializes the sink across worker threads */
+  MS2RMSCallback callback;
+  void *userdata;
+  MS2RMSWindow *windows;
+  size_t numwindows;
+  size_t capacity;
+  char *indexPath; /* File of the index kept for range queries */
+  RecordIndex index;
+};
+
+/* Sink handle of one source ID */
+typedef struct LibraryChannel
+{
+  MS2RMSContext *context;
+  char sid[LM_SIDLEN];
+} LibraryChannel;
+
+static void *
+openLibrarySink (void *userdata, const char *sid, const char *outputBase)
+{
+  LibraryChannel *channel = (LibraryChannel *)calloc (1, sizeof (LibraryChannel));
+
+  /* Windows go to the callback, nothing is named */
+  (void)outputBase;
+
+  if (channel == NULL)
+  {
+    ms_log (2, "Cannot allocate library channel\n");
+    return NULL;
+  }
+  channel->context = (MS2RMSContext *)userdata;
+  strncpy (channel->sid, sid, sizeof (channel->sid) - 1);
+
+  return channel;
+}
+
+static int
+writeLibrarySink (void *handle, nstime_t timeStamp, const WindowStats *stats)
+{
+  LibraryChannel *channel = (LibraryChannel *)handle;
+  MS2RMSContext *context  = channel->context;
+  MS2RMSWindow window;
+  int rv = 0;
+
+  memcpy (window.sid, channel->sid, sizeof (window.sid));
+  window.timestamp = timeStamp;
+  window.count     = stats->count;
+  window.mean      = stats->mean;
+  window.SD        = stats->SD;
+  window.min       = stats->min;
+  window.max       = stats->max;
+  window.minDemean = stats->minDemean;
+  window.maxDemean = stats->maxDemean;
+
+  pthread_mutex_lock (&context->lock);
+  if (context->callback)
+  {
+    rv = context->callback (&window, context->userdata) ? -1 : 0;
+  }
+  else
+  {
+    if (context->numwindows == context->capacity)
+    {
+      size_t capacity        = (context->capacity) ? context->capacity * 2 : 1024;
+      MS2RMSWindow *windows = (MS2RMSWindow *)realloc (context->windows, sizeof (MS2RMSWindow) * capacity);
+      if (windows == NULL)
+      {
+        ms_log (2, "Cannot grow the window array\n");
+        rv = -1;
+      }
+      else
+      {
+        context->windows  = windows;
+        context->capacity = capacity;
+      }
+    }
+    if (rv == 0)
+      context->windows[context->numwindows++] = window;
+  }
+  pthread_mutex_unlock (&context->lock);
+
+  return rv;
+}
+
+static int
+closeLibrarySink (void *handle)
+{
+  free (handle);
+
+  return 0;
+}
+
+/* Create a context for windows of windowSize seconds overlapping by
+ * windowOverlap percent. Whole inputs run on one thread unless set
+ * otherwise. Returns NULL on invalid settings or allocation failure. */
+MS2RMSContext *
+ms2rmsCreate (int windowSize, int windowOverlap)
+{
+  MS2RMSContext *context;
+
+  if (windowSize <= 0 || windowOverlap < 0 || windowOverlap >= 100)
+  {
+    ms_log (2, "Invalid window size %d or overlap %d\n", windowSize, windowOverlap);
+    return NULL;
+  }
+  if ((context = (MS2RMSContext *)calloc (1, sizeof (MS2RMSContext))) == NULL)
+  {
+    ms_log (2, "Cannot allocate context\n");
+    return NULL;
+  }
+
+  context->config.windowSize    = windowSize;
+  context->config.windowOverlap = windowOverlap;
+  context->config.numThreads    = 1;
+  context->config.sink          = &context->sink;
+  context->sink.open            = openLibrarySink;
+  context->sink.write           = writeLibrarySink;
+  context->sink.close           = closeLibrarySink;
+  context->sink.userdata        = context;
+  initArena (&context->arena, ARENABLOCKSIZE);
+  pthread_mutex_init (&context->lock, NULL);
+
+  return context;
+}
+
+/* Free the context, dropping incremental windows not flushed yet */
+void
+ms2rmsDestroy (MS2RMSContext *context)
+{
+  if (context == NULL)
+    return;
+
+  if (context->stream)
+  {
+    context->callback = NULL;
+    closeStreamContext (context->stream);
+  }
+  freeRecordIndex (&context->index);
+  free (context->indexPath);
+  freeArena (&context->arena);
+  pthread_mutex_destroy (&context->lock);
+  free (context->windows);
+  free (context);
+}
+
+/* Worker threads decoding the records of whole inputs and computing
+ * their windows, 0 for one per CPU */
+void
+ms2rmsSetThreads (MS2RMSContext *context, int numThreads)
+{
+  context->config.numThreads = numThreads;
+}
+
+/* Pass every window to callback instead of collecting them, NULL to
+ * collect them again */
+void
+ms2rmsSetCallback (MS2RMSContext *context, MS2RMSCallback callback, void *userdata)
+{
+  context->callback = callback;
+  context->userdata = userdata;
+}
+
+/* Compute the windows of a loaded store and give the memory back */
+static int
+processStore (MS2RMSContext *context, SampleStore *store)
+{
+  int rv = traverseSampleStore (store, NULL, &context->config);
+
+  freeSampleStore (store);
+  resetArena (&context->arena);
+
+  return rv;
+}
+
+/* Every window of a miniSEED file, "-" for stdin */
+int
+ms2rmsProcessFile (MS2RMSContext *context, const char *path)
+{
+  SampleStore store;
+
+  if (loadSampleStore (path, &store, MSF_VALIDATECRC, NULL, 0, &context->arena,
+                       context->config.numThreads))
+  {
+    resetArena (&context->arena);
+    return -1;
+  }
+
+  return processStore (context, &store);
+}
+
+/* The windows of the source IDs matching sidPattern (NULL for all) of
+ * the samples in [start, end) (NSTUNSET for either to leave it open) in
+ * a miniSEED file. Only the records overlapping the range are read, found
+ * through the file's sidecar index when current, otherwise through an
+ * index built once and kept for further queries of the same file. */
+int
+ms2rmsProcessFileRange (MS2RMSContext *context, const char *path, const char *sidPattern,
+                        nstime_t start, nstime_t end)
+{
+  SampleStore store;
+
+  if (context->indexPath == NULL || strcmp (context->indexPath, path) ||
+      !isRecordIndexCurrent (path, &context->index))
+  {
+    freeRecordIndex (&context->index);
+    free (context->indexPath);
+    context->indexPath = NULL;
+    if (openRecordIndex (path, &context->index))
+      return -1;
+    if ((context->indexPath = strdup (path)) == NULL)
+    {
+      freeRecordIndex (&context->index);
+      return -1;
+    }
+  }
+
+  if (loadSampleStoreRange (path, &context->index, sidPattern, start, end, &store,
+                            MSF_VALIDATECRC, 0, &context->arena, context->config.numThreads))
+  {
+    resetArena (&context->arena);
+    return -1;
+  }
+
+  return processStore (context, &store);
+}
+
+/* Every window of the miniSEED records in a buffer */
+int
+ms2rmsProcessBuffer (MS2RMSContext *context, const char *buffer, size_t length)
+{
+  SampleStore store;
+
+  if (loadSampleStoreBuffer (buffer, length, &store, MSF_VALIDATECRC, 0, &context->arena,
+                             context->config.numThreads))
+  {
+    resetArena (&context->arena);
+    return -1;
+  }
+
+  return processStore (context, &store);
+}
+
+/* Every window of an array of decoded samples of type sampletype ('i'
+ * int32_t, 'f' float or 'd' double), the first one at starttime. The
+ * samples are used in place. */
+int
+ms2rmsProcessSamples (MS2RMSContext *context, const char *sid, nstime_t starttime,
+                      double samprate, const void *samples, char sampletype, int64_t count)
+{
+  SampleStore store;
+  StoreTrace trace;
+  StoreSegment segment;
+
+  if (count <= 0 || samprate <= 0.0 ||
+      (sampletype != 'i' && sampletype != 'f' && sampletype != 'd'))
+    return (count <= 0) ? 0 : -1;
+
+  memset (&segment, 0, sizeof (StoreSegment));
+  segment.starttime  = starttime;
+  segment.samprate   = samprate;
+  segment.numsamples = count;
+  segment.samples    = (void *)samples;
+  segment.sampletype = sampletype;
+  segment.samplesize = (sampletype == 'd') ? 8 : 4;
+
+  memset (&trace, 0, sizeof (StoreTrace));
+  strncpy (trace.sid, sid, sizeof (trace.sid) - 1);
+  trace.earliest    = starttime;
+  trace.latest      = sampleTimeAt (&segment, count - 1);
+  trace.segments    = &segment;
+  trace.numsegments = 1;
+  trace.numsamples  = count;
+
+  memset (&store, 0, sizeof (SampleStore));
+  store.traces    = &trace;
+  store.numtraces = 1;
+
+  return traverseSampleStore (&store, NULL, &context->config);
+}
+
+static StreamContext *
+getStream (MS2RMSContext *context)
+{
+  if (context->stream == NULL)
+    context->stream = openStreamContext (&context->config, NULL);
+
+  return context->stream;
+}
+
+/* Add the complete miniSEED records at the start of buffer. Returns the
+ * number of bytes consumed; the rest is the start of a record to be
+ * passed again once more data has arrived. Returns -1 on error. */
+int64_t
+ms2rmsPushRecords (MS2RMSContext *context, const char *buffer, size_t length)
+{
+  StreamContext *stream = getStream (context);
+  size_t needed;
+
+  if (stream == NULL)
+    return -1;
+
+  return addStreamBuffer (stream, buffer, length, &needed);
+}
+
+/* Add a record already parsed and unpacked by the caller */
+int
+ms2rmsPushRecord (MS2RMSContext *context, const MS3Record *msr)
+{
+  StreamContext *stream = getStream (context);
+
+  return (stream) ? addStreamRecord (stream, msr) : -1;
+}
+
+/* Add a run of decoded samples, see ms2rmsProcessSamples() */
+int
+ms2rmsPushSamples (MS2RMSContext *context, const char *sid, nstime_t starttime,
+                   double samprate, const void *samples, char sampletype, int64_t count)
+{
+  StreamContext *stream = getStream (context);
+
+  return (stream) ? addStreamSamples (stream, sid, starttime, samprate, samples, sampletype, count) : -1;
+}
+
+/* End the incremental input, producing every window still open. The
+ * next pushed data starts a new stream. */
+int
+ms2rmsFlush (MS2RMSContext *context)
+{
+  int rv = 0;
+
+  if (context->stream)
+  {
+    rv              = closeStreamContext (context->stream);
+    context->stream = NULL;
+  }
+
+  return rv;
+}
+
+/* Windows collected so far, when no callback is set */
+const MS2RMSWindow *
+ms2rmsGetWindows (const MS2RMSContext *context, size_t *count)
+{
+  *count = context->numwindows;
+
+  return context->windows;
+}
+
+/* Forget the collected windows, keeping the array for reuse */
+void
+ms2rmsClearWindows (MS2RMSContext *context)
+{
+  context->numwindows = 0;
+}
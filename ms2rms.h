@@ -0,0 +1,71 @@
+#ifndef MS2RMS_H
+#define MS2RMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libmseed.h"
+
+/* libms2rms: window statistics of miniSEED data computed in-process.
+ *
+ * A context holds the window settings, its buffers and the state of
+ * incremental input. Data is handed over either whole (a file, a buffer
+ * of records or an array of decoded samples), in which case every window
+ * is produced before the call returns, or incrementally (records or
+ * sample runs as they arrive), in which case each window is produced as
+ * soon as no later data can contribute to it and ms2rmsFlush() ends the
+ * stream.
+ *
+ * Windows are passed to the callback set with ms2rmsSetCallback(), or
+ * else collected in an array read with ms2rmsGetWindows(). Window
+ * statistics are the same as in the program's .rms outputs.
+ *
+ * Functions returning int return 0 on success and -1 on error. A context
+ * must not be used from several threads at once. */
+
+typedef struct MS2RMSContext MS2RMSContext;
+
+/* Statistics of one time window */
+typedef struct MS2RMSWindow
+{
+  char sid[LM_SIDLEN]; /* Source ID */
+  nstime_t timestamp;  /* Middle of the first and last sample */
+  uint64_t count;      /* Samples in the window */
+  double mean;         /* Rounded to the hundredth */
+  double SD;           /* Rounded to the hundredth */
+  double min;
+  double max;
+  double minDemean;
+  double maxDemean;
+} MS2RMSWindow;
+
+/* Receives each window; returning non-zero stops the processing call
+ * with an error. With several threads the calls are serialized, windows
+ * of one source ID always arrive in time order. */
+typedef int (*MS2RMSCallback) (const MS2RMSWindow *window, void *userdata);
+
+MS2RMSContext *ms2rmsCreate (int windowSize, int windowOverlap);
+void ms2rmsDestroy (MS2RMSContext *context);
+void ms2rmsSetThreads (MS2RMSContext *context, int numThreads);
+void ms2rmsSetCallback (MS2RMSContext *context, MS2RMSCallback callback, void *userdata);
+
+/* Whole input */
+int ms2rmsProcessFile (MS2RMSContext *context, const char *path);
+int ms2rmsProcessFileRange (MS2RMSContext *context, const char *path, const char *sidPattern,
+                            nstime_t start, nstime_t end);
+int ms2rmsProcessBuffer (MS2RMSContext *context, const char *buffer, size_t length);
+int ms2rmsProcessSamples (MS2RMSContext *context, const char *sid, nstime_t starttime,
+                          double samprate, const void *samples, char sampletype, int64_t count);
+
+/* Incremental input */
+int64_t ms2rmsPushRecords (MS2RMSContext *context, const char *buffer, size_t length);
+int ms2rmsPushRecord (MS2RMSContext *context, const MS3Record *msr);
+int ms2rmsPushSamples (MS2RMSContext *context, const char *sid, nstime_t starttime,
+                       double samprate, const void *samples, char sampletype, int64_t count);
+int ms2rmsFlush (MS2RMSContext *context);
+
+/* Collected results */
+const MS2RMSWindow *ms2rmsGetWindows (const MS2RMSContext *context, size_t *count);
+void ms2rmsClearWindows (MS2RMSContext *context);
+
+#endif
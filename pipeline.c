@@ -0,0 +1,572 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmseed.h"
+
+#include "pipeline.h"
+#include "spsc_queue.h"
+#include "stage_stats.h"
+#include "stream.h"
+#include "window_writer.h"
+
+/* Waits on a full or empty queue yield this many times, then sleep */
+#define PIPELINESPINS 64
+
+/* Bytes read by the reader stage */
+typedef struct PipelineBlock
+{
+  char *data;
+  size_t length;
+} PipelineBlock;
+
+/* What the writer stage does with an item */
+#define ITEMOPEN 0
+#define ITEMWRITE 1
+#define ITEMCLOSE 2
+
+/* A record on its way from the parser to the statistics stage, with a
+ * copy of its bytes the decoder unpacks the samples from */
+typedef struct PipelineRecord
+{
+  MS3Record *msr;
+  char *raw;
+  size_t rawSize;
+  int valid; /* Cleared by the decoder when the samples cannot be unpacked */
+} PipelineRecord;
+
+/* The outputs of one source ID, opened by the writer stage */
+typedef struct PipelineChannel
+{
+  struct Pipeline *pipeline;
+  void *output; /* Handle of the file sink, only used by the writer */
+  char sid[LM_SIDLEN];
+  char *outputBase;
+  struct PipelineChannel *next;
+} PipelineChannel;
+
+typedef struct PipelineItem
+{
+  int type; /* ITEM* */
+  PipelineChannel *channel;
+  nstime_t timeStamp;
+  WindowStats stats;
+} PipelineItem;
+
+typedef struct PipelineBatch
+{
+  int count;
+  PipelineItem items[PIPELINEBATCHSIZE];
+} PipelineBatch;
+
+/* Full items travel down a link, empty ones come back up to be reused */
+typedef struct PipelineLink
+{
+  SpscQueue full;
+  SpscQueue empty;
+} PipelineLink;
+
+/* Reader, parser, decoder, statistics and writer stages of one input */
+typedef struct Pipeline
+{
+  int fd;
+  const char *name;
+  const MS3Selections *selections; /* Records to decode, NULL for all */
+  PipelineLink blocks;  /* Reader to parser */
+  SpscQueue parsed;     /* Parser to decoder, records CRC checked */
+  PipelineLink records; /* Decoder to statistics, unpacked, and back to the parser */
+  PipelineLink batches; /* Statistics to writer */
+  PipelineBlock blockPool[PIPELINEBLOCKS];
+  PipelineRecord recordPool[PIPELINERECORDS];
+  PipelineBatch *batchPool[PIPELINEBATCHES];
+  PipelineBatch *batch;      /* Being filled by the statistics stage */
+  PipelineChannel *channels; /* Every one opened, freed once the stages are joined */
+  FileSinkOptions fileOptions;
+  WindowSink fileSink;
+  atomic_int failed; /* Set by any stage, the others give up */
+} Pipeline;
+
+static void
+failPipeline (Pipeline *pipeline)
+{
+  atomic_store (&pipeline->failed, 1);
+}
+
+static void
+waitTurn (int *spins)
+{
+  struct timespec pause = {0, 50000};
+
+  if ((*spins)++ < PIPELINESPINS)
+    sched_yield ();
+  else
+    nanosleep (&pause, NULL);
+}
+
+/* Push, waiting for room. Returns -1 once the pipeline failed. */
+static int
+pushItem (Pipeline *pipeline, SpscQueue *queue, void *item)
+{
+  int spins = 0;
+
+  while (tryPushSpscQueue (queue, item))
+  {
+    if (atomic_load (&pipeline->failed))
+      return -1;
+    waitTurn (&spins);
+  }
+
+  return 0;
+}
+
+/* Pop, waiting for an item. Returns NULL at the end of the queue or once
+ * the pipeline failed. */
+static void *
+popItem (Pipeline *pipeline, SpscQueue *queue)
+{
+  int spins = 0;
+  void *item;
+
+  while ((item = tryPopSpscQueue (queue)) == NULL)
+  {
+    if (isSpscQueueDone (queue) || atomic_load (&pipeline->failed))
+      return NULL;
+    waitTurn (&spins);
+  }
+
+  return item;
+}
+
+/* Read the input ahead of the parser, so waiting for storage overlaps
+ * with the work of the other stages */
+static void *
+readerStage (void *arg)
+{
+  Pipeline *pipeline = (Pipeline *)arg;
+  PipelineBlock *block;
+  StageTimer timer;
+  ssize_t bytes;
+
+  while ((block = (PipelineBlock *)popItem (pipeline, &pipeline->blocks.empty)) != NULL)
+  {
+    startStage (&timer);
+    do
+      bytes = read (pipeline->fd, block->data, PIPELINEBLOCKSIZE);
+    while (bytes < 0 && errno == EINTR);
+    endStage (&timer, STAGE_READ);
+    if (bytes < 0)
+    {
+      ms_log (2, "Error reading %s: %s\n", pipeline->name, strerror (errno));
+      failPipeline (pipeline);
+      break;
+    }
+    if (bytes == 0)
+      break;
+    countStage (COUNT_BYTESREAD, bytes);
+
+    block->length = bytes;
+    if (pushItem (pipeline, &pipeline->blocks.full, block))
+      break;
+  }
+  closeSpscQueue (&pipeline->blocks.full);
+
+  return NULL;
+}
+
+/* Parse and check the records of the blocks read, in order, copying
+ * the bytes of each one for the decoder. Invalid data is skipped byte by
+ * byte as in streaming mode. */
+static void *
+parserStage (void *arg)
+{
+  Pipeline *pipeline = (Pipeline *)arg;
+  PipelineBlock *block;
+  PipelineRecord *record = NULL;
+  char *pending          = NULL; /* Unparsed bytes, a record may span blocks */
+  size_t pendingSize     = 0;
+  size_t length          = 0;
+  size_t offset;
+  size_t needed;
+  int rv;
+
+  while ((block = (PipelineBlock *)popItem (pipeline, &pipeline->blocks.full)) != NULL)
+  {
+    if (length + block->length > pendingSize)
+    {
+      char *grown = (char *)realloc (pending, length + block->length);
+      if (grown == NULL)
+      {
+        ms_log (2, "Cannot grow pipeline buffer\n");
+        failPipeline (pipeline);
+        break;
+      }
+      pending     = grown;
+      pendingSize = length + block->length;
+    }
+    memcpy (pending + length, block->data, block->length);
+    length += block->length;
+    if (pushItem (pipeline, &pipeline->blocks.empty, block))
+      break;
+
+    for (offset = 0; offset < length;)
+    {
+      if (record == NULL &&
+          (record = (PipelineRecord *)popItem (pipeline, &pipeline->records.empty)) == NULL)
+        break;
+
+      rv = parseStreamRecord (pending + offset, length - offset, pipeline->selections, &record->msr, &needed);
+      if (rv == 1)
+        break;
+      if (rv == 2)
+      {
+        offset += record->msr->reclen;
+        continue;
+      }
+      if (rv < 0)
+      {
+        countStage (COUNT_BYTESSKIPPED, 1);
+        offset++;
+        continue;
+      }
+
+      /* The pending bytes move on, the decoder reads its own copy */
+      if ((size_t)record->msr->reclen > record->rawSize)
+      {
+        char *grown = (char *)realloc (record->raw, record->msr->reclen);
+        if (grown == NULL)
+        {
+          ms_log (2, "Cannot grow pipeline record\n");
+          failPipeline (pipeline);
+          break;
+        }
+        record->raw     = grown;
+        record->rawSize = record->msr->reclen;
+      }
+      memcpy (record->raw, pending + offset, record->msr->reclen);
+      record->msr->record = record->raw;
+
+      offset += record->msr->reclen;
+      if (pushItem (pipeline, &pipeline->parsed, record))
+        break;
+      record = NULL;
+    }
+
+    /* Keep only the unparsed tail */
+    memmove (pending, pending + offset, length - offset);
+    length -= offset;
+  }
+  closeSpscQueue (&pipeline->parsed);
+  free (pending);
+
+  return NULL;
+}
+
+/* Unpack the samples of the records parsed, in order. Records that
+ * cannot be unpacked still go on to the statistics stage, which returns
+ * every record to the parser, but are skipped there. */
+static void *
+decoderStage (void *arg)
+{
+  Pipeline *pipeline = (Pipeline *)arg;
+  PipelineRecord *record;
+
+  while ((record = (PipelineRecord *)popItem (pipeline, &pipeline->parsed)) != NULL)
+  {
+    record->valid = (unpackStreamRecord (record->msr) == 0);
+    if (!record->valid)
+      countStage (COUNT_BYTESSKIPPED, record->msr->reclen);
+    if (pushItem (pipeline, &pipeline->records.full, record))
+      break;
+  }
+  closeSpscQueue (&pipeline->records.full);
+
+  return NULL;
+}
+
+/* Format and write the windows, opening and closing the outputs of each
+ * source ID as the statistics stage asks for it. Outputs still open when
+ * a stage fails are closed by pipelineTimeWindow(). */
+static void *
+writerStage (void *arg)
+{
+  Pipeline *pipeline     = (Pipeline *)arg;
+  const WindowSink *sink = &pipeline->fileSink;
+  PipelineBatch *batch;
+  int i;
+
+  while ((batch = (PipelineBatch *)popItem (pipeline, &pipeline->batches.full)) != NULL)
+  {
+    for (i = 0; i < batch->count; i++)
+    {
+      PipelineItem *item       = &batch->items[i];
+      PipelineChannel *channel = item->channel;
+
+      if (item->type == ITEMOPEN)
+      {
+        channel->output = sink->open (sink->userdata, channel->sid, channel->outputBase);
+        if (channel->output == NULL)
+          failPipeline (pipeline);
+      }
+      else if (item->type == ITEMWRITE)
+      {
+        if (channel->output && sink->write (channel->output, item->timeStamp, &item->stats))
+          failPipeline (pipeline);
+      }
+      else
+      {
+        if (channel->output && sink->close (channel->output))
+          failPipeline (pipeline);
+        channel->output = NULL;
+      }
+    }
+    batch->count = 0;
+    if (pushItem (pipeline, &pipeline->batches.empty, batch))
+      break;
+  }
+
+  return NULL;
+}
+
+/* Hand the batch being filled to the writer stage */
+static int
+sendBatch (Pipeline *pipeline)
+{
+  int rv = 0;
+
+  if (pipeline->batch && pipeline->batch->count > 0)
+  {
+    rv              = pushItem (pipeline, &pipeline->batches.full, pipeline->batch);
+    pipeline->batch = NULL;
+  }
+
+  return rv;
+}
+
+static int
+queueItem (Pipeline *pipeline, int type, PipelineChannel *channel, nstime_t timeStamp,
+           const WindowStats *stats)
+{
+  PipelineItem *item;
+
+  if (pipeline->batch == NULL &&
+      (pipeline->batch = (PipelineBatch *)popItem (pipeline, &pipeline->batches.empty)) == NULL)
+    return -1;
+
+  item          = &pipeline->batch->items[pipeline->batch->count++];
+  item->type    = type;
+  item->channel = channel;
+  if (stats)
+  {
+    item->timeStamp = timeStamp;
+    item->stats     = *stats;
+  }
+
+  return (pipeline->batch->count == PIPELINEBATCHSIZE) ? sendBatch (pipeline) : 0;
+}
+
+/* Sink of the statistics stage, queueing everything for the writer */
+static void *
+openPipelineSink (void *userdata, const char *sid, const char *outputBase)
+{
+  PipelineChannel *channel = (PipelineChannel *)calloc (1, sizeof (PipelineChannel));
+
+  if (channel == NULL || (outputBase && (channel->outputBase = strdup (outputBase)) == NULL))
+  {
+    ms_log (2, "Cannot allocate pipeline channel\n");
+    free (channel);
+    return NULL;
+  }
+  channel->pipeline = (Pipeline *)userdata;
+  strncpy (channel->sid, sid, sizeof (channel->sid) - 1);
+
+  /* Kept until every stage is joined, even if never opened */
+  channel->next               = channel->pipeline->channels;
+  channel->pipeline->channels = channel;
+  if (queueItem (channel->pipeline, ITEMOPEN, channel, 0, NULL))
+    return NULL;
+
+  return channel;
+}
+
+static int
+writePipelineSink (void *handle, nstime_t timeStamp, const WindowStats *stats)
+{
+  PipelineChannel *channel = (PipelineChannel *)handle;
+
+  return queueItem (channel->pipeline, ITEMWRITE, channel, timeStamp, stats);
+}
+
+static int
+closePipelineSink (void *handle)
+{
+  PipelineChannel *channel = (PipelineChannel *)handle;
+
+  return queueItem (channel->pipeline, ITEMCLOSE, channel, 0, NULL);
+}
+
+static int
+initPipeline (Pipeline *pipeline, int fd, const char *name, const TraverseConfig *config)
+{
+  int i;
+
+  memset (pipeline, 0, sizeof (Pipeline));
+  pipeline->fd         = fd;
+  pipeline->name       = name;
+  pipeline->selections = config->selections;
+  atomic_init (&pipeline->failed, 0);
+
+  if (initSpscQueue (&pipeline->blocks.full, PIPELINEBLOCKS) ||
+      initSpscQueue (&pipeline->blocks.empty, PIPELINEBLOCKS) ||
+      initSpscQueue (&pipeline->parsed, PIPELINERECORDS) ||
+      initSpscQueue (&pipeline->records.full, PIPELINERECORDS) ||
+      initSpscQueue (&pipeline->records.empty, PIPELINERECORDS) ||
+      initSpscQueue (&pipeline->batches.full, PIPELINEBATCHES) ||
+      initSpscQueue (&pipeline->batches.empty, PIPELINEBATCHES))
+    return -1;
+
+  /* Every item starts out empty */
+  for (i = 0; i < PIPELINEBLOCKS; i++)
+  {
+    if ((pipeline->blockPool[i].data = (char *)malloc (PIPELINEBLOCKSIZE)) == NULL)
+      return -1;
+    tryPushSpscQueue (&pipeline->blocks.empty, &pipeline->blockPool[i]);
+  }
+  for (i = 0; i < PIPELINERECORDS; i++)
+  {
+    if ((pipeline->recordPool[i].msr = msr3_init (NULL)) == NULL)
+      return -1;
+    tryPushSpscQueue (&pipeline->records.empty, &pipeline->recordPool[i]);
+  }
+  for (i = 0; i < PIPELINEBATCHES; i++)
+  {
+    if ((pipeline->batchPool[i] = (PipelineBatch *)calloc (1, sizeof (PipelineBatch))) == NULL)
+      return -1;
+    tryPushSpscQueue (&pipeline->batches.empty, pipeline->batchPool[i]);
+  }
+
+  /* Nothing follows the outputs while they are written, no flushing */
+  pipeline->fileOptions.outputFormatFlag = config->outputFormatFlag;
+  pipeline->fileOptions.flush            = 0;
+  makeFileSink (&pipeline->fileSink, &pipeline->fileOptions);
+
+  return 0;
+}
+
+static void
+freePipeline (Pipeline *pipeline)
+{
+  int i;
+
+  for (i = 0; i < PIPELINEBLOCKS; i++)
+    free (pipeline->blockPool[i].data);
+  for (i = 0; i < PIPELINERECORDS; i++)
+  {
+    if (pipeline->recordPool[i].msr)
+      msr3_free (&pipeline->recordPool[i].msr);
+    free (pipeline->recordPool[i].raw);
+  }
+  for (i = 0; i < PIPELINEBATCHES; i++)
+    free (pipeline->batchPool[i]);
+  freeSpscQueue (&pipeline->blocks.full);
+  freeSpscQueue (&pipeline->blocks.empty);
+  freeSpscQueue (&pipeline->parsed);
+  freeSpscQueue (&pipeline->records.full);
+  freeSpscQueue (&pipeline->records.empty);
+  freeSpscQueue (&pipeline->batches.full);
+  freeSpscQueue (&pipeline->batches.empty);
+}
+
+/* Process a file or "-" for stdin as streaming mode does, with reading,
+ * parsing, decoding, window statistics and output each on a thread of
+ * their own, connected by bounded lock-free queues. Reads from slow
+ * storage then overlap with the decoding and statistics of the records
+ * before them. The outputs are those of streamTimeWindow(). */
+int
+pipelineTimeWindow (const char *mseedfile, const char *outputPrefix, const TraverseConfig *config)
+{
+  static void *(*const stages[]) (void *) = {readerStage, parserStage, decoderStage, writerStage};
+  pthread_t threads[4];
+  TraverseConfig streamConfig = *config;
+  StreamContext *context      = NULL;
+  PipelineChannel *channel;
+  PipelineRecord *record;
+  Pipeline pipeline;
+  WindowSink sink;
+  int started = 0;
+  int rv      = 0;
+  int fd;
+
+  if (strcmp (mseedfile, "-") == 0)
+    fd = STDIN_FILENO;
+  else if ((fd = open (mseedfile, O_RDONLY)) < 0)
+  {
+    ms_log (2, "Error opening file %s: %s\n", mseedfile, strerror (errno));
+    return -1;
+  }
+
+  sink.open           = openPipelineSink;
+  sink.write          = writePipelineSink;
+  sink.close          = closePipelineSink;
+  sink.userdata       = &pipeline;
+  streamConfig.sink   = &sink;
+  if (initPipeline (&pipeline, fd, mseedfile, config) ||
+      (context = openStreamContext (&streamConfig, outputPrefix)) == NULL)
+  {
+    ms_log (2, "Cannot allocate pipeline\n");
+    rv = -1;
+  }
+
+  for (; rv == 0 && started < 4; started++)
+  {
+    if (pthread_create (&threads[started], NULL, stages[started], &pipeline))
+    {
+      ms_log (2, "Cannot create pipeline thread\n");
+      failPipeline (&pipeline);
+      rv = -1;
+    }
+  }
+  if (rv)
+    started--;
+
+  /* The statistics stage runs here, slid over the records as they come */
+  while (rv == 0 && (record = (PipelineRecord *)popItem (&pipeline, &pipeline.records.full)) != NULL)
+  {
+    if ((record->valid && addStreamRecord (context, record->msr)) ||
+        pushItem (&pipeline, &pipeline.records.empty, record))
+      failPipeline (&pipeline);
+  }
+  if (context && closeStreamContext (context))
+    failPipeline (&pipeline);
+  if (sendBatch (&pipeline))
+    failPipeline (&pipeline);
+  closeSpscQueue (&pipeline.batches.full);
+
+  while (started-- > 0)
+    pthread_join (threads[started], NULL);
+  if (atomic_load (&pipeline.failed))
+    rv = -1;
+
+  /* After a failure, close the outputs the writer left open with the
+   * windows written so far */
+  while ((channel = pipeline.channels) != NULL)
+  {
+    pipeline.channels = channel->next;
+    if (channel->output && pipeline.fileSink.close (channel->output))
+      rv = -1;
+    free (channel->outputBase);
+    free (channel);
+  }
+
+  freePipeline (&pipeline);
+  if (fd != STDIN_FILENO)
+    close (fd);
+
+  return rv;
+}
@@ -0,0 +1,20 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "traverse.h"
+
+/* Bytes per read of the reader stage */
+#define PIPELINEBLOCKSIZE 1048576
+
+/* Items in flight between two stages, which bounds the memory used and
+ * how far one stage can run ahead of the next */
+#define PIPELINEBLOCKS 8
+#define PIPELINERECORDS 256
+#define PIPELINEBATCHES 8
+
+/* Windows handed to the writer stage at a time */
+#define PIPELINEBATCHSIZE 512
+
+int pipelineTimeWindow (const char *mseedfile, const char *outputPrefix, const TraverseConfig *config);
+
+#endif
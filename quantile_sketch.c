@@ -0,0 +1,281 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "quantile_sketch.h"
+#include "stats_kernel.h"
+
+/* Samples sorted at a time before they are merged into a sketch */
+#define SKETCHBATCH 512
+
+static int
+compareValues (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* The arcsine scale of the t-digest and its inverse. A centroid may
+ * only span one unit of it, which is a small share of the samples near
+ * the tails and a large one around the median. */
+static double
+scaleOf (double quantile)
+{
+  return QUANTILECOMPRESSION / (2 * M_PI) * asin (2 * quantile - 1);
+}
+
+static double
+quantileOf (double scale)
+{
+  if (scale >= QUANTILECOMPRESSION / 4.0)
+    return 1.0;
+
+  return (sin (scale * 2 * M_PI / QUANTILECOMPRESSION) + 1) / 2;
+}
+
+/* Pack centroids sorted by mean into the sketch, merging neighbours as
+ * long as the scale allows. Two neighbours always span more than a unit
+ * of it, so no more than QUANTILECOMPRESSION + 1 are left. */
+static void
+compressCentroids (QuantileSketch *sketch, const double *means, const double *weights, int n)
+{
+  double total  = (double)sketch->count;
+  double soFar  = 0.0;
+  double limit  = total * quantileOf (scaleOf (0.0) + 1);
+  double mean   = means[0];
+  double weight = weights[0];
+  int out       = 0;
+  int i;
+
+  for (i = 1; i < n; i++)
+  {
+    /* The last slot takes whatever rounding may leave over */
+    if (soFar + weight + weights[i] <= limit || out == QUANTILECENTROIDS - 1)
+    {
+      weight += weights[i];
+      mean += (means[i] - mean) * weights[i] / weight;
+      continue;
+    }
+    sketch->means[out]     = mean;
+    sketch->weights[out++] = weight;
+    soFar += weight;
+    limit  = total * quantileOf (scaleOf (soFar / total) + 1);
+    mean   = means[i];
+    weight = weights[i];
+  }
+  sketch->means[out]     = mean;
+  sketch->weights[out++] = weight;
+  sketch->numcentroids   = out;
+}
+
+/* Merge n centroids sorted by mean, of count samples, into the sketch.
+ * Without weights every centroid is a single sample. */
+static void
+mergeCentroids (QuantileSketch *sketch, const double *means, const double *weights, int n, uint64_t count)
+{
+  double mergedMeans[QUANTILECENTROIDS + SKETCHBATCH];
+  double mergedWeights[QUANTILECENTROIDS + SKETCHBATCH];
+  int a = 0;
+  int b = 0;
+  int m = 0;
+
+  while (a < sketch->numcentroids || b < n)
+  {
+    if (b == n || (a < sketch->numcentroids && sketch->means[a] <= means[b]))
+    {
+      mergedMeans[m]     = sketch->means[a];
+      mergedWeights[m++] = sketch->weights[a++];
+    }
+    else
+    {
+      mergedMeans[m]     = means[b];
+      mergedWeights[m++] = (weights) ? weights[b] : 1.0;
+      b++;
+    }
+  }
+
+  sketch->count += count;
+  compressCentroids (sketch, mergedMeans, mergedWeights, m);
+}
+
+void
+initQuantileSketch (QuantileSketch *sketch)
+{
+  sketch->count        = 0;
+  sketch->min          = 0.0;
+  sketch->max          = 0.0;
+  sketch->numcentroids = 0;
+}
+
+/* Add a run of samples, sorted in batches and merged batch by batch */
+void
+addQuantileSketch (QuantileSketch *sketch, const void *samples, char sampletype, int64_t count)
+{
+  double values[SKETCHBATCH];
+  int64_t done;
+  int n, i;
+
+  for (done = 0; done < count; done += n)
+  {
+    n = (count - done < SKETCHBATCH) ? (int)(count - done) : SKETCHBATCH;
+    for (i = 0; i < n; i++)
+      values[i] = sampleValueAt (samples, sampletype, done + i);
+    qsort (values, n, sizeof (double), compareValues);
+
+    if (sketch->count == 0 || values[0] < sketch->min)
+      sketch->min = values[0];
+    if (sketch->count == 0 || values[n - 1] > sketch->max)
+      sketch->max = values[n - 1];
+    mergeCentroids (sketch, values, NULL, n, n);
+  }
+}
+
+void
+mergeQuantileSketch (QuantileSketch *sketch, const QuantileSketch *other)
+{
+  if (other->count == 0)
+    return;
+
+  if (sketch->count == 0 || other->min < sketch->min)
+    sketch->min = other->min;
+  if (sketch->count == 0 || other->max > sketch->max)
+    sketch->max = other->max;
+  mergeCentroids (sketch, other->means, other->weights, other->numcentroids, other->count);
+}
+
+/* Value at a quantile in [0, 1], interpolated between the centroids,
+ * each taken to be centered on its mean, and the extrema at both ends.
+ * Sketches of up to about QUANTILECOMPRESSION samples keep every sample
+ * and interpolate between them. */
+double
+getQuantileSketchValue (const QuantileSketch *sketch, double quantile)
+{
+  const double *means   = sketch->means;
+  const double *weights = sketch->weights;
+  int n                 = sketch->numcentroids;
+  double index;
+  double cumulative;
+  double gap;
+  int i;
+
+  if (sketch->count == 0)
+    return 0.0;
+  if (quantile <= 0.0)
+    return sketch->min;
+  if (quantile >= 1.0)
+    return sketch->max;
+
+  index = quantile * sketch->count;
+  if (index < weights[0] / 2)
+    return sketch->min + (means[0] - sketch->min) * index / (weights[0] / 2);
+
+  cumulative = weights[0] / 2;
+  for (i = 0; i < n - 1; i++)
+  {
+    gap = (weights[i] + weights[i + 1]) / 2;
+    if (index < cumulative + gap)
+      return means[i] + (means[i + 1] - means[i]) * (index - cumulative) / gap;
+    cumulative += gap;
+  }
+
+  return means[n - 1] + (sketch->max - means[n - 1]) * (index - cumulative) / (weights[n - 1] / 2);
+}
+
+/* Share of the sorted samples not above a value */
+static double
+rankOf (const double *sorted, int64_t count, double value)
+{
+  int64_t lo = 0;
+  int64_t hi = count;
+
+  while (lo < hi)
+  {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (sorted[mid] <= value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (double)lo / count;
+}
+
+/* Uniform in (0, 1) */
+static double
+uniformValue (void)
+{
+  return (rand () + 0.5) / ((double)RAND_MAX + 1);
+}
+
+/* Check the percentiles of sketches built directly and merged from
+ * pieces against the ranks of the sorted samples, for uniform, normal
+ * like and heavy tailed data. Returns the number of failed checks. */
+int
+testQuantileSketch (void)
+{
+  static const double quantiles[] = {0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99};
+  int failures = 0;
+  int trial, q, p;
+
+  srand (20200318);
+  for (trial = 0; trial < 60; trial++)
+  {
+    int64_t count = 1 + rand () % 50000;
+    int numpieces = 1 + rand () % 16;
+    double *data   = (double *)malloc (sizeof (double) * count);
+    double *sorted = (double *)malloc (sizeof (double) * count);
+    QuantileSketch whole, merged, piece;
+    int64_t i, start;
+
+    for (i = 0; i < count; i++)
+    {
+      if (trial % 3 == 0)
+        data[i] = uniformValue () * 20000 - 10000;
+      else if (trial % 3 == 1)
+        data[i] = (uniformValue () + uniformValue () + uniformValue ()) * 1000;
+      else
+        data[i] = 1.0e6 + 1.0 / uniformValue ();
+      sorted[i] = data[i];
+    }
+    qsort (sorted, count, sizeof (double), compareValues);
+
+    initQuantileSketch (&whole);
+    addQuantileSketch (&whole, data, 'd', count);
+
+    initQuantileSketch (&merged);
+    for (p = 0, start = 0; p < numpieces; p++)
+    {
+      int64_t end = (p == numpieces - 1) ? count : start + (count - start) / (numpieces - p);
+
+      initQuantileSketch (&piece);
+      addQuantileSketch (&piece, data + start, 'd', end - start);
+      mergeQuantileSketch (&merged, &piece);
+      start = end;
+    }
+
+    /* Rank errors of a t-digest are smallest at the tails */
+    for (q = 0; q < (int)(sizeof (quantiles) / sizeof (quantiles[0])); q++)
+    {
+      double tolerance  = 0.01 + 1.0 / count;
+      double wholeRank  = rankOf (sorted, count, getQuantileSketchValue (&whole, quantiles[q]));
+      double mergedRank = rankOf (sorted, count, getQuantileSketchValue (&merged, quantiles[q]));
+
+      if (fabs (wholeRank - quantiles[q]) > tolerance || fabs (mergedRank - quantiles[q]) > tolerance ||
+          whole.numcentroids > QUANTILECOMPRESSION + 1 || merged.numcentroids > QUANTILECOMPRESSION + 1)
+      {
+        printf ("Quantile sketch FAILED at %g for %" PRId64 " samples in %d pieces: ranks %g and %g\n",
+                quantiles[q], count, numpieces, wholeRank, mergedRank);
+        failures++;
+      }
+    }
+
+    free (data);
+    free (sorted);
+  }
+  printf ("quantile sketches checked\n");
+
+  return failures;
+}
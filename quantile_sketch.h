@@ -0,0 +1,31 @@
+#ifndef QUANTILE_SKETCH_H
+#define QUANTILE_SKETCH_H
+
+#include <stdint.h>
+
+/* Compression of the sketches, which keeps them to at most
+ * QUANTILECOMPRESSION + 1 centroids */
+#define QUANTILECOMPRESSION 100
+#define QUANTILECENTROIDS (QUANTILECOMPRESSION + 2)
+
+/* Merging t-digest of a set of samples: centroids sorted by mean, small
+ * near both tails and larger towards the median, so extreme percentiles
+ * stay accurate. Its size is fixed, and merging two sketches gives a
+ * sketch of both sets of samples. */
+typedef struct QuantileSketch
+{
+  uint64_t count;
+  double min;
+  double max;
+  int numcentroids;
+  double means[QUANTILECENTROIDS];
+  double weights[QUANTILECENTROIDS];
+} QuantileSketch;
+
+void initQuantileSketch (QuantileSketch *sketch);
+void addQuantileSketch (QuantileSketch *sketch, const void *samples, char sampletype, int64_t count);
+void mergeQuantileSketch (QuantileSketch *sketch, const QuantileSketch *other);
+double getQuantileSketchValue (const QuantileSketch *sketch, double quantile);
+int testQuantileSketch (void);
+
+#endif
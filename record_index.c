@@ -0,0 +1,533 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input_map.h"
+#include "record_index.h"
+#include "stage_stats.h"
+
+/* Sidecar index <mseedfile>.idx, in the byte order and layout of the
+ * host like the .rmsb outputs: the header, the traces, the records */
+#define INDEXMAGIC "MS2RMSIX"
+#define INDEXVERSION 1
+
+typedef struct IndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t numtraces;
+  uint64_t numrecords;
+  uint64_t filesize;
+  int64_t mtime;
+} IndexHeader;
+
+/* Size and modification time of a file, to tell whether an index of it
+ * is still current */
+static int
+getFileStamp (const char *path, uint64_t *filesize, int64_t *mtime)
+{
+  struct stat sb;
+
+  if (stat (path, &sb))
+  {
+    ms_log (2, "Error stating file %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+  *filesize = sb.st_size;
+  *mtime    = (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+
+  return 0;
+}
+
+/* Position of the trace of a source ID, added when new */
+static int
+getIndexTrace (RecordIndex *index, const char *sid, int *capacity)
+{
+  IndexTrace *trace;
+  size_t length;
+  int i;
+
+  /* Records of a source ID mostly follow each other */
+  for (i = index->numtraces - 1; i >= 0; i--)
+  {
+    if (strcmp (index->traces[i].sid, sid) == 0)
+      return i;
+  }
+
+  if (index->numtraces == *capacity)
+  {
+    int grown          = (*capacity) ? *capacity * 2 : 16;
+    IndexTrace *traces = (IndexTrace *)realloc (index->traces, sizeof (IndexTrace) * grown);
+    if (traces == NULL)
+      return -1;
+    index->traces = traces;
+    *capacity     = grown;
+  }
+
+  trace = &index->traces[index->numtraces];
+  memset (trace, 0, sizeof (IndexTrace));
+  length = strnlen (sid, sizeof (trace->sid) - 1);
+  memcpy (trace->sid, sid, length);
+  trace->sid[length] = '\0';
+
+  return index->numtraces++;
+}
+
+static int
+compareIndexRecords (const void *a, const void *b)
+{
+  const IndexRecord *x = (const IndexRecord *)a;
+  const IndexRecord *y = (const IndexRecord *)b;
+
+  if (x->trace != y->trace)
+    return (x->trace < y->trace) ? -1 : 1;
+  if (x->starttime != y->starttime)
+    return (x->starttime < y->starttime) ? -1 : 1;
+  return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+/* Index a miniSEED file by parsing the fixed header of every record,
+ * without CRC checks or decoding. Data that is not miniSEED is skipped
+ * as by the stream reader. */
+int
+buildRecordIndex (const char *mseedfile, RecordIndex *index)
+{
+  MS3Record *msr    = NULL;
+  int64_t capacity  = 0;
+  int traceCapacity = 0;
+  uint64_t offset   = 0;
+  StageTimer timer;
+  InputMap map;
+  int64_t i;
+  int trace;
+  int rv;
+
+  memset (index, 0, sizeof (RecordIndex));
+
+  if ((rv = openInputMap (mseedfile, &map)) != 0)
+  {
+    if (rv > 0)
+      ms_log (2, "Cannot index %s, not a regular file\n", mseedfile);
+    return -1;
+  }
+  if (getFileStamp (mseedfile, &index->filesize, &index->mtime))
+  {
+    closeInputMap (&map);
+    return -1;
+  }
+
+  rv = 0;
+  startStage (&timer);
+  while (offset < map.length)
+  {
+    int parsed = msr3_parse (map.buffer + offset, map.length - offset, &msr, 0, 0);
+
+    /* A record cut short at the end of the file */
+    if (parsed > 0)
+      break;
+    if (parsed < 0)
+    {
+      offset++;
+      continue;
+    }
+
+    if ((trace = getIndexTrace (index, msr->sid, &traceCapacity)) < 0)
+    {
+      rv = -1;
+      break;
+    }
+    if (index->numrecords == capacity)
+    {
+      int64_t grown        = (capacity) ? capacity * 2 : 4096;
+      IndexRecord *records = (IndexRecord *)realloc (index->records, sizeof (IndexRecord) * grown);
+      if (records == NULL)
+      {
+        rv = -1;
+        break;
+      }
+      index->records = records;
+      capacity       = grown;
+    }
+
+    IndexRecord *record = &index->records[index->numrecords++];
+    record->starttime   = msr->starttime;
+    record->endtime     = msr3_endtime (msr);
+    record->offset      = offset;
+    record->reclen      = msr->reclen;
+    record->trace       = trace;
+
+    offset += msr->reclen;
+  }
+  endStage (&timer, STAGE_PARSE);
+  countStage (COUNT_RECORDS, index->numrecords);
+
+  if (msr)
+    msr3_free (&msr);
+  closeInputMap (&map);
+  if (rv)
+  {
+    ms_log (2, "Cannot allocate the record index of %s\n", mseedfile);
+    freeRecordIndex (index);
+    return -1;
+  }
+
+  /* Group the records by source ID, in time order within each */
+  qsort (index->records, index->numrecords, sizeof (IndexRecord), compareIndexRecords);
+  for (i = 0; i < index->numrecords; i++)
+  {
+    IndexTrace *t = &index->traces[index->records[i].trace];
+    nstime_t span = index->records[i].endtime - index->records[i].starttime;
+
+    if (t->numrecords++ == 0)
+      t->first = i;
+    if (span > t->maxspan)
+      t->maxspan = span;
+  }
+
+  return 0;
+}
+
+/* Whether the file still has the size and modification time it had
+ * when indexed */
+int
+isRecordIndexCurrent (const char *mseedfile, const RecordIndex *index)
+{
+  uint64_t filesize;
+  int64_t mtime;
+
+  if (getFileStamp (mseedfile, &filesize, &mtime))
+    return 0;
+
+  return (filesize == index->filesize && mtime == index->mtime);
+}
+
+/* Read the sidecar index of a file. Returns 0 on success, 1 when there
+ * is none or it is out of date, -1 on error. */
+int
+readRecordIndex (const char *mseedfile, RecordIndex *index)
+{
+  IndexHeader header;
+  char path[1024];
+  FILE *file;
+  int rv = 0;
+
+  memset (index, 0, sizeof (RecordIndex));
+  snprintf (path, sizeof (path), "%s.idx", mseedfile);
+  if ((file = fopen (path, "rb")) == NULL)
+  {
+    if (errno == ENOENT)
+      return 1;
+    ms_log (2, "Error opening file %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+
+  if (fread (&header, sizeof (IndexHeader), 1, file) != 1 ||
+      memcmp (header.magic, INDEXMAGIC, sizeof (header.magic)) || header.version != INDEXVERSION)
+  {
+    ms_log (1, "Ignoring unreadable index %s\n", path);
+    fclose (file);
+    return 1;
+  }
+
+  index->filesize = header.filesize;
+  index->mtime    = header.mtime;
+  if (!isRecordIndexCurrent (mseedfile, index))
+  {
+    fclose (file);
+    memset (index, 0, sizeof (RecordIndex));
+    return 1;
+  }
+
+  index->numtraces  = header.numtraces;
+  index->numrecords = header.numrecords;
+  index->traces     = (IndexTrace *)malloc (sizeof (IndexTrace) * (header.numtraces + 1));
+  index->records    = (IndexRecord *)malloc (sizeof (IndexRecord) * (header.numrecords + 1));
+  if (index->traces == NULL || index->records == NULL ||
+      fread (index->traces, sizeof (IndexTrace), header.numtraces, file) != header.numtraces ||
+      fread (index->records, sizeof (IndexRecord), header.numrecords, file) != header.numrecords)
+  {
+    ms_log (2, "Cannot read index %s\n", path);
+    freeRecordIndex (index);
+    rv = -1;
+  }
+  fclose (file);
+
+  return rv;
+}
+
+/* Write the index of a file to <mseedfile>.idx */
+int
+writeRecordIndex (const char *mseedfile, const RecordIndex *index)
+{
+  IndexHeader header;
+  char path[1024];
+  FILE *file;
+  int rv = 0;
+
+  memset (&header, 0, sizeof (IndexHeader));
+  memcpy (header.magic, INDEXMAGIC, sizeof (header.magic));
+  header.version    = INDEXVERSION;
+  header.numtraces  = index->numtraces;
+  header.numrecords = index->numrecords;
+  header.filesize   = index->filesize;
+  header.mtime      = index->mtime;
+
+  snprintf (path, sizeof (path), "%s.idx", mseedfile);
+  if ((file = fopen (path, "wb")) == NULL)
+  {
+    ms_log (2, "Error opening file %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+  if (fwrite (&header, sizeof (IndexHeader), 1, file) != 1 ||
+      fwrite (index->traces, sizeof (IndexTrace), index->numtraces, file) != (size_t)index->numtraces ||
+      fwrite (index->records, sizeof (IndexRecord), index->numrecords, file) != (size_t)index->numrecords)
+    rv = -1;
+  if (fclose (file))
+    rv = -1;
+  if (rv)
+  {
+    ms_log (2, "Cannot write index %s\n", path);
+    unlink (path);
+  }
+
+  return rv;
+}
+
+/* The sidecar index of a file when it is current, otherwise one built
+ * in memory */
+int
+openRecordIndex (const char *mseedfile, RecordIndex *index)
+{
+  int rv = readRecordIndex (mseedfile, index);
+
+  return (rv > 0) ? buildRecordIndex (mseedfile, index) : rv;
+}
+
+void
+freeRecordIndex (RecordIndex *index)
+{
+  free (index->traces);
+  free (index->records);
+  memset (index, 0, sizeof (RecordIndex));
+}
+
+static int
+compareIndexRanges (const void *a, const void *b)
+{
+  const IndexRange *x = (const IndexRange *)a;
+  const IndexRange *y = (const IndexRange *)b;
+
+  return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+/* Growing list of the byte ranges of selected records */
+typedef struct RangeList
+{
+  IndexRange *ranges;
+  int64_t numranges;
+  int64_t capacity;
+} RangeList;
+
+/* Add the records of source IDs matching sidPattern (NULL for all)
+ * that overlap [start, end), either bound NSTUNSET for none. Records are
+ * found by binary search on their start time. */
+static int
+addIndexRanges (const RecordIndex *index, const char *sidPattern, nstime_t start, nstime_t end,
+                RangeList *list)
+{
+  int t;
+
+  for (t = 0; t < index->numtraces; t++)
+  {
+    const IndexTrace *trace    = &index->traces[t];
+    const IndexRecord *records = index->records + trace->first;
+    int64_t lo                 = 0;
+    int64_t hi                 = trace->numrecords;
+    int64_t mid;
+
+    if (sidPattern && !ms_globmatch (trace->sid, sidPattern))
+      continue;
+
+    /* No record starting before start - maxspan can reach start */
+    if (start != NSTUNSET)
+    {
+      while (lo < hi)
+      {
+        mid = lo + (hi - lo) / 2;
+        if (records[mid].starttime < start - trace->maxspan)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+    }
+
+    for (; lo < trace->numrecords && (end == NSTUNSET || records[lo].starttime < end); lo++)
+    {
+      if (start != NSTUNSET && records[lo].endtime < start)
+        continue;
+
+      if (list->numranges == list->capacity)
+      {
+        int64_t grown      = (list->capacity) ? list->capacity * 2 : 1024;
+        IndexRange *larger = (IndexRange *)realloc (list->ranges, sizeof (IndexRange) * grown);
+        if (larger == NULL)
+        {
+          ms_log (2, "Cannot allocate index ranges\n");
+          return -1;
+        }
+        list->ranges   = larger;
+        list->capacity = grown;
+      }
+      list->ranges[list->numranges].offset   = records[lo].offset;
+      list->ranges[list->numranges++].length = records[lo].reclen;
+    }
+  }
+
+  return 0;
+}
+
+/* Sort the ranges of a list into file order and merge those following
+ * or overlapping each other, handing them over to *ranges. Returns their
+ * number. */
+static int64_t
+mergeIndexRanges (RangeList *list, IndexRange **ranges)
+{
+  IndexRange *selected = list->ranges;
+  int64_t count        = 0;
+  int64_t i;
+
+  *ranges = NULL;
+  if (list->numranges == 0)
+  {
+    free (selected);
+    return 0;
+  }
+
+  qsort (selected, list->numranges, sizeof (IndexRange), compareIndexRanges);
+  for (i = 1; i < list->numranges; i++)
+  {
+    uint64_t end = selected[count].offset + selected[count].length;
+
+    if (selected[i].offset <= end)
+    {
+      if (selected[i].offset + selected[i].length > end)
+        selected[count].length = selected[i].offset + selected[i].length - selected[count].offset;
+    }
+    else
+    {
+      selected[++count] = selected[i];
+    }
+  }
+  *ranges = selected;
+
+  return count + 1;
+}
+
+/* Byte ranges of the records of source IDs matching sidPattern (NULL
+ * for all) that overlap [start, end), either bound NSTUNSET for none.
+ * Adjacent records are merged into one range, in file order. Returns
+ * the number of ranges stored in a new *ranges array, -1 on error. */
+int64_t
+selectIndexRanges (const RecordIndex *index, const char *sidPattern, nstime_t start,
+                   nstime_t end, IndexRange **ranges)
+{
+  RangeList list = {NULL, 0, 0};
+
+  *ranges = NULL;
+  if (addIndexRanges (index, sidPattern, start, end, &list))
+  {
+    free (list.ranges);
+    return -1;
+  }
+
+  return mergeIndexRanges (&list, ranges);
+}
+
+/* Byte ranges of the records any of a set of libmseed selections may
+ * match, on source ID and time only, as selectIndexRanges() */
+int64_t
+selectIndexSelections (const RecordIndex *index, const MS3Selections *selections, IndexRange **ranges)
+{
+  RangeList list = {NULL, 0, 0};
+  const MS3SelectTime *window;
+  int rv = 0;
+
+  *ranges = NULL;
+  for (; rv == 0 && selections; selections = selections->next)
+  {
+    if (selections->timewindows == NULL)
+      rv = addIndexRanges (index, selections->sidpattern, NSTUNSET, NSTUNSET, &list);
+    for (window = selections->timewindows; rv == 0 && window; window = window->next)
+      rv = addIndexRanges (index, selections->sidpattern, window->starttime, window->endtime, &list);
+  }
+  if (rv)
+  {
+    free (list.ranges);
+    return -1;
+  }
+
+  return mergeIndexRanges (&list, ranges);
+}
+
+/* Read the byte ranges of a file, one after the other, into a new
+ * buffer */
+int
+readIndexRanges (const char *mseedfile, const IndexRange *ranges, int64_t numranges,
+                 char **buffer, uint64_t *length)
+{
+  uint64_t total = 0;
+  uint64_t done  = 0;
+  StageTimer timer;
+  int64_t i;
+  int fd;
+
+  *buffer = NULL;
+  *length = 0;
+  for (i = 0; i < numranges; i++)
+    total += ranges[i].length;
+
+  if ((fd = open (mseedfile, O_RDONLY)) < 0)
+  {
+    ms_log (2, "Error opening file %s: %s\n", mseedfile, strerror (errno));
+    return -1;
+  }
+  if ((*buffer = (char *)malloc (total > 0 ? total : 1)) == NULL)
+  {
+    ms_log (2, "Cannot allocate %" PRIsize_t " bytes for %s\n", (size_t)total, mseedfile);
+    close (fd);
+    return -1;
+  }
+
+  startStage (&timer);
+  for (i = 0; i < numranges; i++)
+  {
+    uint64_t got = 0;
+    while (got < ranges[i].length)
+    {
+      ssize_t bytes = pread (fd, *buffer + done + got, ranges[i].length - got, ranges[i].offset + got);
+      if (bytes < 0 && errno == EINTR)
+        continue;
+      if (bytes <= 0)
+      {
+        ms_log (2, "Error reading %s: %s\n", mseedfile, (bytes < 0) ? strerror (errno) : "file shrank");
+        free (*buffer);
+        *buffer = NULL;
+        close (fd);
+        return -1;
+      }
+      got += bytes;
+    }
+    done += got;
+  }
+  endStage (&timer, STAGE_READ);
+  countStage (COUNT_BYTESREAD, total);
+  close (fd);
+
+  *length = total;
+
+  return 0;
+}
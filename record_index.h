@@ -0,0 +1,59 @@
+#ifndef RECORD_INDEX_H
+#define RECORD_INDEX_H
+
+#include <stdint.h>
+
+#include "libmseed.h"
+
+/* Location of one record and the time it covers */
+typedef struct IndexRecord
+{
+  nstime_t starttime;
+  nstime_t endtime; /* Time of the last sample */
+  uint64_t offset;
+  uint32_t reclen;
+  uint32_t trace; /* Position in RecordIndex.traces */
+} IndexRecord;
+
+/* The records of one source ID, a run of RecordIndex.records */
+typedef struct IndexTrace
+{
+  char sid[LM_SIDLEN];
+  int64_t first;
+  int64_t numrecords;
+  nstime_t maxspan; /* Longest endtime - starttime of its records */
+} IndexTrace;
+
+/* Every record of a miniSEED file, grouped by source ID and sorted by
+ * start time within each, so time queries are binary searches */
+typedef struct RecordIndex
+{
+  uint64_t filesize; /* Of the file indexed, to notice changes */
+  int64_t mtime;     /* Modification time in nanoseconds */
+  int numtraces;
+  IndexTrace *traces;
+  int64_t numrecords;
+  IndexRecord *records;
+} RecordIndex;
+
+/* A run of adjacent selected records */
+typedef struct IndexRange
+{
+  uint64_t offset;
+  uint64_t length;
+} IndexRange;
+
+int buildRecordIndex (const char *mseedfile, RecordIndex *index);
+int readRecordIndex (const char *mseedfile, RecordIndex *index);
+int writeRecordIndex (const char *mseedfile, const RecordIndex *index);
+int openRecordIndex (const char *mseedfile, RecordIndex *index);
+int isRecordIndexCurrent (const char *mseedfile, const RecordIndex *index);
+void freeRecordIndex (RecordIndex *index);
+int64_t selectIndexRanges (const RecordIndex *index, const char *sidPattern, nstime_t start,
+                           nstime_t end, IndexRange **ranges);
+int64_t selectIndexSelections (const RecordIndex *index, const MS3Selections *selections,
+                               IndexRange **ranges);
+int readIndexRanges (const char *mseedfile, const IndexRange *ranges, int64_t numranges,
+                     char **buffer, uint64_t *length);
+
+#endif
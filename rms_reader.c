@@ -0,0 +1,78 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rms_reader.h"
+
+_Static_assert (sizeof (RMSBHeader) == 128, "RMSBHeader must stay 128 bytes");
+
+/* Map a .rmsb file and point the columns into it. Nothing is parsed or
+ * copied, so opening costs the same for any number of windows.
+ * Returns 0 on success and -1 on error. */
+int
+openRMSReader (RMSReader *reader, const char *path)
+{
+  const RMSBHeader *header;
+  struct stat sb;
+  const char *base;
+  int fd;
+
+  memset (reader, 0, sizeof (RMSReader));
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+  {
+    fprintf (stderr, "Cannot open %s\n", path);
+    return -1;
+  }
+  if (fstat (fd, &sb) || (size_t)sb.st_size < sizeof (RMSBHeader))
+  {
+    fprintf (stderr, "%s is not a .rmsb file\n", path);
+    close (fd);
+    return -1;
+  }
+
+  reader->length = sb.st_size;
+  reader->map    = mmap (NULL, reader->length, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (reader->map == MAP_FAILED)
+  {
+    fprintf (stderr, "Cannot map %s\n", path);
+    reader->map = NULL;
+    return -1;
+  }
+
+  header = (const RMSBHeader *)reader->map;
+  if (memcmp (header->magic, RMSBMAGIC, 4) || header->version != RMSBVERSION ||
+      header->byteorder != RMSBBYTEORDER || header->numcolumns != RMSBCOLUMNS ||
+      header->numwindows < 0 ||
+      reader->length < header->headersize + (size_t)header->numwindows * RMSBCOLUMNS * 8)
+  {
+    fprintf (stderr, "%s is not a .rmsb file of this version and byte order\n", path);
+    closeRMSReader (reader);
+    return -1;
+  }
+
+  base               = (const char *)reader->map + header->headersize;
+  reader->header     = header;
+  reader->numwindows = header->numwindows;
+  reader->timestamp  = (const int64_t *)base;
+  reader->mean       = (const double *)base + 1 * header->numwindows;
+  reader->SD         = (const double *)base + 2 * header->numwindows;
+  reader->min        = (const double *)base + 3 * header->numwindows;
+  reader->max        = (const double *)base + 4 * header->numwindows;
+  reader->minDemean  = (const double *)base + 5 * header->numwindows;
+  reader->maxDemean  = (const double *)base + 6 * header->numwindows;
+
+  return 0;
+}
+
+void
+closeRMSReader (RMSReader *reader)
+{
+  if (reader->map)
+    munmap (reader->map, reader->length);
+  memset (reader, 0, sizeof (RMSReader));
+}
@@ -0,0 +1,52 @@
+#ifndef RMS_READER_H
+#define RMS_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RMSBMAGIC "RMSB"
+#define RMSBVERSION 1
+#define RMSBCOLUMNS 7
+#define RMSBBYTEORDER 0x01020304
+
+/* Fixed 128 byte header of a .rmsb file. It is followed by RMSBCOLUMNS
+ * contiguous arrays of numwindows 8-byte values each, in this order:
+ * timestamp (int64_t nanoseconds after timebase), mean, SD, min, max,
+ * minDemean and maxDemean (double). Values are in the byte order of the
+ * writer, which byteorder reads as RMSBBYTEORDER on matching hosts. */
+typedef struct RMSBHeader
+{
+  char magic[4];
+  uint16_t version;
+  uint16_t headersize;
+  uint32_t byteorder;
+  uint32_t numcolumns;
+  int64_t numwindows;
+  int64_t timebase; /* nstime_t of the first window time stamp */
+  char network[16];
+  char station[16];
+  char location[16];
+  char channel[32];
+  uint8_t reserved[16];
+} RMSBHeader;
+
+/* A .rmsb file mapped read-only, columns point into the mapping */
+typedef struct RMSReader
+{
+  const RMSBHeader *header;
+  int64_t numwindows;
+  const int64_t *timestamp;
+  const double *mean;
+  const double *SD;
+  const double *min;
+  const double *max;
+  const double *minDemean;
+  const double *maxDemean;
+  void *map;
+  size_t length;
+} RMSReader;
+
+int openRMSReader (RMSReader *reader, const char *path);
+void closeRMSReader (RMSReader *reader);
+
+#endif
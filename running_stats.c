@@ -0,0 +1,242 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "min_max.h"
+#include "running_stats.h"
+#include "standard_deviation.h"
+
+/* Kahan-Babuska compensated accumulation, applied once per run of
+ * samples so the per-sample sums stay in the vectorized kernels */
+static inline void
+accumulate (double *sum, double *comp, double value)
+{
+  double t = *sum + value;
+
+  if ((t >= 0 ? t : -t) >= (*sum >= 0 ? *sum : -*sum))
+    *comp += (*sum - t) + value;
+  else
+    *comp += (value - t) + *sum;
+  *sum = t;
+}
+
+void
+initRunningStats (RunningStats *stats)
+{
+  memset (stats, 0, sizeof (RunningStats));
+}
+
+void
+addRunningStats (RunningStats *stats, const void *samples, char sampletype, int64_t count)
+{
+  KernelSums sums;
+
+  if (count <= 0)
+    return;
+
+  if (stats->count == 0)
+    stats->shift = stats->min = stats->max = sampleValueAt (samples, sampletype, 0);
+
+  sumSamples (samples, sampletype, count, stats->shift, &sums);
+
+  stats->count += count;
+  stats->icount += sums.icount;
+  stats->isum += sums.isum;
+  stats->isumsq += sums.isumsq;
+  accumulate (&stats->sum, &stats->sumComp, sums.sum);
+  accumulate (&stats->sumsq, &stats->sumsqComp, sums.sumsq);
+  stats->min = (sums.min < stats->min) ? sums.min : stats->min;
+  stats->max = (sums.max > stats->max) ? sums.max : stats->max;
+}
+
+/* Accumulate every span in turn, e.g. the pieces of a window split by
+ * gaps, without gathering them into one array */
+void
+addRunningStatsSpans (RunningStats *stats, const StatsSpan *spans, int numspans)
+{
+  int i;
+
+  for (i = 0; i < numspans; i++)
+    addRunningStats (stats, spans[i].samples, spans[i].sampletype, spans[i].count);
+}
+
+/* Take samples added before out of the sums again. The extrema are not
+ * updated, callers removing samples track them on their own. */
+void
+removeRunningStats (RunningStats *stats, const void *samples, char sampletype, int64_t count)
+{
+  KernelSums sums;
+
+  if (count <= 0)
+    return;
+
+  sumSamples (samples, sampletype, count, stats->shift, &sums);
+
+  stats->count -= count;
+  stats->icount -= sums.icount;
+  stats->isum -= sums.isum;
+  stats->isumsq -= sums.isumsq;
+  accumulate (&stats->sum, &stats->sumComp, -sums.sum);
+  accumulate (&stats->sumsq, &stats->sumsqComp, -sums.sumsq);
+}
+
+/* Add the summary of another, disjoint set of samples. Its floating
+ * point sums are moved from its shift to this one:
+ * sum(x - a) = sum(x - b) + n (b - a) and
+ * sum((x - a)^2) = sum((x - b)^2) + 2 (b - a) sum(x - b) + n (b - a)^2 */
+void
+mergeRunningStats (RunningStats *stats, const RunningStats *other)
+{
+  double n, delta, sum, sumsq;
+
+  if (other->count == 0)
+    return;
+  if (stats->count == 0)
+  {
+    *stats = *other;
+    return;
+  }
+
+  n     = (double)(other->count - other->icount);
+  delta = other->shift - stats->shift;
+  sum   = other->sum + other->sumComp;
+  sumsq = other->sumsq + other->sumsqComp;
+
+  stats->count += other->count;
+  stats->icount += other->icount;
+  stats->isum += other->isum;
+  stats->isumsq += other->isumsq;
+  accumulate (&stats->sum, &stats->sumComp, sum + n * delta);
+  accumulate (&stats->sumsq, &stats->sumsqComp, sumsq + 2 * delta * sum + n * delta * delta);
+  stats->min = (other->min < stats->min) ? other->min : stats->min;
+  stats->max = (other->max > stats->max) ? other->max : stats->max;
+}
+
+void
+getRunningStatsResult (const RunningStats *stats, WindowStats *result)
+{
+  double mean, variance;
+
+  if (stats->count == 0)
+  {
+    makeWindowStats (0, 0.0, 0.0, 0.0, 0.0, result);
+    return;
+  }
+
+  getSampleMoments (stats->icount, stats->isum, stats->isumsq,
+                    stats->count - stats->icount, stats->shift,
+                    stats->sum + stats->sumComp, stats->sumsq + stats->sumsqComp,
+                    &mean, &variance);
+  makeWindowStats (stats->count, mean, variance, stats->min, stats->max, result);
+}
+
+/* True when a summary matches the two pass results over the same
+ * samples. Rounded values must be equal, unless the unrounded value sits
+ * on a rounding edge where the summation order alone decides. */
+static int
+matchesTwoPass (const RunningStats *stats, const double *data, int64_t count)
+{
+  double mean, SD, min, max, minDemean, maxDemean;
+  double refMean = 0.0, refVar = 0.0, kMean, kVar;
+  WindowStats result;
+  int64_t i;
+
+  getMeanAndSD ((double *)data, count, &mean, &SD);
+  getMinMaxAndDemean ((double *)data, count, &min, &max, &minDemean, &maxDemean, mean);
+  getRunningStatsResult (stats, &result);
+
+  if (result.min != min || result.max != max)
+    return 0;
+  if (result.mean == mean && result.SD == SD &&
+      result.minDemean == minDemean && result.maxDemean == maxDemean)
+    return 1;
+
+  for (i = 0; i < count; i++)
+    refMean += data[i];
+  refMean /= count;
+  for (i = 0; i < count; i++)
+    refVar += (data[i] - refMean) * (data[i] - refMean);
+  refVar /= count;
+
+  getSampleMoments (stats->icount, stats->isum, stats->isumsq,
+                    stats->count - stats->icount, stats->shift,
+                    stats->sum + stats->sumComp, stats->sumsq + stats->sumsqComp,
+                    &kMean, &kVar);
+
+  return fabs (kMean - refMean) <= 1e-9 * fmax (1.0, fabs (refMean)) &&
+         fabs (sqrt (fmax (kVar, 0.0)) - sqrt (refVar)) <= 1e-9 * fmax (1.0, sqrt (refVar));
+}
+
+/* Check spans of mixed sample types, accumulated directly and merged
+ * from partial summaries, against getMeanAndSD() and
+ * getMinMaxAndDemean() over the same samples gathered into one array.
+ * Returns the number of failed checks. */
+int
+testRunningStats (void)
+{
+  static const char types[] = {'i', 'f', 'd'};
+  int failures = 0;
+  int trial, i;
+
+  srand (20200317);
+  for (trial = 0; trial < 200; trial++)
+  {
+    int numspans = 1 + rand () % 8;
+    StatsSpan spans[8];
+    void *buffers[8];
+    double *data;
+    int64_t total = 0, j;
+    double offset = (trial % 2) ? 1.0e6 : 0.0;
+    RunningStats whole, left, right;
+
+    for (i = 0; i < numspans; i++)
+    {
+      spans[i].count      = 1 + rand () % 3000;
+      spans[i].sampletype = types[rand () % 3];
+      buffers[i]          = malloc (sizeof (double) * spans[i].count);
+      spans[i].samples    = buffers[i];
+      total += spans[i].count;
+    }
+    data = (double *)malloc (sizeof (double) * total);
+
+    for (i = 0, total = 0; i < numspans; i++)
+    {
+      for (j = 0; j < spans[i].count; j++, total++)
+      {
+        double value = offset + (double)(rand () % 20001 - 10000);
+
+        if (spans[i].sampletype == 'i')
+          data[total] = ((int32_t *)buffers[i])[j] = (int32_t)value;
+        else if (spans[i].sampletype == 'f')
+          data[total] = ((float *)buffers[i])[j] = (float)(value + (rand () % 100) / 100.0);
+        else
+          data[total] = ((double *)buffers[i])[j] = value + (rand () % 1000) / 1000.0;
+      }
+    }
+
+    initRunningStats (&whole);
+    addRunningStatsSpans (&whole, spans, numspans);
+
+    /* Split at a span boundary, each half with its own shift */
+    initRunningStats (&left);
+    initRunningStats (&right);
+    addRunningStatsSpans (&left, spans, numspans / 2);
+    addRunningStatsSpans (&right, spans + numspans / 2, numspans - numspans / 2);
+    mergeRunningStats (&left, &right);
+
+    if (!matchesTwoPass (&whole, data, total) || !matchesTwoPass (&left, data, total))
+    {
+      printf ("Running statistics FAILED for %d spans, %" PRId64 " samples\n", numspans, total);
+      failures++;
+    }
+
+    for (i = 0; i < numspans; i++)
+      free (buffers[i]);
+    free (data);
+  }
+  printf ("running statistics checked\n");
+
+  return failures;
+}
@@ -0,0 +1,37 @@
+#ifndef RUNNING_STATS_H
+#define RUNNING_STATS_H
+
+#include <stdint.h>
+
+#include "stats_kernel.h"
+#include "window_stats.h"
+
+/* Mergeable summary of a set of samples. Integer samples are summed
+ * exactly, floating point samples minus a reference value, the first
+ * sample added, which keeps the sum of squares well conditioned for
+ * data with a large offset. Floating point sums carry a compensation
+ * term, so adding and removing many runs does not drift. */
+typedef struct RunningStats
+{
+  uint64_t count;
+  uint64_t icount;
+  int64_t isum;
+  __int128 isumsq;
+  double shift;
+  double sum;
+  double sumComp;
+  double sumsq;
+  double sumsqComp;
+  double min;
+  double max;
+} RunningStats;
+
+void initRunningStats (RunningStats *stats);
+void addRunningStats (RunningStats *stats, const void *samples, char sampletype, int64_t count);
+void addRunningStatsSpans (RunningStats *stats, const StatsSpan *spans, int numspans);
+void removeRunningStats (RunningStats *stats, const void *samples, char sampletype, int64_t count);
+void mergeRunningStats (RunningStats *stats, const RunningStats *other);
+void getRunningStatsResult (const RunningStats *stats, WindowStats *result);
+int testRunningStats (void);
+
+#endif
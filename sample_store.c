@@ -0,0 +1,918 @@
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "input_map.h"
+#include "sample_store.h"
+#include "stage_stats.h"
+
+static nstime_t NSECS = 1000000000;
+
+/* Records taken at a time by a decoding thread */
+#define DECODEBATCH 32
+
+/* A record and the place of its samples in the store */
+typedef struct RecordTask
+{
+  const MS3RecordPtr *rec;
+  char *output;
+  uint8_t samplesize;
+  char sampletype; /* Of the segment, every record has to match it */
+} RecordTask;
+
+/* The records of a store, decoded by several threads */
+typedef struct DecodeJob
+{
+  RecordTask *tasks;
+  int64_t numtasks;
+  atomic_int_fast64_t next; /* First task not taken yet */
+  atomic_int failed;
+} DecodeJob;
+
+/* Zeroed memory living as long as the store */
+static void *
+storeAlloc (SampleStore *store, size_t size)
+{
+  void *ptr;
+
+  if (store->arena)
+    ptr = arenaAlloc (store->arena, size);
+  else
+    ptr = malloc (size);
+  if (ptr == NULL)
+    ms_log (2, "Cannot allocate %zu bytes for the sample store\n", size);
+  else
+    memset (ptr, 0, size);
+
+  return ptr;
+}
+
+/* Unpacked sample type and size of a trace segment, taken from its
+ * records when they are not unpacked yet. Returns the sample count,
+ * 0 for segments without samples to compute statistics on. */
+static int64_t
+segmentSampleType (const MS3TraceSeg *seg, char *sampletype, uint8_t *samplesize)
+{
+  if (seg->datasamples)
+  {
+    *sampletype = seg->sampletype;
+    *samplesize = (seg->sampletype == 'd') ? 8 : 4;
+    return (seg->sampletype == 'a') ? 0 : seg->numsamples;
+  }
+
+  if (seg->recordlist == NULL || seg->recordlist->first == NULL ||
+      ms_encoding_sizetype (seg->recordlist->first->msr->encoding, samplesize, sampletype))
+    return 0;
+
+  /* Text payloads carry no samples to compute statistics on */
+  return (*sampletype == 'a') ? 0 : seg->samplecnt;
+}
+
+/* Queue the records of a segment parsed in place, each with the offset
+ * its samples are decoded to. Returns -1, queueing nothing, when the
+ * segment has to be unpacked by libmseed instead. */
+static int
+addRecordTasks (DecodeJob *job, const MS3TraceSeg *seg, char *block, uint8_t samplesize, char sampletype)
+{
+  const MS3RecordPtr *rec;
+  int64_t numtasks = job->numtasks;
+  int64_t offset   = 0;
+
+  for (rec = seg->recordlist->first; rec; rec = rec->next)
+  {
+    if (rec->bufferptr == NULL)
+      break;
+
+    job->tasks[numtasks].rec        = rec;
+    job->tasks[numtasks].output     = block + offset * samplesize;
+    job->tasks[numtasks].samplesize = samplesize;
+    job->tasks[numtasks].sampletype = sampletype;
+    numtasks++;
+    offset += rec->msr->samplecnt;
+  }
+  if (rec || offset != seg->samplecnt)
+    return -1;
+
+  job->numtasks = numtasks;
+  return 0;
+}
+
+/* Offset and size of the encoded data of a record parsed in place */
+static int
+recordDataBounds (const MS3RecordPtr *rec, uint32_t *offset, uint32_t *size)
+{
+  const MS3Record *msr   = rec->msr;
+  const uint8_t *record = (const uint8_t *)rec->bufferptr;
+  uint16_t begin;
+
+  if (msr->formatversion == 3)
+  {
+    /* Fixed header, source ID and extra headers */
+    *offset = 40 + record[33] + msr->extralength;
+    *size   = msr->datalength;
+  }
+  else
+  {
+    /* Beginning of data field of the fixed header, in its byte order */
+    memcpy (&begin, record + 44, sizeof (begin));
+    if (msr->swapflag & MSSWAP_HEADER)
+      begin = (uint16_t) (begin << 8 | begin >> 8);
+    *offset = begin;
+    *size   = (*offset < (uint32_t)msr->reclen) ? msr->reclen - *offset : 0;
+  }
+
+  return (*offset + *size <= (uint32_t)msr->reclen) ? 0 : -1;
+}
+
+static int
+decodeRecordTask (const RecordTask *task)
+{
+  const MS3Record *msr = task->rec->msr;
+  uint32_t offset;
+  uint32_t size;
+  char sampletype = task->sampletype;
+  int64_t count   = -1;
+
+  if (recordDataBounds (task->rec, &offset, &size) == 0)
+    count = ms_decode_data (task->rec->bufferptr + offset, size, (uint8_t)msr->encoding, msr->samplecnt,
+                            task->output, msr->samplecnt * task->samplesize, &sampletype,
+                            (msr->swapflag & MSSWAP_PAYLOAD) ? 1 : 0, msr->sid, 0);
+  if (count != msr->samplecnt || sampletype != task->sampletype)
+  {
+    ms_log (2, "Cannot unpack samples of %s: decoded %" PRId64 " of %" PRId64 "\n",
+            msr->sid, count, msr->samplecnt);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void *
+decodeWorker (void *arg)
+{
+  DecodeJob *job = (DecodeJob *)arg;
+  StageTimer timer;
+  int64_t first;
+  int64_t last;
+
+  while (!atomic_load (&job->failed) &&
+         (first = atomic_fetch_add (&job->next, DECODEBATCH)) < job->numtasks)
+  {
+    last = (first + DECODEBATCH < job->numtasks) ? first + DECODEBATCH : job->numtasks;
+
+    startStage (&timer);
+    for (; first < last; first++)
+    {
+      if (decodeRecordTask (&job->tasks[first]))
+      {
+        atomic_store (&job->failed, 1);
+        break;
+      }
+    }
+    endStage (&timer, STAGE_DECODE);
+  }
+
+  return NULL;
+}
+
+/* Decode the queued records, the calling thread being one of the
+ * decoders. Records are independent and write disjoint parts of the
+ * store, so they are taken in batches in any order. */
+static int
+runDecodeJob (DecodeJob *job, int numThreads)
+{
+  int64_t batches    = (job->numtasks + DECODEBATCH - 1) / DECODEBATCH;
+  pthread_t *threads = NULL;
+  int t              = 0;
+
+  atomic_init (&job->next, 0);
+  atomic_init (&job->failed, 0);
+  if (numThreads > batches)
+    numThreads = (int)batches;
+  if (numThreads > 1)
+    threads = (pthread_t *)malloc (sizeof (pthread_t) * (numThreads - 1));
+
+  for (; threads && t < numThreads - 1; t++)
+  {
+    if (pthread_create (&threads[t], NULL, decodeWorker, job))
+    {
+      ms_log (2, "Cannot create decoding thread\n");
+      break;
+    }
+  }
+  decodeWorker (job);
+  while (t-- > 0)
+    pthread_join (threads[t], NULL);
+  free (threads);
+
+  return atomic_load (&job->failed) ? -1 : 0;
+}
+
+/* Build the store from a parsed trace list. All samples go to one block
+ * sized from the record headers, each segment unpacked straight into
+ * its part of it. With a job the records parsed in place are only
+ * queued with their offsets, to be decoded by runDecodeJob(). */
+static int
+fillSampleStore (MS3TraceList *mstl, SampleStore *store, DecodeJob *job, int8_t verbose)
+{
+  MS3TraceID *tid  = NULL;
+  MS3TraceSeg *seg = NULL;
+  size_t total     = 0;
+  char *block;
+  char sampletype;
+  uint8_t samplesize;
+  int64_t count;
+
+  store->traces = (StoreTrace *)storeAlloc (store, sizeof (StoreTrace) * (mstl->numtraces > 0 ? mstl->numtraces : 1));
+  if (store->traces == NULL)
+    return -1;
+
+  for (tid = mstl->traces; tid; tid = tid->next)
+  {
+    for (seg = tid->first; seg; seg = seg->next)
+    {
+      if ((count = segmentSampleType (seg, &sampletype, &samplesize)) > 0)
+        total += (count * samplesize + 7) & ~(size_t)7;
+    }
+  }
+
+  store->buffer = storeAlloc (store, total > 0 ? total : 1);
+  if (store->buffer == NULL)
+    return -1;
+  block = (char *)store->buffer;
+
+  for (tid = mstl->traces; tid; tid = tid->next)
+  {
+    StoreTrace *trace = &store->traces[store->numtraces];
+
+    memcpy (trace->sid, tid->sid, sizeof (trace->sid));
+    trace->earliest = tid->earliest;
+    trace->latest   = tid->latest;
+    trace->segments = (StoreSegment *)storeAlloc (store, sizeof (StoreSegment) * (tid->numsegments > 0 ? tid->numsegments : 1));
+    if (trace->segments == NULL)
+      return -1;
+    store->numtraces++;
+
+    for (seg = tid->first; seg; seg = seg->next)
+    {
+      StoreSegment *segment = &trace->segments[trace->numsegments];
+
+      StageTimer timer;
+
+      if ((count = segmentSampleType (seg, &sampletype, &samplesize)) <= 0)
+        continue;
+
+      startStage (&timer);
+      if (seg->datasamples)
+      {
+        memcpy (block, seg->datasamples, count * samplesize);
+        endStage (&timer, STAGE_CONVERT);
+      }
+      else if (job && addRecordTasks (job, seg, block, samplesize, sampletype) == 0)
+      {
+        /* Decoded once every record has its place */
+      }
+      else if ((count = mstl3_unpack_recordlist (tid, seg, block, count * samplesize, verbose)) < 0)
+      {
+        ms_log (2, "Cannot unpack samples of %s: %s\n", tid->sid, ms_errorstr ((int)count));
+        return -1;
+      }
+      else
+      {
+        endStage (&timer, STAGE_DECODE);
+      }
+      countStage (COUNT_SAMPLES, count);
+
+      segment->starttime  = seg->starttime;
+      segment->samprate   = seg->samprate;
+      segment->offset     = trace->numsamples;
+      segment->numsamples = count;
+      segment->samples    = block;
+      segment->sampletype = sampletype;
+      segment->samplesize = samplesize;
+      block += (count * samplesize + 7) & ~(size_t)7;
+
+      trace->numsamples += count;
+      trace->numsegments++;
+    }
+  }
+
+  return 0;
+}
+
+/* Build the store from a parsed trace list, decoding the records on
+ * numThreads threads, 0 for one per CPU */
+static int
+unpackSampleStore (MS3TraceList *mstl, SampleStore *store, int numThreads, int8_t verbose)
+{
+  MS3TraceID *tid;
+  MS3TraceSeg *seg;
+  DecodeJob job;
+  int64_t numrecords = 0;
+  int rv;
+
+  memset (&job, 0, sizeof (DecodeJob));
+  if (numThreads <= 0)
+    numThreads = (int)sysconf (_SC_NPROCESSORS_ONLN);
+
+  if (numThreads > 1)
+  {
+    for (tid = mstl->traces; tid; tid = tid->next)
+    {
+      for (seg = tid->first; seg; seg = seg->next)
+      {
+        if (seg->datasamples == NULL && seg->recordlist)
+          numrecords += seg->recordlist->recordcnt;
+      }
+    }
+    /* A few records are not worth the threads */
+    if (numrecords > DECODEBATCH)
+      job.tasks = (RecordTask *)malloc (sizeof (RecordTask) * numrecords);
+  }
+
+  rv = fillSampleStore (mstl, store, (job.tasks) ? &job : NULL, verbose);
+  if (rv == 0 && job.numtasks > 0)
+    rv = runDecodeJob (&job, numThreads);
+  free (job.tasks);
+
+  return rv;
+}
+
+/* Check the CRC of a parsed miniSEED 3 record, taken over the whole
+ * record with the CRC field zeroed. Older records carry none. Returns
+ * MS_NOERROR or MS_INVALIDCRC. */
+int
+validateRecordCRC (const char *record, const MS3Record *msr)
+{
+  static const uint8_t zero[4] = {0, 0, 0, 0};
+  uint32_t crc;
+
+  if (msr->formatversion != 3 || msr->reclen < 40)
+    return MS_NOERROR;
+
+  crc = ms_crc32c ((const uint8_t *)record, 28, 0);
+  crc = ms_crc32c (zero, 4, crc);
+  crc = ms_crc32c ((const uint8_t *)record + 32, msr->reclen - 32, crc);
+
+  return (crc == msr->crc) ? MS_NOERROR : MS_INVALIDCRC;
+}
+
+/* Validate every record of a trace list parsed in place from buffer */
+static int
+validateTraceListCRC (MS3TraceList *mstl, const char *buffer)
+{
+  MS3TraceID *tid;
+  MS3TraceSeg *seg;
+  MS3RecordPtr *rec;
+
+  for (tid = mstl->traces; tid; tid = tid->next)
+  {
+    for (seg = tid->first; seg; seg = seg->next)
+    {
+      for (rec = (seg->recordlist) ? seg->recordlist->first : NULL; rec; rec = rec->next)
+      {
+        if (rec->bufferptr && validateRecordCRC (rec->bufferptr, rec->msr))
+        {
+          ms_log (2, "%s: CRC mismatch in record at offset %" PRId64 "\n",
+                  tid->sid, (int64_t)(rec->bufferptr - buffer));
+          return MS_INVALIDCRC;
+        }
+      }
+    }
+  }
+
+  return MS_NOERROR;
+}
+
+/* Parse the records of a buffer in place into a trace list of record
+ * lists, keeping only those matching the selections (NULL for all).
+ * Returns a libmseed error code. */
+static int
+readRecordBuffer (MS3TraceList **mstl, const char *buffer, uint64_t length, uint32_t flags,
+                  const MS3Selections *selections, int8_t verbose)
+{
+  /* With --stats the CRCs are checked on their own to time them apart,
+   * with selections to check only the records selected from their
+   * fixed headers */
+  int validate = (stageStatsEnabled || selections) && (flags & MSF_VALIDATECRC);
+  StageTimer timer;
+  int64_t records;
+  int rv;
+
+  startStage (&timer);
+  records = mstl3_readbuffer_selection (mstl, buffer, length, 0,
+                                        (validate ? flags & ~MSF_VALIDATECRC : flags) | MSF_RECORDLIST,
+                                        NULL, selections, verbose);
+  /* Nothing selected is not an error */
+  rv = (records < 0) ? (int)records : (records == 0 && selections == NULL) ? MS_NOTSEED : MS_NOERROR;
+  endStage (&timer, STAGE_PARSE);
+  countStage (COUNT_RECORDS, (records > 0) ? records : 0);
+
+  if (validate && rv == MS_NOERROR)
+  {
+    startStage (&timer);
+    rv = validateTraceListCRC (*mstl, buffer);
+    endStage (&timer, STAGE_CRC);
+  }
+
+  return rv;
+}
+
+/* Every time window of the selections matching sid, a selection
+ * without time windows taken as one window over all time */
+#define FOREACH_SELECTION_WINDOW(selections, sid, selection, window, whole)                 \
+  for (selection = selections; selection; selection = selection->next)                       \
+    if (ms_globmatch (sid, selection->sidpattern))                                            \
+      for (window = (selection->timewindows) ? selection->timewindows : &whole; window; \
+           window = window->next)
+
+/* Time range [start, end) selected for a source ID after time (NSTUNSET
+ * for the first one): the earliest time window of the selections
+ * matching it that ends later, joined with every window overlapping or
+ * touching it, either bound NSTUNSET for none. Iterating with time set
+ * to the end of the range before walks the union of the time windows in
+ * order, until that end is NSTUNSET. Returns -1 when no range is left,
+ * or no selection matches. */
+int
+nextSelectionRange (const MS3Selections *selections, const char *sid, nstime_t time,
+                    nstime_t *start, nstime_t *end)
+{
+  const MS3Selections *selection;
+  const MS3SelectTime *window;
+  MS3SelectTime whole;
+  int found = 0;
+  int grown = 1;
+
+  whole.starttime = NSTUNSET;
+  whole.endtime   = NSTUNSET;
+  whole.next      = NULL;
+
+  FOREACH_SELECTION_WINDOW (selections, sid, selection, window, whole)
+  {
+    if (window->endtime != NSTUNSET && window->endtime <= time)
+      continue;
+    if (!found || window->starttime < *start)
+    {
+      *start = window->starttime;
+      *end   = window->endtime;
+    }
+    found = 1;
+  }
+  if (!found)
+    return -1;
+
+  /* Unset start times are the earliest of all, unset end times grow the
+   * range to the end of time */
+  while (grown && *end != NSTUNSET)
+  {
+    grown = 0;
+    FOREACH_SELECTION_WINDOW (selections, sid, selection, window, whole)
+    {
+      if (*end != NSTUNSET && window->starttime <= *end &&
+          (window->endtime == NSTUNSET || window->endtime > *end))
+      {
+        *end  = window->endtime;
+        grown = 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Keep only the samples inside [start, end), either bound NSTUNSET for
+ * none, or with selections inside the time ranges selected for each
+ * trace, dropping segments and traces left empty. A segment spanning
+ * several ranges is cut in one segment per range. Returns -1 when the
+ * segments cannot be allocated. */
+static int
+trimSampleStore (SampleStore *store, nstime_t start, nstime_t end, const MS3Selections *selections)
+{
+  int numtraces = 0;
+  int t, s, r;
+
+  for (t = 0; t < store->numtraces; t++)
+  {
+    StoreTrace *trace      = &store->traces[t];
+    StoreSegment *segments = trace->segments;
+    nstime_t after         = NSTUNSET;
+    int numranges          = 1;
+    int numsegments        = 0;
+
+    if (selections)
+    {
+      for (numranges = 0; nextSelectionRange (selections, trace->sid, after, &start, &end) == 0;)
+      {
+        numranges++;
+        if (end == NSTUNSET)
+          break;
+        after = end;
+      }
+    }
+
+    /* Cut segments are written apart, as they may outnumber the others */
+    if (numranges > 1 &&
+        (segments = (StoreSegment *)storeAlloc (store, sizeof (StoreSegment) * trace->numsegments * numranges)) == NULL)
+    {
+      /* This trace and those after it are dropped */
+      for (; t < store->numtraces && store->arena == NULL; t++)
+        free (store->traces[t].segments);
+      store->numtraces = numtraces;
+      return -1;
+    }
+
+    trace->numsamples = 0;
+    for (s = 0; s < trace->numsegments; s++)
+    {
+      after = NSTUNSET;
+      for (r = 0; r < numranges; r++)
+      {
+        StoreSegment segment = trace->segments[s];
+        int64_t lo;
+        int64_t hi;
+
+        if (selections)
+        {
+          nextSelectionRange (selections, trace->sid, after, &start, &end);
+          after = end;
+        }
+        lo = (start != NSTUNSET) ? sampleIndexAt (&segment, start) : 0;
+        hi = (end != NSTUNSET) ? sampleIndexAt (&segment, end) : segment.numsamples;
+        if (hi <= lo)
+          continue;
+        segment.samples    = (void *)segmentSamples (&segment, lo);
+        segment.starttime  = sampleTimeAt (&segment, lo);
+        segment.numsamples = hi - lo;
+        segment.offset     = trace->numsamples;
+        trace->numsamples += segment.numsamples;
+        segments[numsegments++] = segment;
+      }
+    }
+    if (segments != trace->segments && store->arena == NULL)
+      free (trace->segments);
+    trace->segments    = segments;
+    trace->numsegments = numsegments;
+    if (numsegments == 0)
+    {
+      if (store->arena == NULL)
+        free (trace->segments);
+      continue;
+    }
+
+    trace->earliest = trace->segments[0].starttime;
+    trace->latest   = sampleTimeAt (&trace->segments[numsegments - 1],
+                                    trace->segments[numsegments - 1].numsamples - 1);
+    store->traces[numtraces++] = *trace;
+  }
+  store->numtraces = numtraces;
+
+  return 0;
+}
+
+/* Unpack the selected miniSEED records of a buffer into an empty
+ * sample store, trimmed to the selections */
+static int
+unpackRecordBuffer (const char *buffer, size_t length, SampleStore *store, uint32_t flags,
+                    const MS3Selections *selections, int8_t verbose, Arena *arena, int numThreads)
+{
+  MS3TraceList *mstl = NULL;
+  Arena *previous;
+  int rv;
+
+  previous = useArena (arena);
+  rv       = readRecordBuffer (&mstl, buffer, length, flags, selections, verbose);
+  if (rv != MS_NOERROR)
+  {
+    ms_log (2, "Cannot read miniSEED from buffer: %s\n", ms_errorstr (rv));
+    rv = -1;
+  }
+  else
+  {
+    rv = unpackSampleStore (mstl, store, numThreads, verbose);
+  }
+  if (rv == 0 && selections)
+    rv = trimSampleStore (store, NSTUNSET, NSTUNSET, selections);
+
+  if (mstl)
+    mstl3_free (&mstl, 0);
+  useArena (previous);
+
+  if (rv)
+    freeSampleStore (store);
+
+  return rv;
+}
+
+/* Load the records selections may match, found in a current sidecar
+ * index and read as byte ranges, instead of scanning the whole file */
+static int
+loadIndexedSelections (const char *mseedfile, const RecordIndex *index, SampleStore *store,
+                       uint32_t flags, const MS3Selections *selections, int8_t verbose,
+                       Arena *arena, int numThreads)
+{
+  IndexRange *ranges = NULL;
+  char *buffer       = NULL;
+  uint64_t length;
+  int64_t numranges;
+  int rv;
+
+  if ((numranges = selectIndexSelections (index, selections, &ranges)) <= 0)
+    return (int)numranges;
+  if (readIndexRanges (mseedfile, ranges, numranges, &buffer, &length))
+  {
+    free (ranges);
+    return -1;
+  }
+  free (ranges);
+
+  rv = unpackRecordBuffer (buffer, length, store, flags, selections, verbose, arena, numThreads);
+  free (buffer);
+
+  return rv;
+}
+
+/* Read and unpack a whole miniSEED file into a sample store.
+ * The file is parsed, CRC checked and decompressed exactly once,
+ * every time window is then cut from memory. Samples are kept in their
+ * native type, without conversion.
+ * Regular files are mapped, their records parsed in place and then
+ * unpacked straight into the store. Anything else (e.g. "-" for stdin)
+ * is read and unpacked through libmseed's file reader.
+ * The records are decoded on numThreads threads, 0 for one per CPU,
+ * each straight into its place in the store. With selections, records
+ * are picked from their fixed headers before any CRC check or decoding,
+ * and trimmed to the time ranges selected.
+ * With an arena the store and libmseed's own allocations come from it
+ * and are released by resetting it, otherwise they use the heap. */
+int
+loadSampleStore (const char *mseedfile, SampleStore *store, uint32_t flags,
+                 const MS3Selections *selections, int8_t verbose, Arena *arena, int numThreads)
+{
+  MS3TraceList *mstl = NULL;
+  RecordIndex index;
+  Arena *previous;
+  StageTimer timer;
+  InputMap map;
+  int mapped;
+  int rv;
+
+  memset (store, 0, sizeof (SampleStore));
+  store->arena = arena;
+
+  /* A current sidecar index finds the selected records without a scan */
+  if (selections && readRecordIndex (mseedfile, &index) == 0)
+  {
+    rv = loadIndexedSelections (mseedfile, &index, store, flags, selections, verbose, arena, numThreads);
+    freeRecordIndex (&index);
+    return rv;
+  }
+
+  startStage (&timer);
+  mapped = openInputMap (mseedfile, &map);
+  if (mapped < 0)
+    return -1;
+  if (mapped == 0)
+  {
+    endStage (&timer, STAGE_READ);
+    countStage (COUNT_BYTESREAD, map.length);
+  }
+
+  previous = useArena (arena);
+  if (mapped == 0)
+  {
+    rv = readRecordBuffer (&mstl, map.buffer, map.length, flags, selections, verbose);
+  }
+  else
+  {
+    /* Reading, parsing and unpacking all happen inside libmseed here */
+    rv = ms3_readtracelist_selection (&mstl, mseedfile, NULL, selections, 0, flags | MSF_UNPACKDATA, verbose);
+    endStage (&timer, STAGE_READ);
+  }
+
+  if (rv != MS_NOERROR)
+  {
+    ms_log (2, "Cannot read miniSEED from file %s: %s\n", mseedfile, ms_errorstr (rv));
+    rv = -1;
+  }
+  else
+  {
+    rv = unpackSampleStore (mstl, store, numThreads, verbose);
+  }
+  if (rv == 0 && selections)
+    rv = trimSampleStore (store, NSTUNSET, NSTUNSET, selections);
+
+  if (mstl)
+    mstl3_free (&mstl, 0);
+  useArena (previous);
+  if (mapped == 0)
+    closeInputMap (&map);
+
+  if (rv)
+    freeSampleStore (store);
+
+  return rv;
+}
+
+/* Unpack the miniSEED records of a buffer into a sample store, like
+ * loadSampleStore() does for mapped files. The buffer is only needed
+ * during the call. */
+int
+loadSampleStoreBuffer (const char *buffer, size_t length, SampleStore *store, uint32_t flags,
+                       int8_t verbose, Arena *arena, int numThreads)
+{
+  memset (store, 0, sizeof (SampleStore));
+  store->arena = arena;
+  countStage (COUNT_BYTESREAD, length);
+
+  return unpackRecordBuffer (buffer, length, store, flags, NULL, verbose, arena, numThreads);
+}
+
+/* Load only the records of source IDs matching sidPattern (NULL for
+ * all) that overlap [start, end), found in the index and read as byte
+ * ranges, trimmed to the samples inside [start, end). Either bound may
+ * be NSTUNSET for none. */
+int
+loadSampleStoreRange (const char *mseedfile, const RecordIndex *index, const char *sidPattern,
+                      nstime_t start, nstime_t end, SampleStore *store, uint32_t flags,
+                      int8_t verbose, Arena *arena, int numThreads)
+{
+  IndexRange *ranges = NULL;
+  char *buffer       = NULL;
+  uint64_t length;
+  int64_t numranges;
+  int rv;
+
+  memset (store, 0, sizeof (SampleStore));
+  store->arena = arena;
+
+  if ((numranges = selectIndexRanges (index, sidPattern, start, end, &ranges)) <= 0)
+    return (int)numranges;
+  if (readIndexRanges (mseedfile, ranges, numranges, &buffer, &length))
+  {
+    free (ranges);
+    return -1;
+  }
+  free (ranges);
+
+  if ((rv = loadSampleStoreBuffer (buffer, length, store, flags, verbose, arena, numThreads)) == 0 &&
+      (rv = trimSampleStore (store, start, end, NULL)))
+    freeSampleStore (store);
+  free (buffer);
+
+  return rv;
+}
+
+void
+freeSampleStore (SampleStore *store)
+{
+  int i;
+
+  /* Arena memory goes back with the arena */
+  if (store->arena == NULL)
+  {
+    for (i = 0; i < store->numtraces; i++)
+      free (store->traces[i].segments);
+    free (store->traces);
+    free (store->buffer);
+  }
+  memset (store, 0, sizeof (SampleStore));
+}
+
+/* Time of a sample, rounded the same way as libmseed's ms_sampletime() */
+nstime_t
+sampleTimeAt (const StoreSegment *segment, int64_t index)
+{
+  return segment->starttime + (nstime_t) (index / segment->samprate * NSECS + 0.5);
+}
+
+/* Index of the first sample at or after the given time,
+ * clamped to [0, numsamples] */
+int64_t
+sampleIndexAt (const StoreSegment *segment, nstime_t time)
+{
+  int64_t index;
+
+  if (time <= segment->starttime || segment->samprate <= 0.0)
+    return 0;
+
+  index = (int64_t)ceil ((double)(time - segment->starttime) / NSECS * segment->samprate);
+  if (index > segment->numsamples)
+    return segment->numsamples;
+
+  /* Correct the floating point estimate against the exact sample times */
+  while (index > 0 && sampleTimeAt (segment, index - 1) >= time)
+    index--;
+  while (index < segment->numsamples && sampleTimeAt (segment, index) < time)
+    index++;
+
+  return index;
+}
+
+/* Trace-wide index of the first sample at or after the given time.
+ * Samples of consecutive segments are numbered contiguously, so the
+ * samples of any time range form one index range [lo, hi). */
+int64_t
+traceIndexAt (const StoreTrace *trace, nstime_t time)
+{
+  int lo = 0;
+  int hi = trace->numsegments;
+  int mid;
+
+  /* Find the first segment starting after the given time */
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (trace->segments[mid].starttime <= time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == 0)
+    return 0;
+
+  /* The time is either inside the previous segment or in the gap after it */
+  const StoreSegment *segment = &trace->segments[lo - 1];
+  return segment->offset + sampleIndexAt (segment, time);
+}
+
+/* Segment holding the sample with the given trace-wide index */
+int
+traceSegmentOf (const StoreTrace *trace, int64_t index)
+{
+  int lo = 0;
+  int hi = trace->numsegments - 1;
+  int mid;
+
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo + 1) / 2;
+    if (trace->segments[mid].offset <= index)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+/* Time of the sample with the given trace-wide index */
+nstime_t
+traceSampleTime (const StoreTrace *trace, int64_t index)
+{
+  const StoreSegment *segment = &trace->segments[traceSegmentOf (trace, index)];
+
+  return sampleTimeAt (segment, index - segment->offset);
+}
+
+/* Address of the sample with the given segment index */
+const void *
+segmentSamples (const StoreSegment *segment, int64_t index)
+{
+  return (const char *)segment->samples + index * segment->samplesize;
+}
+
+/* Prepare to walk the samples [lo, hi) of a trace */
+void
+openSpanCursor (SpanCursor *cursor, const StoreTrace *trace, int64_t lo, int64_t hi)
+{
+  cursor->trace   = trace;
+  cursor->index   = lo;
+  cursor->hi      = hi;
+  cursor->segment = (lo < hi) ? traceSegmentOf (trace, lo) : 0;
+}
+
+/* The next run of samples inside one segment, pointing into the store.
+ * Gaps only split the range into more spans, nothing is copied.
+ * Returns 0 once the range is exhausted, start is set to the trace-wide
+ * index of the first sample of the span. */
+int
+nextSpan (SpanCursor *cursor, StatsSpan *span, int64_t *start)
+{
+  const StoreSegment *segment;
+  int64_t end;
+
+  if (cursor->index >= cursor->hi)
+    return 0;
+
+  segment = &cursor->trace->segments[cursor->segment];
+  end     = segment->offset + segment->numsamples;
+  if (end > cursor->hi)
+    end = cursor->hi;
+
+  span->samples    = segmentSamples (segment, cursor->index - segment->offset);
+  span->count      = end - cursor->index;
+  span->sampletype = segment->sampletype;
+  if (start)
+    *start = cursor->index;
+
+  cursor->index = end;
+  cursor->segment++;
+
+  return 1;
+}
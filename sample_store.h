@@ -0,0 +1,74 @@
+#ifndef SAMPLE_STORE_H
+#define SAMPLE_STORE_H
+
+#include <stdint.h>
+
+#include "libmseed.h"
+
+#include "arena.h"
+#include "record_index.h"
+#include "stats_kernel.h"
+
+/* A contiguous run of decoded samples without gaps, kept in the native
+ * type libmseed unpacks them to */
+typedef struct StoreSegment
+{
+  nstime_t starttime;
+  double samprate;
+  int64_t offset; /* Trace-wide index of the first sample */
+  int64_t numsamples;
+  void *samples;
+  char sampletype; /* 'i' int32_t, 'f' float or 'd' double */
+  uint8_t samplesize;
+} StoreSegment;
+
+/* All segments of one source ID, sorted by time */
+typedef struct StoreTrace
+{
+  char sid[LM_SIDLEN];
+  nstime_t earliest;
+  nstime_t latest;
+  int64_t numsamples;
+  int numsegments;
+  StoreSegment *segments;
+} StoreTrace;
+
+/* Every trace of a miniSEED file, decoded once */
+typedef struct SampleStore
+{
+  int numtraces;
+  StoreTrace *traces;
+  void *buffer; /* Samples of every segment */
+  Arena *arena; /* Owner of the store memory, NULL for the heap */
+} SampleStore;
+
+/* Walks the samples of a trace-wide index range one segment at a time */
+typedef struct SpanCursor
+{
+  const StoreTrace *trace;
+  int segment;
+  int64_t index; /* Trace-wide index of the next span */
+  int64_t hi;
+} SpanCursor;
+
+int loadSampleStore (const char *mseedfile, SampleStore *store, uint32_t flags,
+                     const MS3Selections *selections, int8_t verbose, Arena *arena, int numThreads);
+int loadSampleStoreBuffer (const char *buffer, size_t length, SampleStore *store, uint32_t flags,
+                           int8_t verbose, Arena *arena, int numThreads);
+int loadSampleStoreRange (const char *mseedfile, const RecordIndex *index, const char *sidPattern,
+                          nstime_t start, nstime_t end, SampleStore *store, uint32_t flags,
+                          int8_t verbose, Arena *arena, int numThreads);
+void freeSampleStore (SampleStore *store);
+int nextSelectionRange (const MS3Selections *selections, const char *sid, nstime_t time,
+                        nstime_t *start, nstime_t *end);
+int validateRecordCRC (const char *record, const MS3Record *msr);
+nstime_t sampleTimeAt (const StoreSegment *segment, int64_t index);
+int64_t sampleIndexAt (const StoreSegment *segment, nstime_t time);
+int64_t traceIndexAt (const StoreTrace *trace, nstime_t time);
+int traceSegmentOf (const StoreTrace *trace, int64_t index);
+nstime_t traceSampleTime (const StoreTrace *trace, int64_t index);
+const void *segmentSamples (const StoreSegment *segment, int64_t index);
+void openSpanCursor (SpanCursor *cursor, const StoreTrace *trace, int64_t lo, int64_t hi);
+int nextSpan (SpanCursor *cursor, StatsSpan *span, int64_t *start);
+
+#endif
@@ -0,0 +1,587 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libmseed.h"
+
+#include "arena.h"
+#include "record_index.h"
+#include "sample_store.h"
+#include "server.h"
+#include "traverse.h"
+#include "window_writer.h"
+
+/* Set by SIGINT/SIGTERM to stop accepting and finish the queued jobs */
+static volatile sig_atomic_t stopRequested = 0;
+
+/* A record index kept between RANGE requests */
+typedef struct ServerIndex
+{
+  char *path;
+  RecordIndex index;
+  uint64_t lastUse; /* Request count of the worker when last used */
+} ServerIndex;
+
+struct Server;
+
+/* What a worker keeps warm from one request to the next */
+typedef struct ServerWorker
+{
+  struct Server *server;
+  pthread_t thread;
+  Arena arena;   /* Sample stores, reset after each request */
+  char *payload; /* Records of DATA requests, grown as needed */
+  size_t capacity;
+  ServerIndex indexes[SERVERINDEXES];
+  uint64_t requests;
+} ServerWorker;
+
+/* Accepted connections waiting for a worker */
+typedef struct Server
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  int *queue; /* Ring of client sockets */
+  int queueLength;
+  int head;
+  int count;
+  int stopping;
+  uint64_t refused; /* Clients turned away with a full queue */
+} Server;
+
+/* Text of one response, windows of each source ID in turn */
+typedef struct ServerResponse
+{
+  FILE *body;
+  int outputFormatFlag;
+  int channels; /* Source IDs with windows so far */
+} ServerResponse;
+
+typedef struct ResponseChannel
+{
+  WindowWriter writer;
+  ServerResponse *response;
+} ResponseChannel;
+
+static void
+requestStop (int sig)
+{
+  (void)sig;
+  stopRequested = 1;
+}
+
+static int
+sendAll (int client, const char *data, size_t length)
+{
+  ssize_t sent;
+
+  while (length > 0)
+  {
+    if ((sent = send (client, data, length, MSG_NOSIGNAL)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += sent;
+    length -= sent;
+  }
+
+  return 0;
+}
+
+static int
+sendError (int client, const char *message)
+{
+  char line[256];
+
+  snprintf (line, sizeof (line), "ERR %s\n", message);
+
+  return sendAll (client, line, strlen (line));
+}
+
+/* End a connection answered early. Unread request bytes would make the
+ * close reset the connection before the client read the answer, so the
+ * bytes that have arrived are read first. */
+static void
+drainClient (int client)
+{
+  char discard[4096];
+
+  shutdown (client, SHUT_WR);
+  while (recv (client, discard, sizeof (discard), MSG_DONTWAIT) > 0)
+    ;
+}
+
+static void *
+openResponseSink (void *userdata, const char *sid, const char *outputBase)
+{
+  ResponseChannel *channel = (ResponseChannel *)malloc (sizeof (ResponseChannel));
+  ServerResponse *response = (ServerResponse *)userdata;
+
+  /* Windows go to the response, nothing is named */
+  (void)outputBase;
+
+  if (channel == NULL)
+  {
+    ms_log (2, "Cannot allocate window writer\n");
+    return NULL;
+  }
+  if (attachWindowWriter (&channel->writer, sid, response->outputFormatFlag, response->body))
+  {
+    free (channel);
+    return NULL;
+  }
+  channel->response = response;
+
+  return channel;
+}
+
+static int
+writeResponseSink (void *handle, nstime_t timeStamp, const WindowStats *stats)
+{
+  ResponseChannel *channel = (ResponseChannel *)handle;
+  ServerResponse *response = channel->response;
+
+  /* The JSON documents of the source IDs form an array. Source IDs are
+   * written one after the other, the previous one is closed by now. */
+  if (channel->writer.windows == 0 && response->channels++ > 0 &&
+      response->outputFormatFlag == OUTPUTJSON)
+    fputc (',', response->body);
+
+  return writeWindow (&channel->writer, timeStamp, stats);
+}
+
+static int
+closeResponseSink (void *handle)
+{
+  int rv = closeWindowWriter (&((ResponseChannel *)handle)->writer);
+
+  free (handle);
+
+  return rv;
+}
+
+/* The index of a file from the worker's cache, read or built again when
+ * the file has changed, replacing the least recently used one */
+static const RecordIndex *
+getServerIndex (ServerWorker *worker, const char *path)
+{
+  ServerIndex *slot = NULL;
+  int i;
+
+  for (i = 0; i < SERVERINDEXES && slot == NULL; i++)
+  {
+    if (worker->indexes[i].path && strcmp (worker->indexes[i].path, path) == 0)
+      slot = &worker->indexes[i];
+  }
+  if (slot && isRecordIndexCurrent (path, &slot->index))
+  {
+    slot->lastUse = worker->requests;
+    return &slot->index;
+  }
+  if (slot == NULL)
+  {
+    slot = &worker->indexes[0];
+    for (i = 1; i < SERVERINDEXES; i++)
+    {
+      if (worker->indexes[i].lastUse < slot->lastUse)
+        slot = &worker->indexes[i];
+    }
+  }
+
+  freeRecordIndex (&slot->index);
+  free (slot->path);
+  slot->path    = NULL;
+  slot->lastUse = 0;
+  if (openRecordIndex (path, &slot->index))
+    return NULL;
+  if ((slot->path = strdup (path)) == NULL)
+  {
+    freeRecordIndex (&slot->index);
+    return NULL;
+  }
+  slot->lastUse = worker->requests;
+
+  return &slot->index;
+}
+
+/* Read the records of a DATA request into the worker's buffer */
+static int
+readPayload (ServerWorker *worker, FILE *input, size_t length)
+{
+  if (length > worker->capacity)
+  {
+    char *payload = (char *)realloc (worker->payload, length);
+    if (payload == NULL)
+      return -1;
+    worker->payload  = payload;
+    worker->capacity = length;
+  }
+
+  return (fread (worker->payload, 1, length, input) == length) ? 0 : -1;
+}
+
+static nstime_t
+parseRequestTime (const char *timestr)
+{
+  return (strcmp (timestr, "-") == 0) ? NSTUNSET : ms_timestr2nstime (timestr);
+}
+
+/* Load the samples a request asks for, see handleRequest(). Returns
+ * NULL on success, otherwise the error to answer with. */
+static const char *
+loadRequest (ServerWorker *worker, FILE *input, const char *kind, const char *rest,
+             SampleStore *store)
+{
+  if (strcmp (kind, "FILE") == 0)
+  {
+    if (*rest == '\0' || strcmp (rest, "-") == 0)
+      return "Missing file path";
+    if (loadSampleStore (rest, store, MSF_VALIDATECRC, NULL, 0, &worker->arena, 1))
+      return "Cannot read the file";
+  }
+  else if (strcmp (kind, "RANGE") == 0)
+  {
+    const RecordIndex *index;
+    char start[64];
+    char end[64];
+    char pattern[LM_SIDLEN];
+    nstime_t startTime;
+    nstime_t endTime;
+    int n = 0;
+
+    if (sscanf (rest, "%63s %63s %63s %n", start, end, pattern, &n) != 3 || n == 0 ||
+        rest[n] == '\0')
+      return "Malformed range";
+    if ((startTime = parseRequestTime (start)) == NSTERROR ||
+        (endTime = parseRequestTime (end)) == NSTERROR)
+      return "Invalid time";
+    if ((index = getServerIndex (worker, rest + n)) == NULL)
+      return "Cannot index the file";
+    if (loadSampleStoreRange (rest + n, index, (strcmp (pattern, "*")) ? pattern : NULL,
+                              startTime, endTime, store, MSF_VALIDATECRC, 0, &worker->arena, 1))
+      return "Cannot read the file";
+  }
+  else if (strcmp (kind, "DATA") == 0)
+  {
+    char *tail;
+    unsigned long long length = strtoull (rest, &tail, 10);
+
+    if (tail == rest || *tail != '\0')
+      return "Malformed payload length";
+    if (length > SERVERMAXPAYLOAD)
+      return "Payload too large";
+    if (readPayload (worker, input, length))
+      return "Incomplete payload";
+    if (loadSampleStoreBuffer (worker->payload, length, store, MSF_VALIDATECRC, 0, &worker->arena, 1))
+      return "Cannot read the records";
+  }
+  else
+    return "Unknown request";
+
+  return NULL;
+}
+
+/* Answer one request and close the connection. A request is one line:
+ *
+ *   FILE <size> <overlap> <r|j> <path>
+ *   RANGE <size> <overlap> <r|j> <start|-> <end|-> <sid pattern|*> <path>
+ *   DATA <size> <overlap> <r|j> <length>, followed by length bytes of records
+ *
+ * answered with "OK <length>\n" and length bytes of .rms text or of a
+ * JSON array of the .json documents, or with "ERR <message>\n". */
+static void
+handleRequest (ServerWorker *worker, int client)
+{
+  FILE *input = fdopen (client, "r");
+  ServerResponse response;
+  TraverseConfig config;
+  WindowSink sink;
+  SampleStore store;
+  char line[4096];
+  char kind[8];
+  char format[8];
+  const char *error = NULL;
+  char *body        = NULL;
+  size_t bodySize   = 0;
+  size_t length;
+  int n = 0;
+  int rv;
+
+  if (input == NULL)
+  {
+    close (client);
+    return;
+  }
+  worker->requests++;
+
+  memset (&config, 0, sizeof (TraverseConfig));
+  length = (fgets (line, sizeof (line), input)) ? strlen (line) : 0;
+  if (length == 0 || line[length - 1] != '\n')
+    error = "Incomplete request line";
+  else
+  {
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+    if (sscanf (line, "%7s %d %d %7s %n", kind, &config.windowSize, &config.windowOverlap,
+                format, &n) != 4 || n == 0)
+      error = "Malformed request";
+    else if (config.windowSize <= 0 || config.windowOverlap < 0 || config.windowOverlap >= 100)
+      error = "Invalid window size or overlap";
+    else if (strcmp (format, "r") && strcmp (format, "j"))
+      error = "Format must be r or j";
+    else
+      error = loadRequest (worker, input, kind, line + n, &store);
+  }
+  if (error)
+  {
+    resetArena (&worker->arena);
+    sendError (client, error);
+    drainClient (client);
+    fclose (input);
+    return;
+  }
+
+  /* Windows of each source ID in turn, formatted into memory so a failure
+   * on the way is still answered with an error */
+  response.outputFormatFlag = (format[0] == 'r') ? OUTPUTRMS : OUTPUTJSON;
+  response.channels         = 0;
+  sink.open                 = openResponseSink;
+  sink.write                = writeResponseSink;
+  sink.close                = closeResponseSink;
+  sink.userdata             = &response;
+  config.outputFormatFlag   = response.outputFormatFlag;
+  config.numThreads         = 1;
+  config.sink               = &sink;
+  if ((response.body = open_memstream (&body, &bodySize)) == NULL)
+    rv = -1;
+  else
+  {
+    if (response.outputFormatFlag == OUTPUTJSON)
+      fputc ('[', response.body);
+    rv = traverseSampleStore (&store, NULL, &config);
+    if (response.outputFormatFlag == OUTPUTJSON)
+      fputc (']', response.body);
+    if (fclose (response.body))
+      rv = -1;
+  }
+  freeSampleStore (&store);
+  resetArena (&worker->arena);
+
+  if (rv)
+    sendError (client, "Cannot compute the windows");
+  else
+  {
+    snprintf (line, sizeof (line), "OK %zu\n", bodySize);
+    if (sendAll (client, line, strlen (line)) == 0)
+      sendAll (client, body, bodySize);
+  }
+  free (body);
+  fclose (input);
+}
+
+static void *
+serverWorker (void *arg)
+{
+  ServerWorker *worker = (ServerWorker *)arg;
+  Server *server       = worker->server;
+  int client;
+
+  for (;;)
+  {
+    pthread_mutex_lock (&server->lock);
+    while (server->count == 0 && !server->stopping)
+      pthread_cond_wait (&server->ready, &server->lock);
+    if (server->count == 0)
+    {
+      pthread_mutex_unlock (&server->lock);
+      break;
+    }
+    client       = server->queue[server->head];
+    server->head = (server->head + 1) % server->queueLength;
+    server->count--;
+    pthread_mutex_unlock (&server->lock);
+
+    handleRequest (worker, client);
+  }
+
+  return NULL;
+}
+
+/* Listen on socketPath, replacing a socket left behind by a server that
+ * is gone but never the one of a running server */
+static int
+openServerSocket (const char *socketPath)
+{
+  struct sockaddr_un address;
+  int fd;
+
+  if (strlen (socketPath) >= sizeof (address.sun_path))
+  {
+    ms_log (2, "Socket path too long: %s\n", socketPath);
+    return -1;
+  }
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  strcpy (address.sun_path, socketPath);
+
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+  {
+    ms_log (2, "Cannot create socket: %s\n", strerror (errno));
+    return -1;
+  }
+  if (connect (fd, (struct sockaddr *)&address, sizeof (address)) == 0)
+  {
+    ms_log (2, "%s is in use by a running server\n", socketPath);
+    close (fd);
+    return -1;
+  }
+  close (fd);
+  if (errno == ECONNREFUSED)
+    unlink (socketPath);
+
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      bind (fd, (struct sockaddr *)&address, sizeof (address)) ||
+      listen (fd, SOMAXCONN))
+  {
+    ms_log (2, "Cannot listen on %s: %s\n", socketPath, strerror (errno));
+    if (fd >= 0)
+      close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Answer RMS jobs sent to a Unix domain socket until SIGINT or SIGTERM,
+ * on a fixed pool of workers each keeping its arena, payload buffer and
+ * record indexes warm between requests. Connections wait in a bounded
+ * queue; when it is full they are answered "ERR busy" at once. */
+int
+serveRequests (const char *socketPath, int numWorkers)
+{
+  Server server;
+  ServerWorker *workers = NULL;
+  struct sigaction action;
+  struct timeval timeout = {SERVERTIMEOUT, 0};
+  struct pollfd listener;
+  uint64_t served = 0;
+  int started     = 0;
+  int rv          = 0;
+  int client;
+  int i;
+
+  if (numWorkers <= 0)
+    numWorkers = (int)sysconf (_SC_NPROCESSORS_ONLN);
+  if (numWorkers < 1)
+    numWorkers = 1;
+
+  memset (&server, 0, sizeof (Server));
+  server.queueLength = numWorkers * SERVERQUEUEPERWORKER;
+  server.queue       = (int *)malloc (sizeof (int) * server.queueLength);
+  workers            = (ServerWorker *)calloc (numWorkers, sizeof (ServerWorker));
+  if (server.queue == NULL || workers == NULL)
+  {
+    ms_log (2, "Cannot allocate server\n");
+    free (server.queue);
+    free (workers);
+    return -1;
+  }
+  if ((listener.fd = openServerSocket (socketPath)) < 0)
+  {
+    free (server.queue);
+    free (workers);
+    return -1;
+  }
+  listener.events = POLLIN;
+  pthread_mutex_init (&server.lock, NULL);
+  pthread_cond_init (&server.ready, NULL);
+
+  /* Interrupted system calls return, so the loop sees the request */
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = requestStop;
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+
+  for (i = 0; i < numWorkers; i++)
+  {
+    workers[i].server = &server;
+    initArena (&workers[i].arena, ARENABLOCKSIZE);
+    if (pthread_create (&workers[i].thread, NULL, serverWorker, &workers[i]))
+    {
+      ms_log (2, "Cannot create server worker\n");
+      freeArena (&workers[i].arena);
+      rv = -1;
+      break;
+    }
+    started++;
+  }
+  if (rv == 0)
+    printf ("Serving on %s with %d workers\n", socketPath, numWorkers);
+  fflush (stdout);
+
+  while (rv == 0 && !stopRequested)
+  {
+    /* Wake up now and then in case the signal came before poll() */
+    if (poll (&listener, 1, 1000) <= 0)
+      continue;
+    if ((client = accept (listener.fd, NULL, NULL)) < 0)
+      continue;
+    setsockopt (client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+    setsockopt (client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+    pthread_mutex_lock (&server.lock);
+    if (server.count == server.queueLength)
+    {
+      server.refused++;
+      pthread_mutex_unlock (&server.lock);
+      sendError (client, "busy");
+      drainClient (client);
+      close (client);
+      continue;
+    }
+    server.queue[(server.head + server.count) % server.queueLength] = client;
+    server.count++;
+    pthread_cond_signal (&server.ready);
+    pthread_mutex_unlock (&server.lock);
+  }
+
+  /* Stop accepting, the workers finish the queued connections */
+  close (listener.fd);
+  unlink (socketPath);
+  pthread_mutex_lock (&server.lock);
+  server.stopping = 1;
+  pthread_cond_broadcast (&server.ready);
+  pthread_mutex_unlock (&server.lock);
+
+  for (i = 0; i < started; i++)
+  {
+    pthread_join (workers[i].thread, NULL);
+    served += workers[i].requests;
+    freeArena (&workers[i].arena);
+    free (workers[i].payload);
+    for (int j = 0; j < SERVERINDEXES; j++)
+    {
+      freeRecordIndex (&workers[i].indexes[j].index);
+      free (workers[i].indexes[j].path);
+    }
+  }
+  printf ("Served %" PRIu64 " requests, %" PRIu64 " refused as busy\n", served, server.refused);
+
+  pthread_cond_destroy (&server.ready);
+  pthread_mutex_destroy (&server.lock);
+  free (server.queue);
+  free (workers);
+
+  return rv;
+}
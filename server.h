@@ -0,0 +1,19 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* Seconds a client has to send its request or take its response */
+#define SERVERTIMEOUT 30
+
+/* Connections waiting for a worker, per worker, before clients are
+ * turned away as busy */
+#define SERVERQUEUEPERWORKER 4
+
+/* Largest miniSEED payload accepted with a DATA request */
+#define SERVERMAXPAYLOAD (256 * 1024 * 1024)
+
+/* Record indexes each worker keeps for RANGE requests */
+#define SERVERINDEXES 8
+
+int serveRequests (const char *socketPath, int numWorkers);
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmseed.h"
+
+#include "sliding_window.h"
+
+/* Capacity is kept a power of two so ring positions wrap with a mask */
+static int
+growDeque (MonoDeque *deque)
+{
+  int64_t capacity = (deque->capacity) ? deque->capacity * 2 : 1024;
+  double *values   = (double *)malloc (sizeof (double) * capacity);
+  int64_t *indices = (int64_t *)malloc (sizeof (int64_t) * capacity);
+  int64_t i;
+
+  if (values == NULL || indices == NULL)
+  {
+    ms_log (2, "Cannot allocate sliding window deque\n");
+    free (values);
+    free (indices);
+    return -1;
+  }
+
+  /* Unwrap the ring so the oldest entry is at the front again */
+  for (i = 0; i < deque->count; i++)
+  {
+    values[i]  = deque->values[(deque->head + i) & (deque->capacity - 1)];
+    indices[i] = deque->indices[(deque->head + i) & (deque->capacity - 1)];
+  }
+  free (deque->values);
+  free (deque->indices);
+
+  deque->values   = values;
+  deque->indices  = indices;
+  deque->capacity = capacity;
+  deque->head     = 0;
+
+  return 0;
+}
+
+/* Append a sample, first dropping every entry it supersedes.
+ * For the min deque an entry is superseded by any later value not larger
+ * than it, for the max deque by any later value not smaller than it. */
+static inline int
+pushDeque (MonoDeque *deque, double value, int64_t index, int isMax)
+{
+  int64_t back;
+
+  while (deque->count > 0)
+  {
+    back = (deque->head + deque->count - 1) & (deque->capacity - 1);
+    if ((isMax) ? deque->values[back] > value : deque->values[back] < value)
+      break;
+    deque->count--;
+  }
+
+  if (deque->count == deque->capacity && growDeque (deque))
+    return -1;
+
+  back                 = (deque->head + deque->count) & (deque->capacity - 1);
+  deque->values[back]  = value;
+  deque->indices[back] = index;
+  deque->count++;
+
+  return 0;
+}
+
+/* Drop entries that left the window */
+static void
+evictDeque (MonoDeque *deque, int64_t lo)
+{
+  while (deque->count > 0 && deque->indices[deque->head] < lo)
+  {
+    deque->head = (deque->head + 1) & (deque->capacity - 1);
+    deque->count--;
+  }
+}
+
+/* Push the span starting at trace-wide index start onto both deques,
+ * branching on the sample type once per span */
+static int
+pushSpan (SlidingWindow *window, const StatsSpan *span, int64_t start)
+{
+  int64_t i;
+
+#define PUSH_SPAN(TYPE)                                     \
+  do                                                        \
+  {                                                         \
+    const TYPE *samples = (const TYPE *)span->samples;      \
+    for (i = 0; i < span->count; i++)                       \
+    {                                                       \
+      if (pushDeque (&window->minDeque, samples[i], start + i, 0) || \
+          pushDeque (&window->maxDeque, samples[i], start + i, 1))   \
+        return -1;                                          \
+    }                                                       \
+  } while (0)
+
+  if (span->sampletype == 'i')
+    PUSH_SPAN (int32_t);
+  else if (span->sampletype == 'f')
+    PUSH_SPAN (float);
+  else
+    PUSH_SPAN (double);
+
+#undef PUSH_SPAN
+
+  return 0;
+}
+
+static void
+resetSlidingWindow (SlidingWindow *window, int64_t lo)
+{
+  window->lo = window->hi = lo;
+  initRunningStats (&window->stats);
+  window->minDeque.count = window->minDeque.head = 0;
+  window->maxDeque.count = window->maxDeque.head = 0;
+}
+
+void
+initSlidingWindow (SlidingWindow *window, int overlapping)
+{
+  memset (window, 0, sizeof (SlidingWindow));
+  window->overlapping = overlapping;
+}
+
+void
+freeSlidingWindow (SlidingWindow *window)
+{
+  free (window->minDeque.values);
+  free (window->minDeque.indices);
+  free (window->maxDeque.values);
+  free (window->maxDeque.indices);
+  memset (window, 0, sizeof (SlidingWindow));
+}
+
+/* Forget the current range, the next advance computes its window from
+ * scratch as if nothing came before it */
+void
+restartSlidingWindow (SlidingWindow *window)
+{
+  resetSlidingWindow (window, 0);
+}
+
+/* Move the window to the trace-wide sample range [lo, hi).
+ * Both bounds may only move forward. When the new range does not
+ * overlap the current one the window restarts from scratch, so the
+ * cost of each step is proportional to the samples entering and
+ * leaving the window rather than to the window length. Samples are
+ * read span by span straight from the store segments. */
+int
+advanceSlidingWindow (SlidingWindow *window, const StoreTrace *trace, int64_t lo, int64_t hi)
+{
+  SpanCursor cursor;
+  StatsSpan span;
+  int64_t start;
+
+  if (lo >= window->hi || lo < window->lo || hi < window->hi)
+    resetSlidingWindow (window, lo);
+
+  /* Add the samples entering the window. Disjoint windows never
+   * evict, so they skip the deques and keep the extrema in the sums. */
+  openSpanCursor (&cursor, trace, window->hi, hi);
+  while (nextSpan (&cursor, &span, &start))
+  {
+    addRunningStats (&window->stats, span.samples, span.sampletype, span.count);
+    if (window->overlapping && pushSpan (window, &span, start))
+      return -1;
+    if (window->hook)
+      window->hook (window->hookData, &span, start);
+  }
+  window->hi = hi;
+
+  /* Remove the samples leaving the window */
+  openSpanCursor (&cursor, trace, window->lo, lo);
+  while (nextSpan (&cursor, &span, NULL))
+    removeRunningStats (&window->stats, span.samples, span.sampletype, span.count);
+  window->lo = lo;
+
+  evictDeque (&window->minDeque, lo);
+  evictDeque (&window->maxDeque, lo);
+
+  return 0;
+}
+
+void
+getSlidingWindowStats (const SlidingWindow *window, WindowStats *stats)
+{
+  RunningStats current = window->stats;
+
+  if (window->overlapping && current.count > 0)
+  {
+    current.min = window->minDeque.values[window->minDeque.head];
+    current.max = window->maxDeque.values[window->maxDeque.head];
+  }
+
+  getRunningStatsResult (&current, stats);
+}
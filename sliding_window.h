@@ -0,0 +1,44 @@
+#ifndef SLIDING_WINDOW_H
+#define SLIDING_WINDOW_H
+
+#include <stdint.h>
+
+#include "running_stats.h"
+#include "sample_store.h"
+#include "window_stats.h"
+
+/* Ring buffer of (value, index) pairs kept monotonic for min or max */
+typedef struct MonoDeque
+{
+  double *values;
+  int64_t *indices;
+  int64_t capacity;
+  int64_t head;
+  int64_t count;
+} MonoDeque;
+
+/* Called with each span entering the window, starting at trace-wide
+ * index start, from the loop adding it to the running statistics */
+typedef void (*EnteringSpanHook) (void *userdata, const StatsSpan *span, int64_t start);
+
+/* Statistics of the trace-wide sample range [lo, hi), updated by adding
+ * the samples entering the window and removing the samples leaving it */
+typedef struct SlidingWindow
+{
+  int overlapping; /* Zero when consecutive windows never share samples */
+  int64_t lo;
+  int64_t hi;
+  RunningStats stats; /* Extrema are only kept here when not overlapping */
+  MonoDeque minDeque;
+  MonoDeque maxDeque;
+  EnteringSpanHook hook; /* NULL for none */
+  void *hookData;
+} SlidingWindow;
+
+void initSlidingWindow (SlidingWindow *window, int overlapping);
+void freeSlidingWindow (SlidingWindow *window);
+void restartSlidingWindow (SlidingWindow *window);
+int advanceSlidingWindow (SlidingWindow *window, const StoreTrace *trace, int64_t lo, int64_t hi);
+void getSlidingWindowStats (const SlidingWindow *window, WindowStats *stats);
+
+#endif
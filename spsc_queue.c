@@ -0,0 +1,77 @@
+#include <stdlib.h>
+
+#include "spsc_queue.h"
+
+/* Room for at least capacity items, rounded up to a power of two */
+int
+initSpscQueue (SpscQueue *queue, uint64_t capacity)
+{
+  uint64_t size = 1;
+
+  while (size < capacity)
+    size <<= 1;
+
+  queue->items = (void **)malloc (sizeof (void *) * size);
+  queue->mask  = size - 1;
+  atomic_init (&queue->head, 0);
+  atomic_init (&queue->tail, 0);
+  atomic_init (&queue->closed, 0);
+
+  return (queue->items == NULL) ? -1 : 0;
+}
+
+void
+freeSpscQueue (SpscQueue *queue)
+{
+  free (queue->items);
+  queue->items = NULL;
+}
+
+/* Producer side. Returns -1 when the queue is full. */
+int
+tryPushSpscQueue (SpscQueue *queue, void *item)
+{
+  uint64_t tail = atomic_load_explicit (&queue->tail, memory_order_relaxed);
+
+  if (tail - atomic_load_explicit (&queue->head, memory_order_acquire) > queue->mask)
+    return -1;
+
+  queue->items[tail & queue->mask] = item;
+  atomic_store_explicit (&queue->tail, tail + 1, memory_order_release);
+
+  return 0;
+}
+
+/* Consumer side. Returns NULL when the queue is empty. */
+void *
+tryPopSpscQueue (SpscQueue *queue)
+{
+  uint64_t head = atomic_load_explicit (&queue->head, memory_order_relaxed);
+  void *item;
+
+  if (head == atomic_load_explicit (&queue->tail, memory_order_acquire))
+    return NULL;
+
+  item = queue->items[head & queue->mask];
+  atomic_store_explicit (&queue->head, head + 1, memory_order_release);
+
+  return item;
+}
+
+/* Producer side, after its last push */
+void
+closeSpscQueue (SpscQueue *queue)
+{
+  atomic_store_explicit (&queue->closed, 1, memory_order_release);
+}
+
+/* Consumer side: true once the queue is closed and every item popped */
+int
+isSpscQueueDone (SpscQueue *queue)
+{
+  if (!atomic_load_explicit (&queue->closed, memory_order_acquire))
+    return 0;
+
+  return atomic_load_explicit (&queue->head, memory_order_relaxed) ==
+         atomic_load_explicit (&queue->tail, memory_order_acquire);
+}
@@ -0,0 +1,26 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Bounded lock-free queue of pointers between exactly one producer
+ * thread and one consumer thread. The producer only writes tail, the
+ * consumer only writes head, each on a cache line of its own. */
+typedef struct SpscQueue
+{
+  void **items;
+  uint64_t mask; /* Capacity - 1, the capacity being a power of two */
+  _Alignas (64) atomic_uint_fast64_t head;
+  _Alignas (64) atomic_uint_fast64_t tail;
+  _Alignas (64) atomic_int closed; /* No more items will be pushed */
+} SpscQueue;
+
+int initSpscQueue (SpscQueue *queue, uint64_t capacity);
+void freeSpscQueue (SpscQueue *queue);
+int tryPushSpscQueue (SpscQueue *queue, void *item);
+void *tryPopSpscQueue (SpscQueue *queue);
+void closeSpscQueue (SpscQueue *queue);
+int isSpscQueueDone (SpscQueue *queue);
+
+#endif
@@ -0,0 +1,113 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "stage_stats.h"
+
+int stageStatsEnabled = 0;
+
+static const char *stageNames[NUMSTAGES] = {
+    "read", "parse", "crc", "decode", "convert", "stats", "format", "write"};
+
+static const char *counterNames[NUMCOUNTERS] = {
+    "bytes_read", "bytes_skipped", "records", "samples", "windows",
+    "windows_skipped_short", "allocs_arena", "allocs_heap", "arena_blocks"};
+
+/* Totals over every thread */
+static atomic_uint_fast64_t stageTimes[NUMSTAGES];
+static atomic_uint_fast64_t stageCalls[NUMSTAGES];
+static atomic_uint_fast64_t counters[NUMCOUNTERS];
+static uint64_t startTime;
+
+/* Stage time ended so far on this thread, see StageTimer */
+static _Thread_local uint64_t nestedTime = 0;
+
+static uint64_t
+monotonicNow (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Start collecting, before any stage runs */
+void
+enableStageStats (void)
+{
+  startTime         = monotonicNow ();
+  stageStatsEnabled = 1;
+}
+
+void
+beginStageTimer (StageTimer *timer)
+{
+  timer->nested = nestedTime;
+  timer->start  = monotonicNow ();
+}
+
+void
+endStageTimer (StageTimer *timer, Stage stage)
+{
+  uint64_t elapsed = monotonicNow () - timer->start - (nestedTime - timer->nested);
+
+  atomic_fetch_add_explicit (&stageTimes[stage], elapsed, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stageCalls[stage], 1, memory_order_relaxed);
+  nestedTime += elapsed;
+}
+
+void
+addCounter (Counter counter, uint64_t value)
+{
+  atomic_fetch_add_explicit (&counters[counter], value, memory_order_relaxed);
+}
+
+/* Print the stage times and counters to stderr, or write them as JSON
+ * to path when given. Stage times are summed over all threads. */
+int
+reportStageStats (const char *path)
+{
+  struct rusage usage;
+  double wall = (monotonicNow () - startTime) / 1e9;
+  long peakRSS;
+  FILE *file;
+  int i;
+
+  getrusage (RUSAGE_SELF, &usage);
+  peakRSS = usage.ru_maxrss; /* KiB on Linux */
+
+  if (path == NULL)
+  {
+    fprintf (stderr, "%-8s %12s %12s\n", "stage", "seconds", "calls");
+    for (i = 0; i < NUMSTAGES; i++)
+      fprintf (stderr, "%-8s %12.6f %12" PRIuFAST64 "\n", stageNames[i],
+               atomic_load (&stageTimes[i]) / 1e9, atomic_load (&stageCalls[i]));
+    fprintf (stderr, "%-8s %12.6f\n", "wall", wall);
+    fprintf (stderr, "user %.6f s, system %.6f s, peak RSS %ld KiB\n",
+             usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+             usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6, peakRSS);
+    for (i = 0; i < NUMCOUNTERS; i++)
+      fprintf (stderr, "%s: %" PRIuFAST64 "\n", counterNames[i], atomic_load (&counters[i]));
+    return 0;
+  }
+
+  if ((file = fopen (path, "w")) == NULL)
+  {
+    fprintf (stderr, "Error opening file %s\n", path);
+    return -1;
+  }
+  fprintf (file, "{\"stages\":{");
+  for (i = 0; i < NUMSTAGES; i++)
+    fprintf (file, "%s\"%s\":{\"seconds\":%.6f,\"calls\":%" PRIuFAST64 "}", i ? "," : "",
+             stageNames[i], atomic_load (&stageTimes[i]) / 1e9, atomic_load (&stageCalls[i]));
+  fprintf (file, "},\"counters\":{");
+  for (i = 0; i < NUMCOUNTERS; i++)
+    fprintf (file, "%s\"%s\":%" PRIuFAST64, i ? "," : "", counterNames[i], atomic_load (&counters[i]));
+  fprintf (file, "},\"wall_seconds\":%.6f,\"user_seconds\":%.6f,\"system_seconds\":%.6f,\"peak_rss_kib\":%ld}\n",
+           wall, usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6, peakRSS);
+
+  return fclose (file) ? -1 : 0;
+}
@@ -0,0 +1,73 @@
+#ifndef STAGE_STATS_H
+#define STAGE_STATS_H
+
+#include <stdint.h>
+
+/* Stages of the pipeline timed by --stats */
+typedef enum Stage
+{
+  STAGE_READ,    /* Mapping or reading the input */
+  STAGE_PARSE,   /* Parsing records into trace lists */
+  STAGE_CRC,     /* CRC validation of miniSEED 3 records */
+  STAGE_DECODE,  /* Unpacking and decompressing samples */
+  STAGE_CONVERT, /* Copying samples unpacked by libmseed into the store */
+  STAGE_STATS,   /* Window statistics */
+  STAGE_FORMAT,  /* Formatting windows for the outputs */
+  STAGE_WRITE,   /* Writing the outputs */
+  NUMSTAGES
+} Stage;
+
+/* Events counted by --stats */
+typedef enum Counter
+{
+  COUNT_BYTESREAD,
+  COUNT_BYTESSKIPPED, /* Stream input skipped as not miniSEED, e.g. MS_NOTSEED */
+  COUNT_RECORDS,
+  COUNT_SAMPLES,
+  COUNT_WINDOWS,      /* Windows written */
+  COUNT_SHORTWINDOWS, /* Windows skipped for holding too few samples */
+  COUNT_ARENAALLOCS,  /* libmseed allocations served by an arena */
+  COUNT_HEAPALLOCS,   /* libmseed allocations served by the heap */
+  COUNT_ARENABLOCKS,  /* Blocks allocated for arenas */
+  NUMCOUNTERS
+} Counter;
+
+/* A running stage measurement. Time spent in stages ended while it runs
+ * is left out, so nested stages are not counted twice. */
+typedef struct StageTimer
+{
+  uint64_t start;
+  uint64_t nested;
+} StageTimer;
+
+/* Set once by enableStageStats(), everything is a no-op otherwise */
+extern int stageStatsEnabled;
+
+void enableStageStats (void);
+void beginStageTimer (StageTimer *timer);
+void endStageTimer (StageTimer *timer, Stage stage);
+void addCounter (Counter counter, uint64_t value);
+int reportStageStats (const char *path);
+
+static inline void
+startStage (StageTimer *timer)
+{
+  if (stageStatsEnabled)
+    beginStageTimer (timer);
+}
+
+static inline void
+endStage (StageTimer *timer, Stage stage)
+{
+  if (stageStatsEnabled)
+    endStageTimer (timer, stage);
+}
+
+static inline void
+countStage (Counter counter, uint64_t value)
+{
+  if (stageStatsEnabled)
+    addCounter (counter, value);
+}
+
+#endif
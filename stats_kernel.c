@@ -0,0 +1,787 @@
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "min_max.h"
+#include "standard_deviation.h"
+#include "stats_kernel.h"
+#include "window_stats.h"
+
+/* Fused kernels computing sum, sum of squares, min and max of the
+ * shifted samples in one pass. Every kernel handles count >= 1 and
+ * only fills the floating point sums and the extrema. */
+typedef void (*SumKernel) (const double *samples, int64_t count, double shift, KernelSums *sums);
+typedef void (*FloatSumKernel) (const float *samples, int64_t count, double shift, KernelSums *sums);
+
+/* Integer kernels fill the exact integer sums and the extrema instead */
+typedef void (*Int32SumKernel) (const int32_t *samples, int64_t count, KernelSums *sums);
+
+/* Vector integer kernels widen the samples to 64-bit lanes. Squares take
+ * up to 62 bits, so each one is split into its high and low 32 bits,
+ * summed in lanes of their own. Lanes are carried into the 128-bit
+ * totals every INT32BLOCK samples, before any of them can overflow. */
+#define INT32BLOCK ((int64_t)1 << 30)
+
+/* Exact sums of 32-bit integer samples. The squares fit in 63 bits, so
+ * the 128-bit accumulator cannot overflow before 2^65 samples. */
+static void
+sumInt32Scalar (const int32_t *x, int64_t n, KernelSums *sums)
+{
+  int64_t sum             = 0;
+  unsigned __int128 sumsq = 0;
+  int32_t min = x[0], max = x[0];
+  int64_t i;
+
+  for (i = 0; i < n; i++)
+  {
+    sum += x[i];
+    sumsq += (uint64_t)((int64_t)x[i] * x[i]);
+    min = (x[i] < min) ? x[i] : min;
+    max = (x[i] > max) ? x[i] : max;
+  }
+
+  sums->isum   = sum;
+  sums->isumsq = (__int128)sumsq;
+  sums->min    = min;
+  sums->max    = max;
+}
+
+/* Add the scalar sums of the samples left over by a vector kernel */
+static void
+addInt32Tail (const int32_t *x, int64_t n, KernelSums *sums)
+{
+  KernelSums tail;
+
+  sumInt32Scalar (x, n, &tail);
+  sums->isum += tail.isum;
+  sums->isumsq += tail.isumsq;
+  sums->min = (tail.min < sums->min) ? tail.min : sums->min;
+  sums->max = (tail.max > sums->max) ? tail.max : sums->max;
+}
+
+/* Single precision samples are widened and summed in double precision */
+static void
+sumFloatScalar (const float *x, int64_t n, double shift, KernelSums *sums)
+{
+  double s0 = 0.0, s1 = 0.0, q0 = 0.0, q1 = 0.0;
+  float min = x[0], max = x[0];
+  int64_t i;
+
+  for (i = 0; i + 2 <= n; i += 2)
+  {
+    double a = x[i] - shift;
+    double b = x[i + 1] - shift;
+
+    s0 += a;
+    s1 += b;
+    q0 += a * a;
+    q1 += b * b;
+    min = (x[i] < min) ? x[i] : min;
+    max = (x[i] > max) ? x[i] : max;
+    min = (x[i + 1] < min) ? x[i + 1] : min;
+    max = (x[i + 1] > max) ? x[i + 1] : max;
+  }
+  for (; i < n; i++)
+  {
+    double a = x[i] - shift;
+
+    s0 += a;
+    q0 += a * a;
+    min = (x[i] < min) ? x[i] : min;
+    max = (x[i] > max) ? x[i] : max;
+  }
+
+  sums->sum   = s0 + s1;
+  sums->sumsq = q0 + q1;
+  sums->min   = min;
+  sums->max   = max;
+}
+
+static void
+sumScalar (const double *x, int64_t n, double shift, KernelSums *sums)
+{
+  double s0 = 0.0, s1 = 0.0, q0 = 0.0, q1 = 0.0;
+  double min = x[0], max = x[0];
+  int64_t i;
+
+  /* Two independent chains so the additions overlap */
+  for (i = 0; i + 2 <= n; i += 2)
+  {
+    double a = x[i] - shift;
+    double b = x[i + 1] - shift;
+
+    s0 += a;
+    s1 += b;
+    q0 += a * a;
+    q1 += b * b;
+    min = (x[i] < min) ? x[i] : min;
+    max = (x[i] > max) ? x[i] : max;
+    min = (x[i + 1] < min) ? x[i + 1] : min;
+    max = (x[i + 1] > max) ? x[i + 1] : max;
+  }
+  for (; i < n; i++)
+  {
+    double a = x[i] - shift;
+
+    s0 += a;
+    q0 += a * a;
+    min = (x[i] < min) ? x[i] : min;
+    max = (x[i] > max) ? x[i] : max;
+  }
+
+  sums->sum   = s0 + s1;
+  sums->sumsq = q0 + q1;
+  sums->min   = min;
+  sums->max   = max;
+}
+
+#if defined(__x86_64__)
+/* SSE2 is part of the x86-64 baseline */
+static void
+sumSSE2 (const double *x, int64_t n, double shift, KernelSums *sums)
+{
+  __m128d k  = _mm_set1_pd (shift);
+  __m128d s0 = _mm_setzero_pd (), s1 = _mm_setzero_pd ();
+  __m128d q0 = _mm_setzero_pd (), q1 = _mm_setzero_pd ();
+  __m128d mn = _mm_set1_pd (x[0]), mx = _mm_set1_pd (x[0]);
+  double lanes[2];
+  KernelSums tail;
+  int64_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    __m128d va = _mm_loadu_pd (x + i);
+    __m128d vb = _mm_loadu_pd (x + i + 2);
+    __m128d a  = _mm_sub_pd (va, k);
+    __m128d b  = _mm_sub_pd (vb, k);
+
+    s0 = _mm_add_pd (s0, a);
+    s1 = _mm_add_pd (s1, b);
+    q0 = _mm_add_pd (q0, _mm_mul_pd (a, a));
+    q1 = _mm_add_pd (q1, _mm_mul_pd (b, b));
+    mn = _mm_min_pd (mn, _mm_min_pd (va, vb));
+    mx = _mm_max_pd (mx, _mm_max_pd (va, vb));
+  }
+
+  _mm_storeu_pd (lanes, _mm_add_pd (s0, s1));
+  sums->sum = lanes[0] + lanes[1];
+  _mm_storeu_pd (lanes, _mm_add_pd (q0, q1));
+  sums->sumsq = lanes[0] + lanes[1];
+  _mm_storeu_pd (lanes, mn);
+  sums->min = (lanes[0] < lanes[1]) ? lanes[0] : lanes[1];
+  _mm_storeu_pd (lanes, mx);
+  sums->max = (lanes[0] > lanes[1]) ? lanes[0] : lanes[1];
+
+  if (i < n)
+  {
+    sumScalar (x + i, n - i, shift, &tail);
+    sums->sum += tail.sum;
+    sums->sumsq += tail.sumsq;
+    sums->min = (tail.min < sums->min) ? tail.min : sums->min;
+    sums->max = (tail.max > sums->max) ? tail.max : sums->max;
+  }
+}
+
+/* SSE2 has neither sign extension nor signed 32-bit products, min and
+ * max: samples are widened by unpacking with their sign and squared as
+ * unsigned absolute values */
+static void
+sumInt32SSE2 (const int32_t *x, int64_t n, KernelSums *sums)
+{
+  const __m128i low       = _mm_set1_epi64x (0xffffffff);
+  __m128i mn              = _mm_set1_epi32 (x[0]), mx = _mm_set1_epi32 (x[0]);
+  unsigned __int128 sumsq = 0;
+  int64_t sum             = 0;
+  int64_t i               = 0;
+  int64_t end;
+  int64_t lanes[2];
+  uint64_t ulanes[2];
+  int32_t ilanes[4];
+  int l;
+
+  while (i + 4 <= n)
+  {
+    __m128i s   = _mm_setzero_si128 ();
+    __m128i qlo = _mm_setzero_si128 (), qhi = _mm_setzero_si128 ();
+
+    end = (n - i > INT32BLOCK) ? i + INT32BLOCK : n;
+    for (; i + 4 <= end; i += 4)
+    {
+      __m128i v    = _mm_loadu_si128 ((const __m128i *)(x + i));
+      __m128i sign = _mm_srai_epi32 (v, 31);
+      __m128i abs  = _mm_sub_epi32 (_mm_xor_si128 (v, sign), sign);
+      __m128i qa   = _mm_mul_epu32 (abs, abs);
+      __m128i qb   = _mm_mul_epu32 (_mm_srli_epi64 (abs, 32), _mm_srli_epi64 (abs, 32));
+      __m128i lt   = _mm_cmplt_epi32 (v, mn);
+      __m128i gt   = _mm_cmpgt_epi32 (v, mx);
+
+      s   = _mm_add_epi64 (s, _mm_add_epi64 (_mm_unpacklo_epi32 (v, sign), _mm_unpackhi_epi32 (v, sign)));
+      qlo = _mm_add_epi64 (qlo, _mm_add_epi64 (_mm_and_si128 (qa, low), _mm_and_si128 (qb, low)));
+      qhi = _mm_add_epi64 (qhi, _mm_add_epi64 (_mm_srli_epi64 (qa, 32), _mm_srli_epi64 (qb, 32)));
+      mn  = _mm_or_si128 (_mm_and_si128 (lt, v), _mm_andnot_si128 (lt, mn));
+      mx  = _mm_or_si128 (_mm_and_si128 (gt, v), _mm_andnot_si128 (gt, mx));
+    }
+
+    _mm_storeu_si128 ((__m128i *)lanes, s);
+    sum += lanes[0] + lanes[1];
+    _mm_storeu_si128 ((__m128i *)ulanes, qhi);
+    sumsq += (unsigned __int128)(ulanes[0] + ulanes[1]) << 32;
+    _mm_storeu_si128 ((__m128i *)ulanes, qlo);
+    sumsq += ulanes[0] + ulanes[1];
+  }
+
+  sums->isum   = sum;
+  sums->isumsq = (__int128)sumsq;
+  _mm_storeu_si128 ((__m128i *)ilanes, mn);
+  sums->min = ilanes[0];
+  for (l = 1; l < 4; l++)
+    sums->min = (ilanes[l] < sums->min) ? ilanes[l] : sums->min;
+  _mm_storeu_si128 ((__m128i *)ilanes, mx);
+  sums->max = ilanes[0];
+  for (l = 1; l < 4; l++)
+    sums->max = (ilanes[l] > sums->max) ? ilanes[l] : sums->max;
+
+  if (i < n)
+    addInt32Tail (x + i, n - i, sums);
+}
+
+__attribute__ ((target ("avx2"))) static void
+sumAVX2 (const double *x, int64_t n, double shift, KernelSums *sums)
+{
+  __m256d k  = _mm256_set1_pd (shift);
+  __m256d s0 = _mm256_setzero_pd (), s1 = _mm256_setzero_pd ();
+  __m256d q0 = _mm256_setzero_pd (), q1 = _mm256_setzero_pd ();
+  __m256d mn = _mm256_set1_pd (x[0]), mx = _mm256_set1_pd (x[0]);
+  double lanes[4];
+  KernelSums tail;
+  int64_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    __m256d va = _mm256_loadu_pd (x + i);
+    __m256d vb = _mm256_loadu_pd (x + i + 4);
+    __m256d a  = _mm256_sub_pd (va, k);
+    __m256d b  = _mm256_sub_pd (vb, k);
+
+    s0 = _mm256_add_pd (s0, a);
+    s1 = _mm256_add_pd (s1, b);
+    q0 = _mm256_add_pd (q0, _mm256_mul_pd (a, a));
+    q1 = _mm256_add_pd (q1, _mm256_mul_pd (b, b));
+    mn = _mm256_min_pd (mn, _mm256_min_pd (va, vb));
+    mx = _mm256_max_pd (mx, _mm256_max_pd (va, vb));
+  }
+
+  _mm256_storeu_pd (lanes, _mm256_add_pd (s0, s1));
+  sums->sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  _mm256_storeu_pd (lanes, _mm256_add_pd (q0, q1));
+  sums->sumsq = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  _mm256_storeu_pd (lanes, mn);
+  sums->min = fmin (fmin (lanes[0], lanes[1]), fmin (lanes[2], lanes[3]));
+  _mm256_storeu_pd (lanes, mx);
+  sums->max = fmax (fmax (lanes[0], lanes[1]), fmax (lanes[2], lanes[3]));
+
+  if (i < n)
+  {
+    sumSSE2 (x + i, n - i, shift, &tail);
+    sums->sum += tail.sum;
+    sums->sumsq += tail.sumsq;
+    sums->min = (tail.min < sums->min) ? tail.min : sums->min;
+    sums->max = (tail.max > sums->max) ? tail.max : sums->max;
+  }
+}
+
+__attribute__ ((target ("avx2"))) static void
+sumFloatAVX2 (const float *x, int64_t n, double shift, KernelSums *sums)
+{
+  __m256d k  = _mm256_set1_pd (shift);
+  __m256d s0 = _mm256_setzero_pd (), s1 = _mm256_setzero_pd ();
+  __m256d q0 = _mm256_setzero_pd (), q1 = _mm256_setzero_pd ();
+  __m256 mn = _mm256_set1_ps (x[0]), mx = _mm256_set1_ps (x[0]);
+  float flanes[8];
+  double lanes[4];
+  KernelSums tail;
+  int64_t i;
+  int l;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    __m256 v  = _mm256_loadu_ps (x + i);
+    __m256d a = _mm256_sub_pd (_mm256_cvtps_pd (_mm256_castps256_ps128 (v)), k);
+    __m256d b = _mm256_sub_pd (_mm256_cvtps_pd (_mm256_extractf128_ps (v, 1)), k);
+
+    s0 = _mm256_add_pd (s0, a);
+    s1 = _mm256_add_pd (s1, b);
+    q0 = _mm256_add_pd (q0, _mm256_mul_pd (a, a));
+    q1 = _mm256_add_pd (q1, _mm256_mul_pd (b, b));
+    mn = _mm256_min_ps (mn, v);
+    mx = _mm256_max_ps (mx, v);
+  }
+
+  _mm256_storeu_pd (lanes, _mm256_add_pd (s0, s1));
+  sums->sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  _mm256_storeu_pd (lanes, _mm256_add_pd (q0, q1));
+  sums->sumsq = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  _mm256_storeu_ps (flanes, mn);
+  sums->min = flanes[0];
+  for (l = 1; l < 8; l++)
+    sums->min = (flanes[l] < sums->min) ? flanes[l] : sums->min;
+  _mm256_storeu_ps (flanes, mx);
+  sums->max = flanes[0];
+  for (l = 1; l < 8; l++)
+    sums->max = (flanes[l] > sums->max) ? flanes[l] : sums->max;
+
+  if (i < n)
+  {
+    sumFloatScalar (x + i, n - i, shift, &tail);
+    sums->sum += tail.sum;
+    sums->sumsq += tail.sumsq;
+    sums->min = (tail.min < sums->min) ? tail.min : sums->min;
+    sums->max = (tail.max > sums->max) ? tail.max : sums->max;
+  }
+}
+__attribute__ ((target ("avx2"))) static void
+sumInt32AVX2 (const int32_t *x, int64_t n, KernelSums *sums)
+{
+  const __m256i low       = _mm256_set1_epi64x (0xffffffff);
+  __m256i mn              = _mm256_set1_epi32 (x[0]), mx = _mm256_set1_epi32 (x[0]);
+  unsigned __int128 sumsq = 0;
+  int64_t sum             = 0;
+  int64_t i               = 0;
+  int64_t end;
+  int64_t lanes[4];
+  uint64_t ulanes[4];
+  int32_t ilanes[8];
+  int l;
+
+  while (i + 8 <= n)
+  {
+    __m256i s   = _mm256_setzero_si256 ();
+    __m256i qlo = _mm256_setzero_si256 (), qhi = _mm256_setzero_si256 ();
+
+    end = (n - i > INT32BLOCK) ? i + INT32BLOCK : n;
+    for (; i + 8 <= end; i += 8)
+    {
+      __m256i v  = _mm256_loadu_si256 ((const __m256i *)(x + i));
+      __m256i a  = _mm256_cvtepi32_epi64 (_mm256_castsi256_si128 (v));
+      __m256i b  = _mm256_cvtepi32_epi64 (_mm256_extracti128_si256 (v, 1));
+      __m256i qa = _mm256_mul_epi32 (a, a);
+      __m256i qb = _mm256_mul_epi32 (b, b);
+
+      s   = _mm256_add_epi64 (s, _mm256_add_epi64 (a, b));
+      qlo = _mm256_add_epi64 (qlo, _mm256_add_epi64 (_mm256_and_si256 (qa, low), _mm256_and_si256 (qb, low)));
+      qhi = _mm256_add_epi64 (qhi, _mm256_add_epi64 (_mm256_srli_epi64 (qa, 32), _mm256_srli_epi64 (qb, 32)));
+      mn  = _mm256_min_epi32 (mn, v);
+      mx  = _mm256_max_epi32 (mx, v);
+    }
+
+    _mm256_storeu_si256 ((__m256i *)lanes, s);
+    sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    _mm256_storeu_si256 ((__m256i *)ulanes, qhi);
+    sumsq += (unsigned __int128)((ulanes[0] + ulanes[1]) + (ulanes[2] + ulanes[3])) << 32;
+    _mm256_storeu_si256 ((__m256i *)ulanes, qlo);
+    sumsq += (ulanes[0] + ulanes[1]) + (ulanes[2] + ulanes[3]);
+  }
+
+  sums->isum   = sum;
+  sums->isumsq = (__int128)sumsq;
+  _mm256_storeu_si256 ((__m256i *)ilanes, mn);
+  sums->min = ilanes[0];
+  for (l = 1; l < 8; l++)
+    sums->min = (ilanes[l] < sums->min) ? ilanes[l] : sums->min;
+  _mm256_storeu_si256 ((__m256i *)ilanes, mx);
+  sums->max = ilanes[0];
+  for (l = 1; l < 8; l++)
+    sums->max = (ilanes[l] > sums->max) ? ilanes[l] : sums->max;
+
+  if (i < n)
+    addInt32Tail (x + i, n - i, sums);
+}
+#endif
+
+#if defined(__aarch64__)
+/* NEON is part of the AArch64 baseline */
+static void
+sumNEON (const double *x, int64_t n, double shift, KernelSums *sums)
+{
+  float64x2_t k  = vdupq_n_f64 (shift);
+  float64x2_t s0 = vdupq_n_f64 (0.0), s1 = vdupq_n_f64 (0.0);
+  float64x2_t q0 = vdupq_n_f64 (0.0), q1 = vdupq_n_f64 (0.0);
+  float64x2_t mn = vdupq_n_f64 (x[0]), mx = vdupq_n_f64 (x[0]);
+  KernelSums tail;
+  int64_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    float64x2_t va = vld1q_f64 (x + i);
+    float64x2_t vb = vld1q_f64 (x + i + 2);
+    float64x2_t a  = vsubq_f64 (va, k);
+    float64x2_t b  = vsubq_f64 (vb, k);
+
+    s0 = vaddq_f64 (s0, a);
+    s1 = vaddq_f64 (s1, b);
+    q0 = vaddq_f64 (q0, vmulq_f64 (a, a));
+    q1 = vaddq_f64 (q1, vmulq_f64 (b, b));
+    mn = vminq_f64 (mn, vminq_f64 (va, vb));
+    mx = vmaxq_f64 (mx, vmaxq_f64 (va, vb));
+  }
+
+  sums->sum   = vaddvq_f64 (vaddq_f64 (s0, s1));
+  sums->sumsq = vaddvq_f64 (vaddq_f64 (q0, q1));
+  sums->min   = vminvq_f64 (mn);
+  sums->max   = vmaxvq_f64 (mx);
+
+  if (i < n)
+  {
+    sumScalar (x + i, n - i, shift, &tail);
+    sums->sum += tail.sum;
+    sums->sumsq += tail.sumsq;
+    sums->min = (tail.min < sums->min) ? tail.min : sums->min;
+    sums->max = (tail.max > sums->max) ? tail.max : sums->max;
+  }
+}
+static void
+sumInt32NEON (const int32_t *x, int64_t n, KernelSums *sums)
+{
+  const uint64x2_t low    = vdupq_n_u64 (0xffffffff);
+  int32x4_t mn            = vdupq_n_s32 (x[0]), mx = vdupq_n_s32 (x[0]);
+  unsigned __int128 sumsq = 0;
+  int64_t sum             = 0;
+  int64_t i               = 0;
+  int64_t end;
+
+  while (i + 4 <= n)
+  {
+    int64x2_t s    = vdupq_n_s64 (0);
+    uint64x2_t qlo = vdupq_n_u64 (0), qhi = vdupq_n_u64 (0);
+
+    end = (n - i > INT32BLOCK) ? i + INT32BLOCK : n;
+    for (; i + 4 <= end; i += 4)
+    {
+      int32x4_t v   = vld1q_s32 (x + i);
+      uint64x2_t qa = vreinterpretq_u64_s64 (vmull_s32 (vget_low_s32 (v), vget_low_s32 (v)));
+      uint64x2_t qb = vreinterpretq_u64_s64 (vmull_high_s32 (v, v));
+
+      s   = vpadalq_s32 (s, v);
+      qlo = vaddq_u64 (qlo, vaddq_u64 (vandq_u64 (qa, low), vandq_u64 (qb, low)));
+      qhi = vaddq_u64 (qhi, vaddq_u64 (vshrq_n_u64 (qa, 32), vshrq_n_u64 (qb, 32)));
+      mn  = vminq_s32 (mn, v);
+      mx  = vmaxq_s32 (mx, v);
+    }
+
+    sum += vaddvq_s64 (s);
+    sumsq += (unsigned __int128)vaddvq_u64 (qhi) << 32;
+    sumsq += vaddvq_u64 (qlo);
+  }
+
+  sums->isum   = sum;
+  sums->isumsq = (__int128)sumsq;
+  sums->min    = vminvq_s32 (mn);
+  sums->max    = vmaxvq_s32 (mx);
+
+  if (i < n)
+    addInt32Tail (x + i, n - i, sums);
+}
+#endif
+
+/* Available kernels, best first */
+typedef struct KernelEntry
+{
+  const char *name;
+  SumKernel kernel;
+  FloatSumKernel floatKernel;
+  Int32SumKernel int32Kernel;
+  int (*supported) (void);
+} KernelEntry;
+
+static int
+alwaysSupported (void)
+{
+  return 1;
+}
+
+#if defined(__x86_64__)
+static int
+avx2Supported (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx2");
+}
+#endif
+
+static const KernelEntry kernels[] = {
+#if defined(__x86_64__)
+    {"avx2", sumAVX2, sumFloatAVX2, sumInt32AVX2, avx2Supported},
+    {"sse2", sumSSE2, sumFloatScalar, sumInt32SSE2, alwaysSupported},
+#elif defined(__aarch64__)
+    {"neon", sumNEON, sumFloatScalar, sumInt32NEON, alwaysSupported},
+#endif
+    {"scalar", sumScalar, sumFloatScalar, sumInt32Scalar, alwaysSupported},
+};
+#define NUMKERNELS (int)(sizeof (kernels) / sizeof (kernels[0]))
+
+static const KernelEntry *selected = NULL;
+static pthread_once_t selectOnce   = PTHREAD_ONCE_INIT;
+
+/* Pick the best kernel the running CPU supports */
+static void
+selectKernel (void)
+{
+  int i;
+
+  for (i = 0; i < NUMKERNELS; i++)
+  {
+    if (kernels[i].supported ())
+    {
+      selected = &kernels[i];
+      return;
+    }
+  }
+}
+
+/* Sums and extrema of a run of samples of one type, dispatched once per
+ * run: 'i' samples are summed exactly, 'f' and 'd' samples as
+ * (sample - shift) in double precision */
+void
+sumSamples (const void *samples, char sampletype, int64_t count, double shift, KernelSums *sums)
+{
+  memset (sums, 0, sizeof (KernelSums));
+  sums->min = INFINITY;
+  sums->max = -INFINITY;
+  if (count <= 0)
+    return;
+
+  pthread_once (&selectOnce, selectKernel);
+  if (sampletype == 'i')
+  {
+    selected->int32Kernel ((const int32_t *)samples, count, sums);
+    sums->icount = count;
+  }
+  else if (sampletype == 'f')
+  {
+    selected->floatKernel ((const float *)samples, count, shift, sums);
+    sums->dcount = count;
+  }
+  else if (sampletype == 'd')
+  {
+    selected->kernel ((const double *)samples, count, shift, sums);
+    sums->dcount = count;
+  }
+}
+
+double
+sampleValueAt (const void *samples, char sampletype, int64_t index)
+{
+  if (sampletype == 'i')
+    return ((const int32_t *)samples)[index];
+  else if (sampletype == 'f')
+    return ((const float *)samples)[index];
+  else
+    return ((const double *)samples)[index];
+}
+
+/* Mean and population variance of a set of samples summed partly as
+ * integers and partly as shifted floating point values. The integer
+ * part is exact as long as count^2 * max^2 fits in 127 bits, i.e. for
+ * any window of 32-bit samples below 2^32 samples. The two parts are
+ * combined with the pairwise update of Chan et al. */
+void
+getSampleMoments (uint64_t icount, int64_t isum, __int128 isumsq,
+                  uint64_t dcount, double shift, double sum, double sumsq,
+                  double *mean, double *variance)
+{
+  uint64_t count = icount + dcount;
+  double imean = 0.0, iM2 = 0.0, dmean = 0.0, dM2 = 0.0, delta;
+
+  if (count == 0)
+  {
+    *mean = *variance = 0.0;
+    return;
+  }
+
+  if (icount > 0)
+  {
+    imean = (double)isum / icount;
+    iM2   = (double)((__int128)icount * isumsq - (__int128)isum * isum) / icount;
+  }
+  if (dcount > 0)
+  {
+    dmean = sum / dcount;
+    dM2   = sumsq - sum * dmean;
+  }
+
+  if (dcount == 0)
+  {
+    *mean     = imean;
+    *variance = iM2 / icount;
+  }
+  else if (icount == 0)
+  {
+    *mean     = shift + dmean;
+    *variance = sumsq / dcount - dmean * dmean;
+  }
+  else
+  {
+    delta     = (shift + dmean) - imean;
+    *mean     = imean + delta * dcount / count;
+    *variance = (iM2 + dM2 + delta * delta * ((double)icount * dcount / count)) / count;
+  }
+}
+
+const char *
+statsKernelName (void)
+{
+  pthread_once (&selectOnce, selectKernel);
+  return selected->name;
+}
+
+/* True when a and b agree to a relative 1e-9 */
+static int
+isClose (double a, double b)
+{
+  return fabs (a - b) <= 1e-9 * fmax (1.0, fabs (b));
+}
+
+/* Check every kernel the CPU supports, for each sample type, against
+ * the two pass results of getMeanAndSD() and getMinMaxAndDemean(). The
+ * rounded statistics must match exactly, unless the unrounded value sits
+ * on a rounding edge where the summation order alone decides. Returns
+ * the number of failed checks. */
+int
+testStatsKernel (void)
+{
+  static const int64_t sizes[]  = {1, 2, 3, 7, 8, 9, 31, 1000, 6001, 360000};
+  static const double offsets[] = {0.0, -1234.5, 1.0e6, 2.0e9};
+  static const char types[]     = {'i', 'f', 'd'};
+  const KernelEntry *best;
+  int failures = 0;
+  int k, t, s, o;
+  int64_t i;
+
+  pthread_once (&selectOnce, selectKernel);
+  best = selected;
+
+  srand (20200304);
+  for (k = 0; k < NUMKERNELS; k++)
+  {
+    if (!kernels[k].supported ())
+      continue;
+    selected = &kernels[k];
+
+    for (t = 0; t < (int)sizeof (types); t++)
+    {
+      for (s = 0; s < (int)(sizeof (sizes) / sizeof (sizes[0])); s++)
+      {
+        for (o = 0; o < (int)(sizeof (offsets) / sizeof (offsets[0])); o++)
+        {
+          int64_t n    = sizes[s];
+          double *data = (double *)malloc (sizeof (double) * n);
+          void *typed  = malloc (sizeof (double) * n);
+          double mean, SD, min, max, minDemean, maxDemean;
+          double refMean = 0.0, refVar = 0.0;
+          double kMean, kVar;
+          KernelSums sums;
+          WindowStats stats;
+
+          if (data == NULL || typed == NULL)
+          {
+            free (data);
+            free (typed);
+            return failures + 1;
+          }
+          for (i = 0; i < n; i++)
+          {
+            /* Integer counts like a digitizer, every other set fractional */
+            data[i] = offsets[o] + (double)(rand () % 20001 - 10000);
+            if (o % 2)
+              data[i] += (rand () % 1000) / 1000.0;
+
+            /* Reference on exactly the values the kernel sees */
+            if (types[t] == 'i')
+              data[i] = ((int32_t *)typed)[i] = (int32_t)data[i];
+            else if (types[t] == 'f')
+              data[i] = ((float *)typed)[i] = (float)data[i];
+            else
+              ((double *)typed)[i] = data[i];
+          }
+
+          getMeanAndSD (data, n, &mean, &SD);
+          getMinMaxAndDemean (data, n, &min, &max, &minDemean, &maxDemean, mean);
+
+          sumSamples (typed, types[t], n, data[0], &sums);
+          getSampleMoments (sums.icount, sums.isum, sums.isumsq, sums.dcount, data[0],
+                            sums.sum, sums.sumsq, &kMean, &kVar);
+          makeWindowStats (n, kMean, kVar, sums.min, sums.max, &stats);
+
+          /* Integer sums must be exact whatever the kernel */
+          if (types[t] == 'i')
+          {
+            KernelSums exact;
+
+            sumInt32Scalar ((const int32_t *)typed, n, &exact);
+            if (sums.isum != exact.isum || sums.isumsq != exact.isumsq)
+            {
+              printf ("%s kernel FAILED for %" PRId64 " 'i' samples at offset %g: inexact sums\n",
+                      kernels[k].name, n, offsets[o]);
+              failures++;
+            }
+          }
+
+          if (stats.mean != mean || stats.SD != SD || stats.min != min ||
+              stats.max != max || stats.minDemean != minDemean ||
+              stats.maxDemean != maxDemean)
+          {
+            /* Unrounded two pass reference */
+            for (i = 0; i < n; i++)
+              refMean += data[i];
+            refMean /= n;
+            for (i = 0; i < n; i++)
+              refVar += (data[i] - refMean) * (data[i] - refMean);
+            refVar /= n;
+
+            if (!isClose (kMean, refMean) ||
+                !isClose (sqrt (kVar > 0.0 ? kVar : 0.0), sqrt (refVar)) ||
+                stats.min != min || stats.max != max)
+            {
+              printf ("%s kernel FAILED for %" PRId64 " '%c' samples at offset %g: "
+                      "mean %lf/%lf SD %lf/%lf min %lf/%lf max %lf/%lf\n",
+                      kernels[k].name, n, types[t], offsets[o], stats.mean, mean,
+                      stats.SD, SD, stats.min, min, stats.max, max);
+              failures++;
+            }
+          }
+          free (data);
+          free (typed);
+        }
+      }
+    }
+    /* Squares of the extreme integers take every bit of their lanes */
+    {
+      int32_t extremes[1001];
+      KernelSums sums, exact;
+
+      for (i = 0; i < 1001; i++)
+        extremes[i] = (i % 3 == 0) ? INT32_MIN : (i % 3 == 1) ? INT32_MAX : -INT32_MAX;
+      sumSamples (extremes, 'i', 1001, 0.0, &sums);
+      sumInt32Scalar (extremes, 1001, &exact);
+      if (sums.isum != exact.isum || sums.isumsq != exact.isumsq || sums.min != INT32_MIN ||
+          sums.max != INT32_MAX)
+      {
+        printf ("%s kernel FAILED for extreme 'i' samples\n", kernels[k].name);
+        failures++;
+      }
+    }
+    printf ("%s kernel checked\n", kernels[k].name);
+  }
+
+  selected = best;
+  return failures;
+}
@@ -0,0 +1,38 @@
+#ifndef STATS_KERNEL_H
+#define STATS_KERNEL_H
+
+#include <stdint.h>
+
+/* A run of samples of one type, e.g. the part of one segment that falls
+ * inside a window. Statistics are taken over lists of spans directly,
+ * without gathering them into one array first. */
+typedef struct StatsSpan
+{
+  const void *samples;
+  int64_t count;
+  char sampletype; /* 'i' int32_t, 'f' float or 'd' double */
+} StatsSpan;
+
+/* Single pass summary of a run of samples of one type. Integer samples
+ * are summed exactly, floating point samples relative to a shift. */
+typedef struct KernelSums
+{
+  uint64_t icount; /* Integer samples */
+  int64_t isum;
+  __int128 isumsq;
+  uint64_t dcount; /* Floating point samples */
+  double sum;      /* Sum of (sample - shift) */
+  double sumsq;    /* Sum of (sample - shift)^2 */
+  double min;
+  double max;
+} KernelSums;
+
+void sumSamples (const void *samples, char sampletype, int64_t count, double shift, KernelSums *sums);
+double sampleValueAt (const void *samples, char sampletype, int64_t index);
+void getSampleMoments (uint64_t icount, int64_t isum, __int128 isumsq,
+                       uint64_t dcount, double shift, double sum, double sumsq,
+                       double *mean, double *variance);
+const char *statsKernelName (void);
+int testStatsKernel (void);
+
+#endif
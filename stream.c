@@ -0,0 +1,1172 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libmseed.h"
+
+#include "running_stats.h"
+#include "sample_store.h"
+#include "stage_stats.h"
+#include "stream.h"
+#include "window_writer.h"
+
+static nstime_t NSECS = 1000000000;
+
+/* Seconds to wait for a followed file to grow */
+#define FOLLOWINTERVAL 1
+
+/* Set by SIGINT/SIGTERM to finish the stream cleanly */
+static volatile sig_atomic_t stopRequested = 0;
+
+/* A window that has received samples but has not been written yet */
+typedef struct StreamWindow
+{
+  int64_t index; /* Position on the window grid, -1 when the slot is free */
+  RunningStats stats;
+  double samprate;
+  nstime_t first;
+  nstime_t last;
+} StreamWindow;
+
+/* Open windows and outputs of one source ID. Window k covers
+ * [gridStart + k * step, gridStart + k * step + windowSize) and lives in
+ * slot k % capacity while it is open, so memory per channel is bounded
+ * by the number of windows overlapping one instant. */
+typedef struct StreamChannel
+{
+  char sid[LM_SIDLEN];
+  void *output; /* Handle of the sink */
+  nstime_t gridStart;
+  int64_t nextIndex; /* Every window before this one is closed */
+  StreamWindow *windows;
+  int capacity;
+  struct StreamChannel *next;
+} StreamChannel;
+
+struct StreamContext
+{
+  const TraverseConfig *config;
+  const WindowSink *sink;
+  FileSinkOptions fileOptions;
+  WindowSink fileSink;
+  char *outputPrefix;
+  nstime_t windowSize_ns;
+  nstime_t step_ns;
+  nstime_t gridAnchor; /* Shared by the grids of every channel, NSTUNSET until the first one */
+  int singleChannel;   /* Outputs named <outputPrefix> alone, see makeChannelBase() */
+  StreamChannel *channels;
+  MS3Record *msr; /* Reused for every record parsed */
+  int rv;
+};
+
+/* Incremental state, see incrementalTimeWindow(). Written in the byte
+ * order and layout of the host, like the .rmsb outputs. */
+#define STATEMAGIC "MS2RMSST"
+#define STATEVERSION 3
+#define STATEHEADBYTES 65536
+
+typedef struct StateHeader
+{
+  char magic[8];
+  uint32_t version;
+  int32_t windowSize;
+  int32_t windowOverlap;
+  int32_t outputFormatFlag;
+  uint64_t offset;   /* Input bytes processed */
+  uint32_t inputCRC;      /* CRC-32C of the first input bytes, see getInputCRC() */
+  uint32_t selectionsCRC; /* See getSelectionsCRC() */
+  uint32_t numchannels;
+} StateHeader;
+
+/* One per channel after the header, followed by its open windows */
+typedef struct StateChannel
+{
+  char sid[LM_SIDLEN];
+  nstime_t gridStart;
+  int64_t nextIndex;
+  int64_t windows;         /* Windows already in the outputs */
+  nstime_t timeStampFirst; /* Time stamp of the first of them */
+  int64_t numopen;
+} StateChannel;
+
+static void
+requestStop (int signum)
+{
+  (void)signum;
+  stopRequested = 1;
+}
+
+/* Write a closed window and free its slot */
+static int
+emitWindow (StreamContext *context, StreamChannel *channel, StreamWindow *window)
+{
+  WindowStats stats;
+  StageTimer timer;
+  int rv = 0;
+
+  if (window->index >= 0 && window->stats.count > 0 &&
+      isWindowTooShort (window->stats.count, window->samprate))
+    countStage (COUNT_SHORTWINDOWS, 1);
+  else if (window->index >= 0 && window->stats.count > 0)
+  {
+    startStage (&timer);
+    getRunningStatsResult (&window->stats, &stats);
+    endStage (&timer, STAGE_STATS);
+    rv = context->sink->write (channel->output, window->first + (window->last - window->first) / 2, &stats);
+  }
+  window->index = -1;
+
+  return rv;
+}
+
+/* Close every window ending at or before the horizon, in grid order */
+static int
+closeWindows (StreamContext *context, StreamChannel *channel, nstime_t horizon)
+{
+  int64_t endIndex;
+  int64_t k;
+  int rv = 0;
+
+  /* First window index whose end lies after the horizon */
+  if (horizon == NSTUNSET)
+    endIndex = channel->nextIndex + channel->capacity;
+  else if (horizon - channel->gridStart < context->windowSize_ns)
+    return 0;
+  else
+    endIndex = (horizon - channel->gridStart - context->windowSize_ns) / context->step_ns + 1;
+
+  for (k = channel->nextIndex; k < endIndex && k < channel->nextIndex + channel->capacity; k++)
+  {
+    StreamWindow *window = &channel->windows[k % channel->capacity];
+    if (window->index == k && emitWindow (context, channel, window))
+      rv = -1;
+  }
+  if (endIndex > channel->nextIndex)
+    channel->nextIndex = endIndex;
+
+  return rv;
+}
+
+/* Make room for windows up to maxIndex, keeping open windows in place */
+static int
+growWindows (StreamChannel *channel, int64_t maxIndex)
+{
+  int capacity = (int)(maxIndex - channel->nextIndex + 1);
+  StreamWindow *windows;
+  int i;
+
+  if (capacity <= channel->capacity)
+    return 0;
+
+  windows = (StreamWindow *)malloc (sizeof (StreamWindow) * capacity);
+  if (windows == NULL)
+  {
+    ms_log (2, "Cannot allocate stream windows\n");
+    return -1;
+  }
+  for (i = 0; i < capacity; i++)
+    windows[i].index = -1;
+  for (i = 0; i < channel->capacity; i++)
+  {
+    if (channel->windows[i].index >= 0)
+      windows[channel->windows[i].index % capacity] = channel->windows[i];
+  }
+  free (channel->windows);
+  channel->windows  = windows;
+  channel->capacity = capacity;
+
+  return 0;
+}
+
+/* Streams are read once, channels are not known up front, so outputs
+ * are named per channel: <outputPrefix>.<network>.<station>.<location>.<channel>.
+ * Incremental runs can look ahead and name the outputs of a single
+ * channel input <outputPrefix>, like traverseSampleStore() does. */
+static int
+makeChannelBase (const StreamContext *context, const char *sid, char *outputBase, size_t size)
+{
+  char network[11];
+  char station[11];
+  char location[11];
+  char code[31];
+
+  if (context->singleChannel)
+  {
+    snprintf (outputBase, size, "%s", context->outputPrefix);
+    return 0;
+  }
+  if (ms_sid2nslc (sid, network, station, location, code))
+  {
+    printf ("Error returned ms_sid2nslc()\n");
+    return -1;
+  }
+  snprintf (outputBase, size, "%s.%s.%s.%s.%s", context->outputPrefix, network, station, location, code);
+
+  return 0;
+}
+
+static StreamChannel *
+getChannel (StreamContext *context, const char *sid, nstime_t starttime)
+{
+  StreamChannel *channel;
+  char outputBase[1024];
+
+  for (channel = context->channels; channel; channel = channel->next)
+  {
+    if (strcmp (channel->sid, sid) == 0)
+      return channel;
+  }
+
+  /* Sinks opened without an output prefix need no names */
+  if (context->outputPrefix && makeChannelBase (context, sid, outputBase, sizeof (outputBase)))
+    return NULL;
+
+  channel = (StreamChannel *)calloc (1, sizeof (StreamChannel));
+  if (channel == NULL)
+  {
+    ms_log (2, "Cannot allocate stream channel\n");
+    return NULL;
+  }
+  strncpy (channel->sid, sid, sizeof (channel->sid) - 1);
+
+  channel->output = context->sink->open (context->sink->userdata, sid,
+                                         (context->outputPrefix) ? outputBase : NULL);
+  if (channel->output == NULL)
+  {
+    free (channel);
+    return NULL;
+  }
+
+  /* Every window grid is anchored at midnight of the day of the first
+   * record, as whole files are at the earliest data. A channel starting
+   * on an earlier day moves its grid back by whole steps. */
+  uint16_t year, yday;
+  ms_nstime2time (starttime, &year, &yday, NULL, NULL, NULL, NULL);
+  nstime_t midnight = ms_time2nstime (year, yday, 0, 0, 0, 0);
+  if (context->gridAnchor == NSTUNSET)
+    context->gridAnchor = midnight;
+  channel->gridStart = context->gridAnchor;
+  if (midnight < channel->gridStart)
+    channel->gridStart -= (channel->gridStart - midnight + context->step_ns - 1) / context->step_ns * context->step_ns;
+
+  channel->next     = context->channels;
+  context->channels = channel;
+
+  return channel;
+}
+
+/* Add a run of samples, e.g. those of one record, to every open window
+ * it overlaps. Windows no later sample can contribute to are written. */
+int
+addStreamSamples (StreamContext *context, const char *sid, nstime_t starttime, double samprate,
+                  const void *samples, char sampletype, int64_t count)
+{
+  StreamChannel *channel;
+  StoreSegment segment;
+  StageTimer timer;
+  int64_t kmin, kmax, k;
+
+  if (count <= 0 || samprate <= 0.0 || sampletype == 'a')
+    return 0;
+
+  if ((channel = getChannel (context, sid, starttime)) == NULL)
+    return -1;
+
+  segment.starttime  = starttime;
+  segment.samprate   = samprate;
+  segment.offset     = 0;
+  segment.numsamples = count;
+  segment.samples    = (void *)samples;
+  segment.sampletype = sampletype;
+  segment.samplesize = (sampletype == 'd') ? 8 : 4;
+
+  nstime_t first = starttime;
+  nstime_t last  = sampleTimeAt (&segment, count - 1);
+
+  /* Windows that can never receive these samples again are complete */
+  if (closeWindows (context, channel, first))
+    return -1;
+
+  /* Windows overlapping the record, leaving out those already written */
+  if (last < channel->gridStart)
+    return 0;
+  kmax = (last - channel->gridStart) / context->step_ns;
+  if (first - channel->gridStart >= context->windowSize_ns)
+    kmin = (first - channel->gridStart - context->windowSize_ns) / context->step_ns + 1;
+  else
+    kmin = 0;
+  if (kmin < channel->nextIndex)
+  {
+#ifdef DEBUG
+    ms_log (1, "%s: record at or before an already written window\n", sid);
+#endif
+    kmin = channel->nextIndex;
+  }
+  if (kmax < kmin)
+    return 0;
+  if (growWindows (channel, kmax))
+    return -1;
+
+  startStage (&timer);
+  for (k = kmin; k <= kmax; k++)
+  {
+    nstime_t windowStart = channel->gridStart + k * context->step_ns;
+    int64_t lo           = sampleIndexAt (&segment, windowStart);
+    int64_t hi           = sampleIndexAt (&segment, windowStart + context->windowSize_ns);
+    StreamWindow *window = &channel->windows[k % channel->capacity];
+    nstime_t spanFirst, spanLast;
+
+    if (hi <= lo)
+      continue;
+
+    spanFirst = sampleTimeAt (&segment, lo);
+    spanLast  = sampleTimeAt (&segment, hi - 1);
+    if (window->index != k)
+    {
+      window->index    = k;
+      window->samprate = samprate;
+      window->first    = spanFirst;
+      window->last     = spanLast;
+      initRunningStats (&window->stats);
+    }
+
+    /* Records may come out of order, keep the extent of all of them */
+    if (spanFirst < window->first)
+      window->first = spanFirst;
+    if (spanLast > window->last)
+      window->last = spanLast;
+    addRunningStats (&window->stats, segmentSamples (&segment, lo), segment.sampletype, hi - lo);
+  }
+  endStage (&timer, STAGE_STATS);
+
+  /* The next sample of this channel is due after the record */
+  return closeWindows (context, channel, sampleTimeAt (&segment, count));
+}
+
+/* Add the unpacked samples of one record, with selections only those
+ * inside the time ranges selected for its source ID */
+int
+addStreamRecord (StreamContext *context, const MS3Record *msr)
+{
+  StoreSegment segment;
+  nstime_t after = NSTUNSET;
+  nstime_t start;
+  nstime_t end;
+  int64_t lo;
+  int64_t hi;
+
+  if (context->config->selections == NULL || msr->sampletype == 'a')
+    return addStreamSamples (context, msr->sid, msr->starttime, msr->samprate,
+                             msr->datasamples, msr->sampletype, msr->numsamples);
+
+  segment.starttime  = msr->starttime;
+  segment.samprate   = msr->samprate;
+  segment.numsamples = msr->numsamples;
+  segment.samples    = msr->datasamples;
+  segment.samplesize = (msr->sampletype == 'd') ? 8 : 4;
+
+  /* Add the samples inside each time range selected, in time order */
+  while (nextSelectionRange (context->config->selections, msr->sid, after, &start, &end) == 0)
+  {
+    lo = (start != NSTUNSET) ? sampleIndexAt (&segment, start) : 0;
+    hi = (end != NSTUNSET) ? sampleIndexAt (&segment, end) : msr->numsamples;
+    if (hi > lo && addStreamSamples (context, msr->sid, sampleTimeAt (&segment, lo), msr->samprate,
+                                     segmentSamples (&segment, lo), msr->sampletype, hi - lo))
+      return -1;
+    if (end == NSTUNSET || hi == msr->numsamples)
+      break;
+    after = end;
+  }
+
+  return 0;
+}
+
+/* Start a stream whose windows go to config->sink, or to output files
+ * named <outputPrefix>.<network>.<station>.<location>.<channel> when it
+ * is NULL. The outputPrefix may be NULL for sinks that need no output
+ * names. The config must outlive the context. */
+StreamContext *
+openStreamContext (const TraverseConfig *config, const char *outputPrefix)
+{
+  StreamContext *context = (StreamContext *)calloc (1, sizeof (StreamContext));
+  int nextTimeStamp      = config->windowSize - (config->windowSize * config->windowOverlap / 100);
+
+  if (context == NULL || (outputPrefix && (context->outputPrefix = strdup (outputPrefix)) == NULL))
+  {
+    ms_log (2, "Cannot allocate stream context\n");
+    free (context);
+    return NULL;
+  }
+  context->config        = config;
+  context->windowSize_ns = config->windowSize * NSECS;
+  context->step_ns       = nextTimeStamp * NSECS;
+  context->gridAnchor    = NSTUNSET;
+
+  /* Files are flushed after every window for readers following them */
+  context->sink = config->sink;
+  if (context->sink == NULL)
+  {
+    context->fileOptions.outputFormatFlag = config->outputFormatFlag;
+    context->fileOptions.flush            = 1;
+    makeFileSink (&context->fileSink, &context->fileOptions);
+    context->sink = &context->fileSink;
+  }
+
+  return context;
+}
+
+/* Close the outputs and free the context, writing every window still
+ * open first unless they are kept elsewhere */
+static int
+releaseStreamContext (StreamContext *context, int writeOpen)
+{
+  StreamChannel *channel;
+  int rv;
+
+  while ((channel = context->channels))
+  {
+    if (writeOpen && closeWindows (context, channel, NSTUNSET))
+      context->rv = -1;
+    if (context->sink->close (channel->output))
+      context->rv = -1;
+    context->channels = channel->next;
+    free (channel->windows);
+    free (channel);
+  }
+
+  rv = context->rv;
+  if (context->msr)
+    msr3_free (&context->msr);
+  free (context->outputPrefix);
+  free (context);
+
+  return rv;
+}
+
+/* Write every window still open, close the outputs and free the
+ * context. Returns -1 when anything failed during the stream. */
+int
+closeStreamContext (StreamContext *context)
+{
+  /* The stream is over, every window left is complete */
+  return releaseStreamContext (context, 1);
+}
+
+/* Parse the record at the start of buffer into *ppmsr and check its
+ * CRC, leaving the samples packed. Returns 0 for a record, 1 when the
+ * buffer holds only its start (the length of the whole record, when
+ * known, stored in needed, else MINRECLEN), 2 for a record outside the
+ * selections (NULL for all), parsed but not CRC checked, and -1 when the
+ * buffer does not start with a valid record: not miniSEED or a failed
+ * CRC. The record keeps pointing into buffer. */
+int
+parseStreamRecord (const char *buffer, size_t length, const MS3Selections *selections,
+                   MS3Record **ppmsr, size_t *needed)
+{
+  uint32_t flags = MSF_VALIDATECRC;
+  int8_t verbose = 0;
+  int validate   = stageStatsEnabled || selections;
+  StageTimer timer;
+  int rv;
+
+  /* Records are unpacked after parsing, and with --stats or selections
+   * the CRCs are checked on their own, so that each stage can be timed
+   * apart and only the records selected are checked */
+  if (validate)
+    flags &= ~MSF_VALIDATECRC;
+
+  startStage (&timer);
+  rv = msr3_parse (buffer, length, ppmsr, flags, verbose);
+  endStage (&timer, STAGE_PARSE);
+  if (rv == 0 && selections &&
+      !ms3_matchselect (selections, (*ppmsr)->sid, (*ppmsr)->starttime, msr3_endtime (*ppmsr),
+                        (*ppmsr)->pubversion, NULL))
+    return 2;
+  if (rv == 0 && validate)
+  {
+    startStage (&timer);
+    rv = validateRecordCRC (buffer, *ppmsr);
+    endStage (&timer, STAGE_CRC);
+  }
+  if (rv > 0)
+  {
+    /* Partial record, rv more bytes are needed */
+    *needed = length + rv;
+    return 1;
+  }
+  if (rv < 0 && length < MINRECLEN)
+  {
+    /* Too short to even detect a record, wait for more data */
+    *needed = MINRECLEN;
+    return 1;
+  }
+  if (rv < 0)
+  {
+#ifdef DEBUG
+    ms_log (1, "Skipping invalid data: %s\n", ms_errorstr (rv));
+#endif
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Unpack the samples of a record parsed by parseStreamRecord(), whose
+ * bytes must still be there. Returns -1 when they cannot be unpacked. */
+int
+unpackStreamRecord (MS3Record *msr)
+{
+  StageTimer timer;
+  int64_t unpacked;
+
+  startStage (&timer);
+  unpacked = msr3_unpack_data (msr, 0);
+  endStage (&timer, STAGE_DECODE);
+  if (unpacked < 0)
+  {
+#ifdef DEBUG
+    ms_log (1, "Skipping invalid data: %s\n", ms_errorstr ((int)unpacked));
+#endif
+    return -1;
+  }
+
+  countStage (COUNT_RECORDS, 1);
+  countStage (COUNT_SAMPLES, msr->numsamples);
+
+  return 0;
+}
+
+/* Parse and unpack the record at the start of buffer into *ppmsr, see
+ * parseStreamRecord(). Data that cannot be unpacked is invalid too. */
+int
+readStreamRecord (const char *buffer, size_t length, const MS3Selections *selections,
+                  MS3Record **ppmsr, size_t *needed)
+{
+  int rv = parseStreamRecord (buffer, length, selections, ppmsr, needed);
+
+  if (rv == 0 && unpackStreamRecord (*ppmsr))
+    return -1;
+
+  return rv;
+}
+
+/* Parse every complete record at the start of buffer and add its
+ * samples. Data that is not miniSEED, or fails its CRC or unpacking, is
+ * skipped byte by byte until the buffer is in sync with record
+ * boundaries again. Returns the number of bytes consumed, the rest being
+ * the start of a record whose full length, when known, is stored in
+ * needed (0 otherwise). Returns -1 when samples could not be added. */
+int64_t
+addStreamBuffer (StreamContext *context, const char *buffer, size_t length, size_t *needed)
+{
+  size_t offset = 0;
+  int rv;
+
+  *needed = 0;
+  while (offset < length)
+  {
+    rv = readStreamRecord (buffer + offset, length - offset, context->config->selections,
+                           &context->msr, needed);
+    if (rv == 1)
+      break;
+    if (rv == 2)
+    {
+      offset += context->msr->reclen;
+      continue;
+    }
+    if (rv < 0)
+    {
+      /* Skip ahead until the stream is in sync with record boundaries again */
+      countStage (COUNT_BYTESSKIPPED, 1);
+      offset++;
+      continue;
+    }
+
+    offset += context->msr->reclen;
+    if (addStreamRecord (context, context->msr))
+    {
+      context->rv = -1;
+      return -1;
+    }
+  }
+
+  return offset;
+}
+
+/* Feed everything read from fd to the stream, following a growing file
+ * when asked, until the end of the input or a stop request. The number
+ * of bytes consumed as whole records (or skipped) is added to offset,
+ * a partial record at the end is left unconsumed. */
+static void
+readStream (StreamContext *context, int fd, const char *name, int follow, uint64_t *offset)
+{
+  char *buffer      = NULL;
+  size_t bufferSize = 65536;
+  size_t length     = 0;
+  size_t needed;
+  int64_t consumed;
+  StageTimer timer;
+  ssize_t bytes;
+
+  if ((buffer = (char *)malloc (bufferSize)) == NULL)
+  {
+    ms_log (2, "Cannot allocate stream buffer\n");
+    context->rv = -1;
+    return;
+  }
+
+  while (!stopRequested && context->rv == 0)
+  {
+    startStage (&timer);
+    bytes = read (fd, buffer + length, bufferSize - length);
+    endStage (&timer, STAGE_READ);
+    if (bytes < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      ms_log (2, "Error reading %s: %s\n", name, strerror (errno));
+      context->rv = -1;
+      break;
+    }
+    if (bytes == 0)
+    {
+      /* Wait for a followed file to grow, anything else ends here */
+      if (follow && fd != STDIN_FILENO)
+      {
+        sleep (FOLLOWINTERVAL);
+        continue;
+      }
+      break;
+    }
+    length += bytes;
+    countStage (COUNT_BYTESREAD, bytes);
+
+    /* Parse every complete record in the buffer */
+    if ((consumed = addStreamBuffer (context, buffer, length, &needed)) < 0)
+      break;
+
+    /* Keep only the unparsed tail */
+    memmove (buffer, buffer + consumed, length - consumed);
+    length -= consumed;
+    *offset += consumed;
+
+    /* Grow the buffer if it cannot hold the whole partial record */
+    if (needed > bufferSize)
+    {
+      char *grown = (char *)realloc (buffer, needed);
+      if (grown == NULL)
+      {
+        ms_log (2, "Cannot grow stream buffer\n");
+        context->rv = -1;
+      }
+      else
+      {
+        buffer     = grown;
+        bufferSize = needed;
+      }
+    }
+  }
+
+  free (buffer);
+}
+
+/* Read miniSEED records incrementally from a file, a growing file (when
+ * following) or "-" for stdin, writing every window as soon as no later
+ * record can contribute to it. Only the open windows of each channel are
+ * kept in memory. */
+int
+streamTimeWindow (const char *mseedfile, const char *outputPrefix,
+                  const TraverseConfig *config, int follow)
+{
+  StreamContext *context;
+  struct sigaction action;
+  uint64_t offset = 0;
+  int fd;
+
+  if (strcmp (mseedfile, "-") == 0)
+    fd = STDIN_FILENO;
+  else if ((fd = open (mseedfile, O_RDONLY)) < 0)
+  {
+    ms_log (2, "Error opening file %s: %s\n", mseedfile, strerror (errno));
+    return -1;
+  }
+
+  if ((context = openStreamContext (config, outputPrefix)) == NULL)
+  {
+    if (fd != STDIN_FILENO)
+      close (fd);
+    return -1;
+  }
+
+  /* Finish the open windows and the JSON documents when interrupted */
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = requestStop;
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+
+  readStream (context, fd, mseedfile, follow, &offset);
+
+  if (fd != STDIN_FILENO)
+    close (fd);
+
+  return closeStreamContext (context);
+}
+
+/* CRC-32C of the first bytes of the input, up to STATEHEADBYTES of the
+ * length processed, to notice a file replaced between runs */
+static uint32_t
+getInputCRC (int fd, uint64_t length)
+{
+  char *buffer = (char *)malloc (STATEHEADBYTES);
+  ssize_t bytes;
+  uint32_t crc;
+
+  if (length > STATEHEADBYTES)
+    length = STATEHEADBYTES;
+  if (buffer == NULL || (bytes = pread (fd, buffer, length, 0)) < 0)
+    bytes = 0;
+  crc = ms_crc32c ((const uint8_t *)buffer, (int)bytes, 0);
+  free (buffer);
+
+  return crc;
+}
+
+/* CRC-32C of the selections of a run, 0 without any, so a run with
+ * other selections does not append to the outputs of an earlier one */
+static uint32_t
+getSelectionsCRC (const MS3Selections *selections)
+{
+  const MS3SelectTime *window;
+  uint32_t crc = 0;
+
+  for (; selections; selections = selections->next)
+  {
+    crc = ms_crc32c ((const uint8_t *)selections->sidpattern, (int)strlen (selections->sidpattern) + 1, crc);
+    crc = ms_crc32c (&selections->pubversion, sizeof (selections->pubversion), crc);
+    for (window = selections->timewindows; window; window = window->next)
+    {
+      crc = ms_crc32c ((const uint8_t *)&window->starttime, sizeof (window->starttime), crc);
+      crc = ms_crc32c ((const uint8_t *)&window->endtime, sizeof (window->endtime), crc);
+    }
+  }
+
+  return crc;
+}
+
+/* Count the source IDs selected in the input from offset on, with sid
+ * (when not empty) already seen, up to 2: incremental outputs are named
+ * like those of a whole file run, which only depends on whether the
+ * input holds more than one channel. Only the fixed headers are parsed.
+ * Returns -1 on error. */
+static int
+countStreamSIDs (int fd, uint64_t offset, const MS3Selections *selections, char *sid)
+{
+  char *buffer      = (char *)malloc (65536);
+  MS3Record *msr    = NULL;
+  size_t bufferSize = 65536;
+  size_t length     = 0;
+  size_t position   = 0;
+  int numsids       = (sid[0] != '\0');
+  int64_t reclen;
+  ssize_t bytes;
+
+  if (buffer == NULL)
+  {
+    ms_log (2, "Cannot allocate stream buffer\n");
+    return -1;
+  }
+
+  while (numsids >= 0 && numsids < 2)
+  {
+    /* Keep only the unparsed tail, then read more */
+    memmove (buffer, buffer + position, length - position);
+    length  -= position;
+    position = 0;
+    if ((bytes = pread (fd, buffer + length, bufferSize - length, (off_t)offset)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      ms_log (2, "Error reading input: %s\n", strerror (errno));
+      numsids = -1;
+      break;
+    }
+    if (bytes == 0)
+      break;
+    length += bytes;
+    offset += bytes;
+
+    while (numsids < 2 && length - position >= MINRECLEN)
+    {
+      if ((reclen = ms3_detect (buffer + position, length - position, NULL)) < 0)
+      {
+        /* Not miniSEED, skipped byte by byte as by addStreamBuffer() */
+        position++;
+        continue;
+      }
+      if (reclen == 0 && length - position == bufferSize)
+      {
+        /* No length found in a whole buffer, not a record after all */
+        position++;
+        continue;
+      }
+      if (reclen == 0 || (size_t)reclen > length - position)
+      {
+        /* Record incomplete, read more into a buffer that can hold it */
+        if ((size_t)reclen > bufferSize)
+        {
+          char *grown = (char *)realloc (buffer, reclen);
+          if (grown == NULL)
+          {
+            ms_log (2, "Cannot grow stream buffer\n");
+            numsids = -1;
+          }
+          else
+          {
+            buffer     = grown;
+            bufferSize = reclen;
+          }
+        }
+        break;
+      }
+      if (msr3_parse (buffer + position, reclen, &msr, 0, 0) == 0 &&
+          (!selections || ms3_matchselect (selections, msr->sid, msr->starttime, msr3_endtime (msr),
+                                           msr->pubversion, NULL)) &&
+          strcmp (msr->sid, sid))
+      {
+        if (numsids++ == 0)
+          memcpy (sid, msr->sid, LM_SIDLEN);
+      }
+      position += reclen;
+    }
+  }
+
+  msr3_free (&msr);
+  free (buffer);
+
+  return numsids;
+}
+
+/* Move the outputs an earlier run wrote for its single channel from
+ * <outputPrefix> to the per channel names, the input holding others now */
+static int
+renameChannelOutputs (StreamContext *context, const char *sid)
+{
+  static const char *extensions[] = {".rms", ".json"};
+  static const int flags[]        = {OUTPUTRMS, OUTPUTJSON};
+  char outputBase[1024];
+  char oldPath[1040];
+  char newPath[1040];
+  int i;
+
+  if (makeChannelBase (context, sid, outputBase, sizeof (outputBase)))
+    return -1;
+  for (i = 0; i < 2; i++)
+  {
+    if (!(context->config->outputFormatFlag & flags[i]))
+      continue;
+    snprintf (oldPath, sizeof (oldPath), "%s%s", context->outputPrefix, extensions[i]);
+    snprintf (newPath, sizeof (newPath), "%s%s", outputBase, extensions[i]);
+    if (rename (oldPath, newPath))
+    {
+      ms_log (2, "Cannot rename %s to %s: %s\n", oldPath, newPath, strerror (errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Restore the channels and open windows an earlier run saved for the
+ * same input and settings, resuming its outputs. Returns 1 when there is
+ * no usable state to start from, 0 when restored, -1 on error. */
+static int
+loadStreamState (StreamContext *context, const char *statePath, int fd, uint64_t *offset)
+{
+  const TraverseConfig *config = context->config;
+  StreamWindow *windows        = NULL;
+  StreamChannel *channel;
+  StateHeader header;
+  StateChannel saved;
+  char outputBase[1024];
+  struct stat info;
+  FILE *file;
+  uint32_t c;
+  int64_t i;
+  int rv = 0;
+
+  if ((file = fopen (statePath, "rb")) == NULL)
+  {
+    if (errno == ENOENT)
+      return 1;
+    ms_log (2, "Error opening file %s: %s\n", statePath, strerror (errno));
+    return -1;
+  }
+
+  if (fread (&header, sizeof (StateHeader), 1, file) != 1 ||
+      memcmp (header.magic, STATEMAGIC, sizeof (header.magic)) || header.version != STATEVERSION)
+  {
+    ms_log (1, "Ignoring unreadable state file %s, starting over\n", statePath);
+    rv = 1;
+  }
+  else if (header.windowSize != config->windowSize || header.windowOverlap != config->windowOverlap ||
+           header.outputFormatFlag != config->outputFormatFlag ||
+           header.selectionsCRC != getSelectionsCRC (config->selections))
+  {
+    ms_log (1, "State file %s was saved with other settings or selections, starting over\n", statePath);
+    rv = 1;
+  }
+  else if (fstat (fd, &info) || (uint64_t)info.st_size < header.offset ||
+           getInputCRC (fd, header.offset) != header.inputCRC)
+  {
+    ms_log (1, "Input changed since state file %s was saved, starting over\n", statePath);
+    rv = 1;
+  }
+
+  /* Name the outputs as a whole file run would, moving those of a single
+   * channel when the records appended since bring in others */
+  if (rv == 0 && header.numchannels < 2)
+  {
+    char sid[LM_SIDLEN] = "";
+    int numsids         = 0;
+
+    if (header.numchannels == 1)
+    {
+      if (fread (&saved, sizeof (StateChannel), 1, file) != 1 ||
+          fseek (file, sizeof (StateHeader), SEEK_SET))
+      {
+        ms_log (2, "Cannot read state file %s\n", statePath);
+        rv = -1;
+      }
+      else
+      {
+        memcpy (sid, saved.sid, LM_SIDLEN - 1);
+      }
+    }
+    if (rv == 0 && (numsids = countStreamSIDs (fd, header.offset, config->selections, sid)) < 0)
+      rv = -1;
+    if (rv == 0)
+      context->singleChannel = (numsids < 2);
+    if (rv == 0 && header.numchannels == 1 && !context->singleChannel &&
+        renameChannelOutputs (context, sid))
+      rv = -1;
+  }
+
+  for (c = 0; rv == 0 && c < header.numchannels; c++)
+  {
+    if (fread (&saved, sizeof (StateChannel), 1, file) != 1 || saved.numopen < 0 ||
+        (windows = (StreamWindow *)realloc (windows, sizeof (StreamWindow) * (saved.numopen + 1))) == NULL ||
+        fread (windows, sizeof (StreamWindow), saved.numopen, file) != (size_t)saved.numopen)
+    {
+      ms_log (2, "Cannot read state file %s\n", statePath);
+      rv = -1;
+      break;
+    }
+    saved.sid[LM_SIDLEN - 1] = '\0';
+
+    if ((channel = (StreamChannel *)calloc (1, sizeof (StreamChannel))) == NULL)
+    {
+      ms_log (2, "Cannot allocate stream channel\n");
+      rv = -1;
+      break;
+    }
+    memcpy (channel->sid, saved.sid, sizeof (channel->sid));
+    channel->gridStart = saved.gridStart;
+    channel->nextIndex = saved.nextIndex;
+    if (context->gridAnchor == NSTUNSET)
+      context->gridAnchor = saved.gridStart;
+
+    if (makeChannelBase (context, saved.sid, outputBase, sizeof (outputBase)) ||
+        (channel->output = resumeFileSink (&context->fileOptions, saved.sid, outputBase,
+                                           saved.windows, saved.timeStampFirst)) == NULL)
+    {
+      free (channel);
+      rv = -1;
+      break;
+    }
+    channel->next     = context->channels;
+    context->channels = channel;
+
+    for (i = 0; i < saved.numopen; i++)
+    {
+      if (windows[i].index < channel->nextIndex || growWindows (channel, windows[i].index))
+      {
+        ms_log (2, "Cannot restore the windows of %s\n", saved.sid);
+        rv = -1;
+        break;
+      }
+      channel->windows[windows[i].index % channel->capacity] = windows[i];
+    }
+  }
+
+  free (windows);
+  fclose (file);
+  if (rv == 0)
+    *offset = header.offset;
+
+  return rv;
+}
+
+/* Save the channels and open windows to statePath, close the outputs
+ * without writing the open windows and free the context. The state file
+ * is replaced only once the outputs are complete. */
+static int
+suspendStreamContext (StreamContext *context, const char *statePath, int fd, uint64_t offset)
+{
+  StreamChannel *channel;
+  StateHeader header;
+  StateChannel saved;
+  char tempPath[1040];
+  FILE *file;
+  int rv = 0;
+  int i;
+
+  memset (&header, 0, sizeof (StateHeader));
+  memcpy (header.magic, STATEMAGIC, sizeof (header.magic));
+  header.version          = STATEVERSION;
+  header.windowSize       = context->config->windowSize;
+  header.windowOverlap    = context->config->windowOverlap;
+  header.outputFormatFlag = context->config->outputFormatFlag;
+  header.offset           = offset;
+  header.inputCRC         = getInputCRC (fd, offset);
+  header.selectionsCRC    = getSelectionsCRC (context->config->selections);
+  for (channel = context->channels; channel; channel = channel->next)
+    header.numchannels++;
+
+  snprintf (tempPath, sizeof (tempPath), "%s.tmp", statePath);
+  if ((file = fopen (tempPath, "wb")) == NULL)
+  {
+    ms_log (2, "Error opening file %s: %s\n", tempPath, strerror (errno));
+    releaseStreamContext (context, 0);
+    return -1;
+  }
+  if (fwrite (&header, sizeof (StateHeader), 1, file) != 1)
+    rv = -1;
+
+  for (channel = context->channels; rv == 0 && channel; channel = channel->next)
+  {
+    const WindowWriter *writer = (const WindowWriter *)channel->output;
+
+    memset (&saved, 0, sizeof (StateChannel));
+    memcpy (saved.sid, channel->sid, sizeof (saved.sid));
+    saved.gridStart      = channel->gridStart;
+    saved.nextIndex      = channel->nextIndex;
+    saved.windows        = writer->windows;
+    saved.timeStampFirst = writer->timeStampFirst;
+    for (i = 0; i < channel->capacity; i++)
+      saved.numopen += (channel->windows[i].index >= 0);
+
+    if (fwrite (&saved, sizeof (StateChannel), 1, file) != 1)
+      rv = -1;
+    for (i = 0; rv == 0 && i < channel->capacity; i++)
+    {
+      if (channel->windows[i].index >= 0 &&
+          fwrite (&channel->windows[i], sizeof (StreamWindow), 1, file) != 1)
+        rv = -1;
+    }
+  }
+  if (fclose (file))
+    rv = -1;
+  if (rv)
+    ms_log (2, "Cannot write state file %s\n", tempPath);
+
+  if (releaseStreamContext (context, 0))
+    rv = -1;
+
+  if (rv == 0 && rename (tempPath, statePath))
+  {
+    ms_log (2, "Cannot replace state file %s: %s\n", statePath, strerror (errno));
+    rv = -1;
+  }
+  if (rv)
+    unlink (tempPath);
+
+  return rv;
+}
+
+/* Process the records appended to a growing file since the last run.
+ * The byte offset reached, the open windows of each channel and the
+ * state of its outputs are kept in <outputPrefix>.state; the next run
+ * parses only what follows the offset and appends the windows completed
+ * since to the text outputs. The final run, once the file is complete,
+ * also writes the windows still open and removes the state file. */
+int
+incrementalTimeWindow (const char *mseedfile, const char *outputPrefix,
+                       const TraverseConfig *config, int final)
+{
+  StreamContext *context;
+  char statePath[1024];
+  char sid[LM_SIDLEN] = "";
+  uint64_t offset     = 0;
+  int rv;
+  int fd;
+
+  if (config->sink || (config->outputFormatFlag & (OUTPUTBINARY | OUTPUTNPY | OUTPUTGZIP)))
+  {
+    ms_log (2, "Incremental runs only write the uncompressed text outputs\n");
+    return -1;
+  }
+  if ((fd = open (mseedfile, O_RDONLY)) < 0)
+  {
+    ms_log (2, "Error opening file %s: %s\n", mseedfile, strerror (errno));
+    return -1;
+  }
+  if ((context = openStreamContext (config, outputPrefix)) == NULL)
+  {
+    close (fd);
+    return -1;
+  }
+
+  /* Outputs are read once the run is over, no need to flush each window */
+  context->fileOptions.flush = 0;
+
+  snprintf (statePath, sizeof (statePath), "%s.state", outputPrefix);
+  rv = loadStreamState (context, statePath, fd, &offset);
+  if (rv == 1)
+  {
+    /* Starting over, the outputs are created anew */
+    releaseStreamContext (context, 0);
+    if ((context = openStreamContext (config, outputPrefix)) == NULL)
+    {
+      close (fd);
+      return -1;
+    }
+    context->fileOptions.flush = 0;
+    offset                     = 0;
+    if ((rv = countStreamSIDs (fd, 0, config->selections, sid)) < 0)
+    {
+      releaseStreamContext (context, 0);
+      close (fd);
+      return -1;
+    }
+    context->singleChannel = (rv < 2);
+  }
+  else if (rv < 0 || lseek (fd, (off_t)offset, SEEK_SET) < 0)
+  {
+    releaseStreamContext (context, 0);
+    close (fd);
+    return -1;
+  }
+
+  readStream (context, fd, mseedfile, 0, &offset);
+
+  if (final || context->rv)
+  {
+    /* Without a state to match them the outputs are rebuilt next time */
+    if (unlink (statePath) && errno != ENOENT)
+      ms_log (2, "Cannot remove state file %s: %s\n", statePath, strerror (errno));
+    rv = closeStreamContext (context);
+  }
+  else
+  {
+    rv = suspendStreamContext (context, statePath, fd, offset);
+  }
+  close (fd);
+
+  return rv;
+}
@@ -0,0 +1,27 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "libmseed.h"
+
+#include "traverse.h"
+
+/* Open windows of every source ID seen in a stream of records */
+typedef struct StreamContext StreamContext;
+
+StreamContext *openStreamContext (const TraverseConfig *config, const char *outputPrefix);
+int addStreamSamples (StreamContext *context, const char *sid, nstime_t starttime, double samprate,
+                      const void *samples, char sampletype, int64_t count);
+int addStreamRecord (StreamContext *context, const MS3Record *msr);
+int parseStreamRecord (const char *buffer, size_t length, const MS3Selections *selections,
+                       MS3Record **ppmsr, size_t *needed);
+int unpackStreamRecord (MS3Record *msr);
+int readStreamRecord (const char *buffer, size_t length, const MS3Selections *selections,
+                      MS3Record **ppmsr, size_t *needed);
+int64_t addStreamBuffer (StreamContext *context, const char *buffer, size_t length, size_t *needed);
+int closeStreamContext (StreamContext *context);
+int streamTimeWindow (const char *mseedfile, const char *outputPrefix,
+                      const TraverseConfig *config, int follow);
+int incrementalTimeWindow (const char *mseedfile, const char *outputPrefix,
+                           const TraverseConfig *config, int final);
+
+#endif
@@ -0,0 +1,220 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stage_stats.h"
+#include "text_buffer.h"
+
+static nstime_t NSECS = 1000000000;
+
+#define SECONDSINDAY 86400
+
+int
+initTextBuffer (TextBuffer *buffer, FILE *file)
+{
+  buffer->file   = file;
+  buffer->length = 0;
+  buffer->failed = 0;
+  buffer->data   = (char *)malloc (TEXTBUFFERSIZE);
+
+  return (buffer->data == NULL) ? -1 : 0;
+}
+
+/* Hand the buffered text to the file. Returns -1 once any write failed. */
+int
+flushTextBuffer (TextBuffer *buffer)
+{
+  StageTimer timer;
+
+  startStage (&timer);
+  if (buffer->length > 0 &&
+      fwrite (buffer->data, 1, buffer->length, buffer->file) != buffer->length)
+    buffer->failed = 1;
+  buffer->length = 0;
+  endStage (&timer, STAGE_WRITE);
+
+  return buffer->failed ? -1 : 0;
+}
+
+/* Flush and release the buffer, the file itself stays open */
+int
+freeTextBuffer (TextBuffer *buffer)
+{
+  int rv = flushTextBuffer (buffer);
+
+  free (buffer->data);
+  buffer->data = NULL;
+
+  return rv;
+}
+
+/* Room for at least size more bytes, size being at most TEXTBUFFERSIZE */
+static inline char *
+reserve (TextBuffer *buffer, size_t size)
+{
+  if (TEXTBUFFERSIZE - buffer->length < size)
+    flushTextBuffer (buffer);
+
+  return buffer->data + buffer->length;
+}
+
+void
+appendText (TextBuffer *buffer, const char *text, size_t length)
+{
+  if (length > TEXTBUFFERSIZE)
+  {
+    flushTextBuffer (buffer);
+    if (fwrite (text, 1, length, buffer->file) != length)
+      buffer->failed = 1;
+    return;
+  }
+
+  memcpy (reserve (buffer, length), text, length);
+  buffer->length += length;
+}
+
+/* printf() into the buffer, for the rare lines that are not per window */
+void
+appendFormat (TextBuffer *buffer, const char *format, ...)
+{
+  va_list args;
+  size_t room = TEXTBUFFERSIZE - buffer->length;
+  int length;
+
+  va_start (args, format);
+  length = vsnprintf (buffer->data + buffer->length, room, format, args);
+  va_end (args);
+  if (length < 0)
+  {
+    buffer->failed = 1;
+    return;
+  }
+  if ((size_t)length < room)
+  {
+    buffer->length += length;
+    return;
+  }
+
+  /* Did not fit, format again after making room or on the heap */
+  flushTextBuffer (buffer);
+  if ((size_t)length < TEXTBUFFERSIZE)
+  {
+    va_start (args, format);
+    buffer->length = vsnprintf (buffer->data, TEXTBUFFERSIZE, format, args);
+    va_end (args);
+  }
+  else
+  {
+    char *text = (char *)malloc (length + 1);
+    if (text == NULL)
+    {
+      buffer->failed = 1;
+      return;
+    }
+    va_start (args, format);
+    vsnprintf (text, length + 1, format, args);
+    va_end (args);
+    appendText (buffer, text, length);
+    free (text);
+  }
+}
+
+/* Same text as printf ("%lld") */
+void
+appendInt (TextBuffer *buffer, long long value)
+{
+  char digits[24];
+  char *out            = reserve (buffer, sizeof (digits));
+  unsigned long long u = (value < 0) ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+  int n                = 0;
+
+  do
+  {
+    digits[n++] = '0' + (char)(u % 10);
+    u /= 10;
+  } while (u);
+
+  if (value < 0)
+    *out++ = '-';
+  while (n > 0)
+    *out++ = digits[--n];
+  buffer->length = out - buffer->data;
+}
+
+/* Same text as printf ("%.2lf"). The value is scaled to hundredths and
+ * rounded directly; values close enough to a rounding tie that the
+ * scaling error could flip the result, and values too large for the
+ * integer path, go through snprintf() so the output never differs. */
+void
+appendFixed2 (TextBuffer *buffer, double value)
+{
+  double scaled = fabs (value) * 100.0;
+  double whole, fraction;
+  unsigned long long units;
+  char *out;
+
+  if (!(scaled < 1e15))
+  {
+    char text[400];
+    int length = snprintf (text, sizeof (text), "%.2f", value);
+    appendText (buffer, text, (length < (int)sizeof (text)) ? (size_t)length : sizeof (text) - 1);
+    return;
+  }
+
+  whole    = floor (scaled);
+  fraction = scaled - whole;
+  if (fabs (fraction - 0.5) <= scaled * 1e-15 + 1e-300)
+  {
+    char text[32];
+    int length = snprintf (text, sizeof (text), "%.2f", value);
+    appendText (buffer, text, length);
+    return;
+  }
+
+  units = (unsigned long long)whole + (fraction > 0.5);
+  out   = reserve (buffer, 32);
+  if (signbit (value))
+    *out++ = '-';
+  buffer->length = out - buffer->data;
+  appendInt (buffer, (long long)(units / 100));
+  out    = buffer->data + buffer->length;
+  out[0] = '.';
+  out[1] = '0' + (char)(units % 100 / 10);
+  out[2] = '0' + (char)(units % 10);
+  buffer->length += 3;
+}
+
+/* ms_nstime2timestr (time, string, ISOMONTHDAY, NONE) for time stamps
+ * that mostly fall on the same day: the date part is kept and only the
+ * time of day is rewritten. Returns NULL when no string can be made. */
+const char *
+getISOTimeString (TimeStringCache *cache, nstime_t time)
+{
+  uint16_t year, yday;
+  char *s = cache->string;
+
+  if (cache->dayStart != NSTUNSET && time >= cache->dayStart &&
+      time - cache->dayStart < SECONDSINDAY * NSECS)
+  {
+    int seconds = (int)((time - cache->dayStart) / NSECS);
+    s[11] = '0' + seconds / 36000;
+    s[12] = '0' + seconds / 3600 % 10;
+    s[14] = '0' + seconds % 3600 / 600;
+    s[15] = '0' + seconds % 600 / 60;
+    s[17] = '0' + seconds % 60 / 10;
+    s[18] = '0' + seconds % 10;
+    return s;
+  }
+
+  cache->dayStart = NSTUNSET;
+  if (!ms_nstime2timestr (time, s, ISOMONTHDAY, NONE))
+    return NULL;
+
+  /* Only cache the day when the string has the expected layout */
+  if (time >= 0 && strlen (s) == 19 && s[10] == 'T' && s[13] == ':' && s[16] == ':' &&
+      ms_nstime2time (time, &year, &yday, NULL, NULL, NULL, NULL) == 0)
+    cache->dayStart = ms_time2nstime (year, yday, 0, 0, 0, 0);
+
+  return s;
+}
@@ -0,0 +1,38 @@
+#ifndef TEXT_BUFFER_H
+#define TEXT_BUFFER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "libmseed.h"
+
+/* Size of the user-space buffer of each text output */
+#define TEXTBUFFERSIZE 262144
+
+/* Text written to a file in large blocks, bypassing stdio formatting */
+typedef struct TextBuffer
+{
+  FILE *file;
+  char *data;
+  size_t length;
+  int failed; /* Set once a write to the file failed */
+} TextBuffer;
+
+/* The last ISO time string made, advanced within its day without
+ * going through ms_nstime2timestr() again */
+typedef struct TimeStringCache
+{
+  nstime_t dayStart; /* Midnight of the cached day, NSTUNSET when empty */
+  char string[30];
+} TimeStringCache;
+
+int initTextBuffer (TextBuffer *buffer, FILE *file);
+int flushTextBuffer (TextBuffer *buffer);
+int freeTextBuffer (TextBuffer *buffer);
+void appendText (TextBuffer *buffer, const char *text, size_t length);
+void appendFormat (TextBuffer *buffer, const char *format, ...);
+void appendInt (TextBuffer *buffer, long long value);
+void appendFixed2 (TextBuffer *buffer, double value);
+const char *getISOTimeString (TimeStringCache *cache, nstime_t time);
+
+#endif
@@ -1,622 +1,958 @@
-#include <errno.h>
-#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <unistd.h>
 
 #include "libmseed.h"
 
-#include "min_max.h"
-#include "standard_deviation.h"
+#include "quantile_sketch.h"
+#include "running_stats.h"
+#include "sample_store.h"
+#include "sliding_window.h"
+#include "stage_stats.h"
+#include "traverse.h"
+#include "window_writer.h"
+
+/* Windows per chunk of a trace, per window length in steps; see
+ * traverseTrace() */
+#define WINDOWCHUNK 16
+
+/* Chunks laid out per thread of a trace at a time */
+#define CHUNKSPERTHREAD 4
 
-#define SECONDSINDAY 86400
 #define SECONDSINHOUR 3600
 #define SECONDSINMINUTE 60
 static nstime_t NSECS = 1000000000;
 
-static void
-write2RMS (FILE *file, nstime_t timeStamp, double mean, double SD,
-           double min, double max, double minDemean, double maxDemean)
+/* One source ID of the input file and where its windows are written */
+typedef struct TraceJob
 {
-  int timeStampInSecond = timeStamp / NSECS;
-  fprintf (file, "%d,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf\r\n", timeStampInSecond, mean, SD,
-           min, max, minDemean, maxDemean);
+  const StoreTrace *trace;
+  const TraverseConfig *config;
+  const WindowSink *sink;
+  nstime_t gridStart;
+  char *outputBase; /* Output file name without extension */
+  int numThreads;   /* Threads sharing the windows of the trace */
+  int rv;
+} TraceJob;
+
+/* Summary of one base block of the grid shared by several window
+ * settings, see traverseTraceSettings() */
+typedef struct BaseBlock
+{
+  RunningStats stats;
+  QuantileSketch *sketch; /* NULL without percentiles */
+  int64_t lo; /* Trace-wide index range of its samples */
+  int64_t hi;
+} BaseBlock;
+
+/* Output and progress of one window setting, in base blocks */
+typedef struct WindowSetting
+{
+  void *channel;
+  int64_t size;
+  int64_t step;
+  int64_t k; /* Next window to write */
+  int64_t kLast;
+} WindowSetting;
+
+/* Jobs handed out to the worker threads in order */
+typedef struct TraceJobQueue
+{
+  TraceJob *jobs;
+  int numjobs;
+  atomic_int next;
+} TraceJobQueue;
+
+static int64_t
+greatestCommonDivisor (int64_t a, int64_t b)
+{
+  while (b)
+  {
+    int64_t r = a % b;
+    a         = b;
+    b         = r;
+  }
+
+  return a;
 }
 
-static void
-testPrintSelections (MS3Selections *selections)
+/* Index of the first window [gridStart + k * step, + windowSize) that
+ * holds the given time */
+static int64_t
+firstWindowOf (nstime_t time, nstime_t gridStart, nstime_t windowSize_ns, nstime_t step_ns)
 {
-  ms3_printselections (selections);
+  if (time - gridStart < windowSize_ns)
+    return 0;
+
+  return (time - gridStart - windowSize_ns) / step_ns + 1;
 }
 
-int
-traverseTimeWindow (const char *mseedfile, const char *outputFileRMS, const char *outputFileJSON,
-                    int windowSize, int windowOverlap, int outputFormatFlag)
+/* A window computed ahead of being written */
+typedef struct ChunkWindow
 {
-  char starttimestr[30];
-  char endtimestr[30];
-  uint32_t flags = 0;
-  int8_t verbose = 0;
-  size_t idx;
-  int rv;
+  nstime_t timeStamp;
+  WindowStats stats;
+} ChunkWindow;
 
-  int64_t unpacked;
-  uint8_t samplesize;
-  char sampletype;
-  size_t lineidx;
-  size_t lines;
-  int col;
-  void *sptr;
+/* Windows [k, kEnd) of the grid of one trace, computed on one thread */
+typedef struct WindowChunk
+{
+  int64_t k;
+  int64_t kEnd;
+  ChunkWindow *windows; /* Those with enough data, kept across rounds */
+  int64_t numwindows;
+  int64_t capacity;
+  int rv;
+} WindowChunk;
 
-  FILE *fptrRMS;
-  FILE *fptrJSON;
+/* Chunks of one trace handed out to its threads in order */
+typedef struct ChunkRound
+{
+  const TraceJob *job;
+  WindowChunk *chunks;
+  int numchunks;
+  atomic_int next;
+} ChunkRound;
+
+/* Sketches of the last base blocks of the grid, as long as the
+ * greatest common divisor of the window size and step, so each block is
+ * sketched once and windows merge the blocks they cover. Blocks are fed
+ * the samples entering the sliding window, see sketchEnteringSpan(). */
+typedef struct SketchRing
+{
+  QuantileSketch *sketches;
+  int64_t *blocks; /* Block held by each slot, -1 for none */
+  int64_t size;    /* Blocks per window */
+  int64_t step;    /* Blocks per step */
+  nstime_t block_ns;
+  const TraceJob *job; /* Of the chunk being computed */
+  int64_t current;     /* Block the last samples entered, -1 for none */
+  int64_t currentHi;   /* Trace-wide index where it ends */
+} SketchRing;
+
+typedef struct ChunkWorkerArg
+{
+  ChunkRound *round;
+  SlidingWindow *window; /* Of this thread, kept across rounds */
+  SketchRing *sketches;  /* Of this thread, NULL without percentiles */
+} ChunkWorkerArg;
+
+/* Hook of the sliding window, adding the samples entering it to the
+ * sketches of their base blocks. Windows only ever enter whole blocks,
+ * so a block is started over when its first samples enter. Spans are cut
+ * at block boundaries, giving each block the same runs of samples as the
+ * block loop of traverseTraceSettings(). */
+static void
+sketchEnteringSpan (void *userdata, const StatsSpan *span, int64_t start)
+{
+  SketchRing *ring        = (SketchRing *)userdata;
+  const StoreTrace *trace = ring->job->trace;
+  size_t samplesize       = (span->sampletype == 'd') ? sizeof (double) : sizeof (int32_t);
+  const char *samples     = (const char *)span->samples;
+  int64_t count           = span->count;
+  int64_t n;
+
+  while (count > 0)
+  {
+    if (ring->current < 0 || start >= ring->currentHi)
+    {
+      int64_t b = (traceSampleTime (trace, start) - ring->job->gridStart) / ring->block_ns;
 
-  /* Buffers for storing source id, network, station, location and channel */
-  char network[11];
-  char station[11];
-  char location[11];
-  char channel[31];
+      ring->current   = b;
+      ring->currentHi = traceIndexAt (trace, ring->job->gridStart + (b + 1) * ring->block_ns);
+      ring->blocks[b % ring->size] = b;
+      initQuantileSketch (&ring->sketches[b % ring->size]);
+    }
+    n = (count < ring->currentHi - start) ? count : ring->currentHi - start;
+    addQuantileSketch (&ring->sketches[ring->current % ring->size], samples, span->sampletype, n);
+    samples += n * samplesize;
+    start += n;
+    count -= n;
+  }
+}
 
-  /* Set bit flag to validate CRC */
-  flags |= MSF_VALIDATECRC;
+/* Set the percentiles asked for of a window from its sketch */
+static void
+setWindowPercentiles (const QuantileSketch *sketch, const TraverseConfig *config, WindowStats *stats)
+{
+  int i;
 
-  /* Set bit flag to build a record list */
-  flags |= MSF_RECORDLIST;
+  stats->numPercentiles = (config->numPercentiles < MAXPERCENTILES) ? config->numPercentiles : MAXPERCENTILES;
+  for (i = 0; i < stats->numPercentiles; i++)
+    stats->percentiles[i] = getQuantileSketchValue (sketch, config->percentiles[i] / 100.0);
+}
 
-  /* Calculate how many segments of this routine */
-  int nextTimeStamp = windowSize - (windowSize * windowOverlap / 100);
-  int segments      = SECONDSINDAY / nextTimeStamp;
-#ifdef DEBUG
-  printf ("num of segments: %d\n", segments);
-#endif
-  nstime_t nextTimeStamp_ns = nextTimeStamp * NSECS;
-  char timeStampStr[30];
+/* Merge the sketches of the base blocks of window k, once the sliding
+ * window is there. Blocks no sample entered are empty. */
+static void
+sketchWindow (SketchRing *ring, int64_t k, QuantileSketch *merged)
+{
+  int64_t b;
 
-  /* Open the output files */
-  if (outputFormatFlag == 1 || outputFormatFlag == 0)
+  initQuantileSketch (merged);
+  for (b = k * ring->step; b < k * ring->step + ring->size; b++)
   {
-    fptrRMS = fopen (outputFileRMS, "w");
-    if (fptrRMS == NULL)
+    QuantileSketch *sketch = &ring->sketches[b % ring->size];
+
+    if (ring->blocks[b % ring->size] != b)
     {
-      printf ("Error opening file %s\n", outputFileRMS);
-      return -1;
+      initQuantileSketch (sketch);
+      ring->blocks[b % ring->size] = b;
     }
+    mergeQuantileSketch (merged, sketch);
   }
-  if (outputFormatFlag == 2 || outputFormatFlag == 0)
+}
+
+static int
+addChunkWindow (WindowChunk *chunk, nstime_t timeStamp, const WindowStats *stats)
+{
+  if (chunk->numwindows == chunk->capacity)
   {
-    fptrJSON = fopen (outputFileJSON, "w");
-    if (fptrJSON == NULL)
+    int64_t capacity     = (chunk->capacity) ? chunk->capacity * 2 : 64;
+    ChunkWindow *windows = (ChunkWindow *)realloc (chunk->windows, sizeof (ChunkWindow) * capacity);
+    if (windows == NULL)
     {
-      printf ("Error opening file %s\n", outputFileJSON);
+      ms_log (2, "Cannot allocate chunk windows\n");
       return -1;
     }
+    chunk->windows  = windows;
+    chunk->capacity = capacity;
   }
+  chunk->windows[chunk->numwindows].timeStamp = timeStamp;
+  chunk->windows[chunk->numwindows].stats     = *stats;
+  chunk->numwindows++;
 
-  /* get the end time of the earliest record */
-  MS3Record *msr = 0;
-  ms3_readmsr (&msr, mseedfile, NULL, NULL, flags, verbose);
-  uint16_t year, yday;
-  uint8_t hour, min, sec;
-  uint32_t nsec;
-  ms_nstime2time (msr3_endtime (msr), &year, &yday, &hour, &min, &sec, &nsec);
-#ifdef DEBUG
-  printf ("end time of year and yday of the earliest record: %" PRId16 " %" PRId16 "\n", year, yday);
-#endif
+  return 0;
+}
+
+/* Compute the windows of a chunk, cutting each one out of the sample
+ * store. The sliding window starts over at the chunk, so its results do
+ * not depend on which thread computed the chunk before. */
+static int
+computeChunk (const TraceJob *job, SlidingWindow *window, SketchRing *sketches, WindowChunk *chunk)
+{
+  const StoreTrace *trace      = job->trace;
+  const TraverseConfig *config = job->config;
+  StageTimer timer;
+  int64_t k = chunk->k;
+
+  /* Windows start every step on a grid anchored at gridStart */
+  int nextTimeStamp         = config->windowSize - (config->windowSize * config->windowOverlap / 100);
+  nstime_t nextTimeStamp_ns = nextTimeStamp * NSECS;
+  nstime_t windowSize_ns    = (nstime_t)config->windowSize * NSECS;
 
-  /* Parse network, station, location and channel from SID */
-  rv = ms_sid2nslc (msr->sid, network, station, location, channel);
-  if (rv)
+  chunk->numwindows = 0;
+  restartSlidingWindow (window);
+  if (sketches)
   {
-    printf ("Error returned ms_sid2nslc()\n");
-    return -1;
+    sketches->job     = job;
+    sketches->current = -1;
   }
-  if (msr)
-    msr3_free (&msr);
 
-  /* Loop over the selected segments */
-  nstime_t starttime = ms_time2nstime (year, yday, 0, 0, 0, 0);
-  nstime_t endtime   = starttime + (nstime_t) (windowSize * NSECS);
-  nstime_t timeStampFirst;
-  int i, counter = 0;
-  for (i = 0; i < segments; i++)
+  /* Loop over the time windows, cutting each one out of the sample store */
+  while (k < chunk->kEnd)
   {
 #ifdef DEBUG
-    printf ("index: %d\n", i);
+    printf ("index: %" PRId64 "\n", k);
 #endif
     /* Record the time stamp of each time interval */
     nstime_t timeStamp;
+    /* Record the sampling rate of each trace */
+    double samplingRate;
+    WindowStats stats;
+
+    /* Find the samples falling in this window */
+    nstime_t starttime = job->gridStart + k * nextTimeStamp_ns;
+    nstime_t endtime   = starttime + windowSize_ns;
+    int64_t lo         = traceIndexAt (trace, starttime);
+    int64_t hi         = traceIndexAt (trace, endtime);
+    uint64_t total     = hi - lo;
+
+    /* Seems this interval has no data, jump to the first window holding
+     * the next sample instead of probing every window of the gap */
+    if (hi <= lo)
+    {
+      if (lo >= trace->numsamples)
+        break;
+      int64_t next = firstWindowOf (traceSampleTime (trace, lo), job->gridStart,
+                                    windowSize_ns, nextTimeStamp_ns);
+      k = (next > k) ? next : k + 1;
+      continue;
+    }
+    k++;
 
-    MS3TraceList *mstl        = NULL;
-    MS3TraceID *tid           = NULL;
-    MS3TraceSeg *seg          = NULL;
-    MS3Selections *selections = NULL;
-
-    /* Create selection for time window */
-    MS3Selections testselection;
-    MS3SelectTime testselectime;
-
-    testselection.sidpattern[0] = '*';
-    testselection.sidpattern[1] = '\0';
-    testselection.timewindows   = &testselectime;
-    testselection.next          = NULL;
-    testselection.pubversion    = 0;
-
-    testselectime.starttime = starttime;
-    testselectime.endtime   = endtime;
-    testselectime.next      = NULL;
+    nstime_t first = traceSampleTime (trace, lo);
+    nstime_t last  = traceSampleTime (trace, hi - 1);
+    samplingRate   = trace->segments[traceSegmentOf (trace, lo)].samprate;
 
 #ifdef DEBUG
-    ms3_printselections (&testselection);
-#endif
-
-    /* Read all miniSEED into a trace list, limiting to time selections */
-    rv = ms3_readtracelist_selection (&mstl, mseedfile, NULL,
-                                      &testselection, 0, flags, verbose);
-
-    /* If there are some records in this time window */
-    if (rv == MS_NOERROR)
+    char starttimestr[30];
+    char endtimestr[30];
+    if (!ms_nstime2timestr (first, starttimestr, ISOMONTHDAY, NANO_MICRO_NONE) ||
+        !ms_nstime2timestr (last, endtimestr, ISOMONTHDAY, NANO_MICRO_NONE))
     {
-      counter++;
+      ms_log (2, "Cannot create time strings\n");
+      starttimestr[0] = endtimestr[0] = '\0';
     }
-    else if (rv == MS_NOTSEED)
-    {
-#ifdef DEBUG
-      ms_log (1, "Seems this interval has no data or there is no miniSEED data\n");
+    ms_log (0, "TraceID for %s, earliest: %s, latest: %s, samples: %" PRIu64 "\n",
+            trace->sid, starttimestr, endtimestr, total);
 #endif
-      starttime += nextTimeStamp_ns;
-      endtime += nextTimeStamp_ns;
 
-      /* Make sure everything is cleaned up */
-      if (mstl)
-        mstl3_free (&mstl, 0);
-      if (selections)
-        ms3_freeselections (selections);
+    /* Get the time stamp of this interval */
+    timeStamp = first + (last - first) / 2;
 
+    if (isWindowTooShort (total, samplingRate))
+    {
+      countStage (COUNT_SHORTWINDOWS, 1);
       continue;
     }
-    else
+
+    /* Slide the running statistics over to this window */
+    startStage (&timer);
+    if (advanceSlidingWindow (window, trace, lo, hi))
     {
-      ms_log (2, "Cannot read miniSEED from file: %s\n", ms_errorstr (rv));
+      printf ("something wrong when sliding the time window\n");
       return -1;
     }
-
-#ifdef DEBUG
-    mstl3_printtracelist (mstl, ISOMONTHDAY, 1, 1);
-#endif
-
-    /* Traverse trace list structures and print summary information */
-    tid = mstl->traces;
-    while (tid)
+    getSlidingWindowStats (window, &stats);
+    if (sketches)
     {
-      /* allocate the data array of every trace */
-      double *data = NULL;
-      uint64_t dataSize;
-      /* Record the sampling rate of each trace */
-      double samplingRate;
-
-      if (!ms_nstime2timestr (tid->earliest, starttimestr, ISOMONTHDAY, NANO_MICRO_NONE) ||
-          !ms_nstime2timestr (tid->latest, endtimestr, ISOMONTHDAY, NANO_MICRO_NONE))
-      {
-        ms_log (2, "Cannot create time strings\n");
-        starttimestr[0] = endtimestr[0] = '\0';
-      }
+      QuantileSketch merged;
 
+      sketchWindow (sketches, k - 1, &merged);
+      setWindowPercentiles (&merged, config, &stats);
+    }
+    endStage (&timer, STAGE_STATS);
 #ifdef DEBUG
-      ms_log (0, "TraceID for %s (%d), earliest: %s, latest: %s, segments: %u\n",
-              tid->sid, tid->pubversion, starttimestr, endtimestr, tid->numsegments);
+    printf ("mean: %.2lf standard deviation: %.2lf\n", stats.mean, stats.SD);
+    printf ("\n");
 #endif
 
-      /* Get the time stamp of this interval */
-      timeStamp = tid->earliest + (tid->latest - tid->earliest) / 2;
-
-      /* Record the time of the first segment, used by RMS file */
-      if (counter == 1)
-      {
-        timeStampFirst = timeStamp;
-      }
+    if (addChunkWindow (chunk, timeStamp, &stats))
+      return -1;
+  }
 
-      /* Create time stamp string */
-      if (!ms_nstime2timestr (timeStamp,
-                              timeStampStr, ISOMONTHDAY, NONE))
-      {
-        ms_log (2, "Cannot create time stamp strings\n");
-        return -1;
-      }
-#ifdef DEBUG
-      ms_log (0, "Time stamp: %s\n", timeStampStr);
-#endif
+  return 0;
+}
 
-      uint64_t total = 0;
-      seg            = tid->first;
-      samplingRate   = seg->samprate;
-      while (seg)
-      {
-        total += seg->samplecnt;
-        seg = seg->next;
-      }
-#ifdef DEBUG
-      printf ("estimated samples of this trace: %" PRId64 "\n", total);
-#endif
+static void *
+chunkWorker (void *arg)
+{
+  ChunkRound *round      = ((ChunkWorkerArg *)arg)->round;
+  SlidingWindow *window = ((ChunkWorkerArg *)arg)->window;
+  SketchRing *sketches  = ((ChunkWorkerArg *)arg)->sketches;
+  int i;
 
-      seg = tid->first;
+  while ((i = atomic_fetch_add (&round->next, 1)) < round->numchunks)
+    round->chunks[i].rv = computeChunk (round->job, window, sketches, &round->chunks[i]);
 
-      /* malloc the data array */
-      dataSize = total;
-      data     = (double *)malloc (sizeof (double) * dataSize);
-      if (data == NULL)
-      {
-        printf ("something wrong when malloc data array\n");
-        exit (-1);
-      }
+  return NULL;
+}
 
-      /* If the duration of this trace is smaller than 20 seconds ignore this trace */
-      if (total * samplingRate < 20)
-      {
-        printf ("Number of data of this trace is smaller than 20 * %lf\n", samplingRate);
-        counter--;
-        free (data);
-        tid = tid->next;
-        continue;
-      }
+/* Run the window loop of one trace, handing each window to the sink.
+ * The grid is cut into chunks of windows that restart the sliding window,
+ * at fixed grid positions, so a trace can be spread over job->numThreads
+ * threads and still produce the same windows as on one. Rounds of chunks
+ * are computed in parallel, then written in time order. */
+static int
+traverseTrace (TraceJob *job)
+{
+  const StoreTrace *trace      = job->trace;
+  const TraverseConfig *config = job->config;
+  const WindowSink *sink       = job->sink;
+  int numThreads               = (job->numThreads > 1) ? job->numThreads : 1;
+  int roundSize                = (numThreads > 1) ? numThreads * CHUNKSPERTHREAD : 1;
+  ChunkRound round;
+  WindowChunk *chunks     = NULL;
+  SlidingWindow *windows  = NULL;
+  SketchRing *sketches    = NULL;
+  ChunkWorkerArg *args    = NULL;
+  pthread_t *threads      = NULL;
+  void *channel;
+  int rv = 0;
+  int c;
+  int t;
+
+  /* Windows start every step on a grid anchored at gridStart */
+  int nextTimeStamp         = config->windowSize - (config->windowSize * config->windowOverlap / 100);
+  nstime_t nextTimeStamp_ns = nextTimeStamp * NSECS;
+  nstime_t windowSize_ns    = (nstime_t)config->windowSize * NSECS;
 
-      /* The beginning of the output file */
-      if (counter == 1)
-      {
-        char temp[30];
-        if (!ms_nstime2timestr (timeStamp, temp, SEEDORDINAL, NONE))
-        {
-          ms_log (2, "Cannot create time stamp strings\n");
-          return -1;
-        }
-        if (outputFormatFlag == 1 || outputFormatFlag == 0)
-          fprintf (fptrRMS, "\"%s\",\"%s\",\"%s\",\"%s\",\"%s\"\r\n",
-                   temp, station, network, channel, location);
-        if (outputFormatFlag == 2 || outputFormatFlag == 0)
-          fprintf (fptrJSON, "{\"network\":\"%s\",\"station\":\"%s\",\"location\":\"%s\",\"channel\":\"%s\",\"data\":[",
-                   network, station, location, channel);
-      }
+  /* Restarting the sliding window costs one window of samples, so a
+   * chunk holds enough windows for that to stay small */
+  int64_t chunkWindows = WINDOWCHUNK * ((config->windowSize + nextTimeStamp - 1) / nextTimeStamp);
 
-      int64_t index = 0;
-      total         = 0;
+  /* Percentiles merge sketches of base blocks dividing both */
+  int64_t block_s = greatestCommonDivisor (config->windowSize, nextTimeStamp);
 
-      while (seg)
-      {
-        if (!ms_nstime2timestr (seg->starttime, starttimestr, ISOMONTHDAY, NANO) ||
-            !ms_nstime2timestr (seg->endtime, endtimestr, ISOMONTHDAY, NANO))
-        {
-          ms_log (2, "Cannot create time strings\n");
-          starttimestr[0] = endtimestr[0] = '\0';
-        }
+  /* Open the output files */
+  if ((channel = sink->open (sink->userdata, trace->sid, job->outputBase)) == NULL)
+  {
+    return -1;
+  }
 
-#ifdef DEBUG
-        ms_log (0, "  Segment %s - %s, samples: %" PRId64 ", sample rate: %g\n",
-                starttimestr, endtimestr, seg->samplecnt, seg->samprate);
-#endif
+  chunks  = (WindowChunk *)calloc (roundSize, sizeof (WindowChunk));
+  windows = (SlidingWindow *)calloc (numThreads, sizeof (SlidingWindow));
+  args    = (ChunkWorkerArg *)calloc (numThreads, sizeof (ChunkWorkerArg));
+  threads = (pthread_t *)calloc (numThreads, sizeof (pthread_t));
+  if (config->numPercentiles > 0)
+    sketches = (SketchRing *)calloc (numThreads, sizeof (SketchRing));
+  if (chunks == NULL || windows == NULL || args == NULL || threads == NULL ||
+      (config->numPercentiles > 0 && sketches == NULL))
+  {
+    printf ("something wrong when malloc window chunks\n");
+    rv = -1;
+  }
+  for (t = 0; rv == 0 && t < numThreads; t++)
+  {
+    initSlidingWindow (&windows[t], nextTimeStamp < config->windowSize);
+    args[t].round  = &round;
+    args[t].window = &windows[t];
+    if (sketches == NULL)
+      continue;
 
-        /* Unpack and print samples for this trace segment */
-        if (seg->recordlist && seg->recordlist->first)
-        {
-          /* Determine sample size and type based on encoding of first record */
-          ms_encoding_sizetype (seg->recordlist->first->msr->encoding, &samplesize, &sampletype);
-
-          /* Unpack data samples using record list.
-         * No data buffer is supplied, so it will be allocated and assigned to the segment.
-         * Alternatively, a user-specified data buffer can be provided here. */
-          unpacked = mstl3_unpack_recordlist (tid, seg, NULL, 0, verbose);
-
-          if (unpacked != seg->samplecnt)
-          {
-            ms_log (2, "Cannot unpack samples for %s\n", tid->sid);
-          }
-          else
-          {
-            if (sampletype == 'a')
-            {
-              printf ("%*s",
-                      (seg->numsamples > INT_MAX) ? INT_MAX : (int)seg->numsamples,
-                      (char *)seg->datasamples);
-            }
-            else
-            {
-              lines = (unpacked / 6) + 1;
-
-              for (idx = 0, lineidx = 0; lineidx < lines; lineidx++)
-              {
-                for (col = 0; col < 6 && idx < seg->numsamples; col++)
-                {
-                  sptr = (char *)seg->datasamples + (idx * samplesize);
-
-                  if (sampletype == 'i')
-                  {
-                    data[index] = (double)(*(int32_t *)sptr);
-                  }
-                  else if (sampletype == 'f')
-                  {
-                    data[index] = (double)(*(float *)sptr);
-                  }
-                  else if (sampletype == 'd')
-                  {
-                    data[index] = (double)(*(double *)sptr);
-                  }
-
-                  idx++;
-                  index++;
-                }
-              }
-            }
-          }
-        }
+    sketches[t].size     = config->windowSize / block_s;
+    sketches[t].step     = nextTimeStamp / block_s;
+    sketches[t].block_ns = block_s * NSECS;
+    sketches[t].sketches = (QuantileSketch *)malloc (sizeof (QuantileSketch) * sketches[t].size);
+    sketches[t].blocks   = (int64_t *)malloc (sizeof (int64_t) * sketches[t].size);
+    if (sketches[t].sketches == NULL || sketches[t].blocks == NULL)
+    {
+      printf ("something wrong when malloc window chunks\n");
+      rv = -1;
+      break;
+    }
+    memset (sketches[t].blocks, -1, sizeof (int64_t) * sketches[t].size);
+    args[t].sketches    = &sketches[t];
+    windows[t].hook     = sketchEnteringSpan;
+    windows[t].hookData = &sketches[t];
+  }
 
-        total += seg->numsamples;
-        seg = seg->next;
-      }
+  /* The grid covers the data of the trace, from the first window holding
+   * its first sample to the window starting at or before its last one */
+  int64_t k     = 0;
+  int64_t kLast = -1;
+  if (trace->numsamples > 0)
+  {
+    nstime_t dataStart = traceSampleTime (trace, 0);
+    nstime_t dataEnd   = traceSampleTime (trace, trace->numsamples - 1);
 
+    k     = firstWindowOf (dataStart, job->gridStart, windowSize_ns, nextTimeStamp_ns);
+    kLast = (dataEnd - job->gridStart) / nextTimeStamp_ns;
+  }
 #ifdef DEBUG
-      printf ("total samples of this trace: %" PRId64 "\n", total);
-      /* print the data samples of every trace */
-      printf ("data samples of this trace: %" PRId64 " index: %" PRId64 "\n", dataSize, index);
+  printf ("windows: %" PRId64 " to %" PRId64 "\n", k, kLast);
 #endif
 
-      /* Calculate the mean and standard deviation */
-      double mean, SD;
-      getMeanAndSD (data, dataSize, &mean, &SD);
-#ifdef DEBUG
-      printf ("mean: %.2lf standard deviation: %.2lf\n", mean, SD);
-      printf ("\n");
-#endif
-      /* Calculate the min and max with all and demain */
-      double min, max, minDemean, maxDemean;
-      getMinMaxAndDemean (data, dataSize, &min, &max,
-                          &minDemean, &maxDemean, mean);
+  round.job    = job;
+  round.chunks = chunks;
+  while (rv == 0 && k <= kLast)
+  {
+    /* Lay out the next chunks, each ending on a multiple of chunkWindows
+     * and starting past any gap before it */
+    for (round.numchunks = 0; round.numchunks < roundSize && k <= kLast; round.numchunks++)
+    {
+      int64_t lo = traceIndexAt (trace, job->gridStart + k * nextTimeStamp_ns);
+      if (lo >= trace->numsamples)
+        break;
+      int64_t next = firstWindowOf (traceSampleTime (trace, lo), job->gridStart,
+                                    windowSize_ns, nextTimeStamp_ns);
+      if (next > k)
+        k = next;
+      if (k > kLast)
+        break;
+      chunks[round.numchunks].k    = k;
+      chunks[round.numchunks].kEnd = (k / chunkWindows + 1) * chunkWindows;
+      if (chunks[round.numchunks].kEnd > kLast + 1)
+        chunks[round.numchunks].kEnd = kLast + 1;
+      k = chunks[round.numchunks].kEnd;
+    }
+    if (round.numchunks == 0)
+      break;
 
-      /* Output timestamp, mean and standard deviation to output files */
-      if (outputFormatFlag == 1 || outputFormatFlag == 0)
-        write2RMS (fptrRMS, timeStamp - timeStampFirst, mean, SD,
-                   min, max, minDemean, maxDemean);
+    /* Compute them, this thread taking its share */
+    atomic_init (&round.next, 0);
+    for (t = 1; t < numThreads && t < round.numchunks; t++)
+    {
+      if (pthread_create (&threads[t], NULL, chunkWorker, &args[t]))
+        break;
+    }
+    chunkWorker (&args[0]);
+    while (--t > 0)
+      pthread_join (threads[t], NULL);
 
-      if (outputFormatFlag == 2 || outputFormatFlag == 0)
+    /* Output timestamp, mean and standard deviation in time order */
+    for (c = 0; rv == 0 && c < round.numchunks; c++)
+    {
+      rv = chunks[c].rv;
+      for (int64_t w = 0; rv == 0 && w < chunks[c].numwindows; w++)
       {
-        if (counter == 1)
-          fprintf (fptrJSON, "{\"timestamp\":\"%s\",\"mean\":%.2lf,\"rms\":%.2lf,\"min\":%.2lf,\"max\":%.2lf,\"minDemean\":%.2lf,\"maxDemean\":%.2lf}",
-                   timeStampStr, mean, SD, min, max, minDemean, maxDemean);
-        else
-          fprintf (fptrJSON, ",{\"timestamp\":\"%s\",\"mean\":%.2lf,\"rms\":%.2lf,\"min\":%.2lf,\"max\":%.2lf,\"minDemean\":%.2lf,\"maxDemean\":%.2lf}",
-                   timeStampStr, mean, SD, min, max, minDemean, maxDemean);
+        if (sink->write (channel, chunks[c].windows[w].timeStamp, &chunks[c].windows[w].stats))
+          rv = -1;
       }
-
-      /* clean up the data array in the end of every trace */
-      free (data);
-
-      tid = tid->next;
     }
-
-    starttime += nextTimeStamp_ns;
-    endtime += nextTimeStamp_ns;
-
-    /* Make sure everything is cleaned up */
-    if (mstl)
-      mstl3_free (&mstl, 0);
-    if (selections)
-      ms3_freeselections (selections);
   }
 
-  if (outputFormatFlag == 2 || outputFormatFlag == 0)
-    fprintf (fptrJSON, "]}");
-
   /* Close the output files */
-  if (outputFormatFlag == 1 || outputFormatFlag == 0)
-    fclose (fptrRMS);
-  if (outputFormatFlag == 2 || outputFormatFlag == 0)
-    fclose (fptrJSON);
+  if (sink->close (channel))
+    rv = -1;
+  for (c = 0; chunks && c < roundSize; c++)
+    free (chunks[c].windows);
+  for (t = 0; windows && t < numThreads; t++)
+    freeSlidingWindow (&windows[t]);
+  for (t = 0; sketches && t < numThreads; t++)
+  {
+    free (sketches[t].sketches);
+    free (sketches[t].blocks);
+  }
+  free (chunks);
+  free (sketches);
+  free (windows);
+  free (args);
+  free (threads);
 
-  return 0;
+  return rv;
 }
 
-/* Function of testing libmseed selection feature. DO NOT USE IT. */
-int
-traverseTimeWindowLimited (const char *mseedfile, const char *outputFileRMS, const char *outputFileJSON,
-                           int windowSize, int windowOverlap)
+/* Write window k of a setting, merged from the base blocks it covers */
+static int
+writeMergedWindow (TraceJob *job, WindowSetting *setting, const BaseBlock *ring, int64_t ringSize)
 {
-  MS3TraceList *mstl = NULL;
-  /*MS3TraceID *tid           = NULL;
-  MS3TraceSeg *seg          = NULL;*/
-  MS3Selections *selections = NULL;
-  MS3Tolerance *tolerance   = NULL;
-  char *buffer              = NULL;
-  struct stat sb            = {0};
-  FILE *inputFileHandler    = NULL;
-  uint64_t bufferLen        = 0;
-  char starttimestr[30];
-  char endtimestr[30];
-  nstime_t starttime;
-  nstime_t endtime;
-  int8_t splitVer = 0;
-  uint32_t flags  = 0;
-  int8_t verbose  = 0;
-  /*size_t idx;*/
-  int rv;
+  const StoreTrace *trace = job->trace;
+  RunningStats merged;
+  QuantileSketch sketch;
+  WindowStats stats;
+  StageTimer timer;
+  int64_t lo = -1;
+  int64_t hi = -1;
+  int64_t j;
+
+  startStage (&timer);
+  initRunningStats (&merged);
+  initQuantileSketch (&sketch);
+  for (j = setting->k * setting->step; j < setting->k * setting->step + setting->size; j++)
+  {
+    const BaseBlock *block = &ring[j % ringSize];
 
-  /*int64_t unpacked;
-  uint8_t samplesize;
-  char sampletype;
-  size_t lineidx;
-  size_t lines;
-  int col;
-  void *sptr;
+    if (block->hi <= block->lo)
+      continue;
+    if (lo < 0)
+      lo = block->lo;
+    hi = block->hi;
+    mergeRunningStats (&merged, &block->stats);
+    if (block->sketch)
+      mergeQuantileSketch (&sketch, block->sketch);
+  }
+  endStage (&timer, STAGE_STATS);
 
-  FILE *fptrRMS;
-  FILE *fptrJSON;*/
+  /* Windows without data are skipped, as by the sliding window loop */
+  if (lo < 0)
+    return 0;
 
-  /* Buffers for storing source id, network, station, location and channel */
-  //char sid[LM_SIDLEN];
-  char network[11];
-  char station[11];
-  char location[11];
-  char channel[31];
+  nstime_t first = traceSampleTime (trace, lo);
+  nstime_t last  = traceSampleTime (trace, hi - 1);
+  if (isWindowTooShort (hi - lo, trace->segments[traceSegmentOf (trace, lo)].samprate))
+  {
+    countStage (COUNT_SHORTWINDOWS, 1);
+    return 0;
+  }
 
-  /* Set bit flag to validate CRC */
-  flags |= MSF_VALIDATECRC;
+  startStage (&timer);
+  getRunningStatsResult (&merged, &stats);
+  if (job->config->numPercentiles > 0)
+    setWindowPercentiles (&sketch, job->config, &stats);
+  endStage (&timer, STAGE_STATS);
+
+  return job->sink->write (setting->channel, first + (last - first) / 2, &stats);
+}
 
-  /* Set bit flag to build a record list */
-  flags |= MSF_RECORDLIST;
+/* Run the windows of several settings over one trace in a single pass.
+ * The grid is cut into base blocks as long as the greatest common
+ * divisor of every window size and step, each block is summarized once,
+ * and every window merges the blocks it covers as soon as the last one
+ * is done. Blocks are kept in a ring as long as the largest window.
+ * Each setting is written to <outputBase>.<size>_<overlap>. */
+static int
+traverseTraceSettings (TraceJob *job)
+{
+  const StoreTrace *trace      = job->trace;
+  const TraverseConfig *config = job->config;
+  const WindowSink *sink       = job->sink;
+  int numsettings              = config->numWindowSpecs;
+  WindowSetting settings[MAXWINDOWSPECS];
+  BaseBlock *ring          = NULL;
+  QuantileSketch *sketches = NULL;
+  int64_t ringSize         = 0;
+  int64_t block_s          = 0;
+  int64_t bFirst           = INT64_MAX;
+  int64_t bLast            = -1;
+  int64_t bData;
+  nstime_t block_ns;
+  StageTimer timer;
+  SpanCursor cursor;
+  StatsSpan span;
+  int64_t b, j, hi;
+  int rv = 0;
+  int i;
 
-  /* Read input file into buffer */
-  if (!(inputFileHandler = fopen (mseedfile, "rb")))
+  if (numsettings > MAXWINDOWSPECS)
+    numsettings = MAXWINDOWSPECS;
+  for (i = 0; i < numsettings; i++)
   {
-    ms_log (2, "Error opening file %s: %s\n", mseedfile, strerror (errno));
-    return -1;
+    const WindowSpec *spec = &config->windowSpecs[i];
+    int64_t step_s         = spec->windowSize - (spec->windowSize * spec->windowOverlap / 100);
+
+    block_s = greatestCommonDivisor (block_s, greatestCommonDivisor (spec->windowSize, step_s));
   }
-  if (fstat (fileno (inputFileHandler), &sb))
+  block_ns = block_s * NSECS;
+
+  for (i = 0; i < numsettings; i++)
   {
-    ms_log (2, "Error stating file %s: %s\n", mseedfile, strerror (errno));
-    return -1;
+    const WindowSpec *spec = &config->windowSpecs[i];
+    WindowSetting *setting = &settings[i];
+    char outputBase[1024];
+
+    setting->size = spec->windowSize / block_s;
+    setting->step = (spec->windowSize - (spec->windowSize * spec->windowOverlap / 100)) / block_s;
+    if (setting->size > ringSize)
+      ringSize = setting->size;
+
+    if (job->outputBase)
+      snprintf (outputBase, sizeof (outputBase), "%s.%d_%d", job->outputBase,
+                spec->windowSize, spec->windowOverlap);
+    if ((setting->channel = sink->open (sink->userdata, trace->sid,
+                                        (job->outputBase) ? outputBase : NULL)) == NULL)
+    {
+      while (i-- > 0)
+        sink->close (settings[i].channel);
+      return -1;
+    }
+
+    /* Same window range as the sliding window loop */
+    setting->k     = 0;
+    setting->kLast = -1;
+    if (trace->numsamples > 0)
+    {
+      nstime_t dataStart = traceSampleTime (trace, 0);
+      nstime_t dataEnd   = traceSampleTime (trace, trace->numsamples - 1);
+
+      setting->k     = firstWindowOf (dataStart, job->gridStart, setting->size * block_ns,
+                                      setting->step * block_ns);
+      setting->kLast = (dataEnd - job->gridStart) / (setting->step * block_ns);
+      if (setting->k * setting->step < bFirst)
+        bFirst = setting->k * setting->step;
+      if (setting->kLast * setting->step + setting->size - 1 > bLast)
+        bLast = setting->kLast * setting->step + setting->size - 1;
+    }
   }
-  if (!(buffer = (char *)malloc (sb.st_size)))
+
+  if (bLast >= 0 && ((ring = (BaseBlock *)malloc (sizeof (BaseBlock) * ringSize)) == NULL ||
+                     (config->numPercentiles > 0 &&
+                      (sketches = (QuantileSketch *)malloc (sizeof (QuantileSketch) * ringSize)) == NULL)))
   {
-    ms_log (2, "Error allocating buffer of %" PRIsize_t " bytes\n",
-            (sb.st_size >= 0) ? (size_t)sb.st_size : 0);
-    return -1;
+    ms_log (2, "Cannot allocate base blocks\n");
+    rv = -1;
   }
-  if (fread (buffer, sb.st_size, 1, inputFileHandler) != 1)
+  for (b = 0; rv == 0 && b < ringSize; b++)
+    ring[b].sketch = (sketches) ? &sketches[b] : NULL;
+
+  hi    = (bLast >= 0) ? traceIndexAt (trace, job->gridStart + bFirst * block_ns) : 0;
+  bData = bFirst - ringSize; /* Last block holding samples */
+  for (b = bFirst; rv == 0 && b <= bLast; b++)
   {
-    ms_log (2, "Error reading file %s\n", mseedfile);
-    return -1;
+    BaseBlock *block = &ring[b % ringSize];
+
+    /* Summarize the block, its samples follow those of the previous one */
+    startStage (&timer);
+    block->lo = hi;
+    block->hi = hi = traceIndexAt (trace, job->gridStart + (b + 1) * block_ns);
+    initRunningStats (&block->stats);
+    if (block->sketch)
+      initQuantileSketch (block->sketch);
+    openSpanCursor (&cursor, trace, block->lo, block->hi);
+    while (nextSpan (&cursor, &span, NULL))
+    {
+      addRunningStats (&block->stats, span.samples, span.sampletype, span.count);
+      if (block->sketch)
+        addQuantileSketch (block->sketch, span.samples, span.sampletype, span.count);
+    }
+    endStage (&timer, STAGE_STATS);
+
+    /* Windows ending with this block are complete */
+    for (i = 0; i < numsettings; i++)
+    {
+      WindowSetting *setting = &settings[i];
+
+      if (setting->k > setting->kLast || setting->k * setting->step + setting->size - 1 != b)
+        continue;
+      if (writeMergedWindow (job, setting, ring, ringSize))
+      {
+        rv = -1;
+        break;
+      }
+      setting->k++;
+    }
+
+    /* Once no window ending with the next block reaches the data before
+     * a gap, jump to the block of the next sample as the sliding window
+     * loop does. The blocks skipped are empty, as is every window ending
+     * in them, so no setting has anything to write there. */
+    if (block->hi > block->lo)
+      bData = b;
+    if (rv == 0 && b + 1 >= bData + ringSize && hi < trace->numsamples)
+    {
+      int64_t bNext = (traceSampleTime (trace, hi) - job->gridStart) / block_ns;
+
+      if (bNext > b + 1)
+      {
+        for (j = 0; j < ringSize; j++)
+          ring[j].lo = ring[j].hi = hi;
+        for (i = 0; i < numsettings; i++)
+        {
+          WindowSetting *setting = &settings[i];
+          int64_t first          = bNext - setting->size + 1;
+
+          if (first > setting->k * setting->step)
+            setting->k = (first + setting->step - 1) / setting->step;
+        }
+        b = bNext - 1;
+      }
+    }
   }
-  fclose (inputFileHandler);
-  bufferLen = sb.st_size;
 
-  mstl = mstl3_init (NULL);
-  if (!mstl)
+  for (i = 0; i < numsettings; i++)
   {
-    ms_log (2, "Error allocating MS3TraceList\n");
-    return -1;
+    if (sink->close (settings[i].channel))
+      rv = -1;
   }
-  /* Read all miniSEED in buffer, accumulate in MS3TraceList */
-  rv = mstl3_readbuffer (&mstl, buffer, bufferLen,
-                         splitVer, flags, NULL, verbose);
-  if (rv < 0)
+  free (ring);
+  free (sketches);
+
+  return rv;
+}
+
+static void *
+traceWorker (void *arg)
+{
+  TraceJobQueue *queue = (TraceJobQueue *)arg;
+  int i;
+
+  while ((i = atomic_fetch_add (&queue->next, 1)) < queue->numjobs)
   {
-    ms_log (2, "Error reading miniSEED record from buffer: %s\n", ms_errorstr (rv));
-    return -1;
+    TraceJob *job = &queue->jobs[i];
+    job->rv       = (job->config->numWindowSpecs > 1) ? traverseTraceSettings (job) : traverseTrace (job);
   }
 
-  /* Get the start time and end time of this buffer */
-  starttime = mstl->traces->earliest;
-  endtime   = mstl->last->latest;
-  printf ("starttime: %s endtime: %s\n",
-          ms_nstime2timestr (starttime, starttimestr, ISOMONTHDAY, NANO),
-          ms_nstime2timestr (endtime, endtimestr, ISOMONTHDAY, NANO));
+  return NULL;
+}
 
-  /* Get source ID and parse network, station, location and channel */
-  rv = ms_sid2nslc (mstl->traces->sid, network, station, location, channel);
-  if (rv < 0)
+/* Build "<prefix><suffix><extension>" */
+static char *
+makeOutputFileName (const char *outputPrefix, const char *suffix, const char *extension)
+{
+  char *fileName = (char *)malloc (strlen (outputPrefix) + strlen (suffix) + strlen (extension) + 1);
+
+  if (fileName == NULL)
   {
-    ms_log (2, "Error parsing source ID\n");
-    return -1;
+    printf ("something wrong when malloc output file name\n");
+    return NULL;
   }
+  strcpy (fileName, outputPrefix);
+  strcat (fileName, suffix);
+  strcat (fileName, extension);
 
-  /* Clean up trace list */
-  if (mstl)
+  return fileName;
+}
+
+/* Compute the windows of every source ID of a loaded store, each on
+ * its own worker thread. Windows go to config->sink, with a NULL
+ * outputPrefix when the sink needs no output names, or to output files
+ * when it is NULL: a store holding a single source ID is written to
+ * <outputPrefix>.rms and <outputPrefix>.json; with several source IDs
+ * each one is written to <outputPrefix>.<NET>.<STA>.<LOC>.<CHAN>.rms and
+ * .json instead. */
+int
+traverseSampleStore (const SampleStore *store, const char *outputPrefix, const TraverseConfig *config)
+{
+  FileSinkOptions fileOptions;
+  WindowSink fileSink;
+  const WindowSink *sink = config->sink;
+  TraceJobQueue queue;
+  pthread_t *threads = NULL;
+  int numThreads;
+  int rv = 0;
+  int t;
+
+  if (store->numtraces == 0)
+    return 0;
+
+  if (sink == NULL)
   {
-    mstl3_free (&mstl, 0);
+    fileOptions.outputFormatFlag = config->outputFormatFlag;
+    fileOptions.flush            = 0;
+    makeFileSink (&fileSink, &fileOptions);
+    sink = &fileSink;
   }
 
-  /* Calculate how many segments of this routine */
-  int nextTimeStamp = windowSize - (windowSize * windowOverlap / 100);
-  int segments      = (endtime - starttime) / NSECS / nextTimeStamp;
+  /* Get the day of the earliest data, every trace shares its window grid */
+  nstime_t earliest = store->traces[0].earliest;
+  for (t = 1; t < store->numtraces; t++)
+  {
+    if (store->traces[t].earliest < earliest)
+      earliest = store->traces[t].earliest;
+  }
+  uint16_t year, yday;
+  ms_nstime2time (earliest, &year, &yday, NULL, NULL, NULL, NULL);
 #ifdef DEBUG
-  printf ("num of segments: %d\n", segments);
+  printf ("year and yday of the earliest data: %" PRId16 " %" PRId16 "\n", year, yday);
 #endif
-  nstime_t nextTimeStamp_ns = nextTimeStamp * NSECS;
-  /*char timeStampStr[30];
-  nstime_t timeStampFirst;*/
 
-#if 0
-  /* Open the output files */
-  fptrRMS  = fopen (outputFileRMS, "w");
-  fptrJSON = fopen (outputFileJSON, "w");
-  if (fptrRMS == NULL)
+  /* Create one job per source ID */
+  queue.jobs    = (TraceJob *)calloc (store->numtraces, sizeof (TraceJob));
+  queue.numjobs = store->numtraces;
+  atomic_init (&queue.next, 0);
+  if (queue.jobs == NULL)
   {
-    printf ("Error opening file %s\n", outputFileRMS);
+    printf ("something wrong when malloc trace jobs\n");
     return -1;
   }
-  else if (fptrJSON == NULL)
+  for (t = 0; t < store->numtraces; t++)
   {
-    printf ("Error opening file %s\n", outputFileJSON);
-    return -1;
-  }
-#endif
+    TraceJob *job = &queue.jobs[t];
+    char suffix[LM_SIDLEN + 8] = "";
 
-  /* Create selections */
-  /* NOTE: MAY SUFFER API CHANGES IN THE FUTURE.*/
-  int i;
-  /*int counter = 0;*/
-  char *sidpattern   = "*";
-  uint8_t pubversion = 0;
-  starttime          = endtime - nextTimeStamp_ns;
-  for (i = 0; i < segments; i++)
-  {
-    MS3Selections *newselections = NULL;
-    MS3SelectTime *newselecttime = NULL;
-
-    /* Allocate new SelectTime struct and populate */
-    newselecttime = (MS3SelectTime *)libmseed_memory.malloc (sizeof (MS3SelectTime));
-    if (newselecttime == NULL)
+    job->trace     = &store->traces[t];
+    job->config    = config;
+    job->sink      = sink;
+    job->gridStart = ms_time2nstime (year, yday, 0, 0, 0, 0);
+
+    /* Sinks other than files do not need output names */
+    if (outputPrefix == NULL)
+      continue;
+
+    if (store->numtraces > 1)
     {
-      ms_log (2, "Error allocating selection time\n");
-      return -1;
+      char network[11];
+      char station[11];
+      char location[11];
+      char channel[31];
+
+      if (ms_sid2nslc (job->trace->sid, network, station, location, channel))
+      {
+        printf ("Error returned ms_sid2nslc()\n");
+        rv = -1;
+        break;
+      }
+      snprintf (suffix, sizeof (suffix), ".%s.%s.%s.%s", network, station, location, channel);
     }
-    memset (newselecttime, 0, sizeof (MS3SelectTime));
-    newselecttime->starttime = starttime;
-    newselecttime->endtime   = endtime;
-    newselecttime->next      = NULL;
-
-    /* Allocate new Selections struct and populate */
-    newselections = (MS3Selections *)libmseed_memory.malloc (sizeof (MS3Selections));
-    if (newselections == NULL)
+    if ((job->outputBase = makeOutputFileName (outputPrefix, suffix, "")) == NULL)
     {
-      ms_log (2, "Error allocating selections\n");
-      return -1;
+      rv = -1;
+      break;
     }
-    memset (newselections, 0, sizeof (MS3Selections));
-    strncpy (newselections->sidpattern, sidpattern, sizeof (newselections->sidpattern));
-    newselections->sidpattern[sizeof (newselections->sidpattern) - 1] = '\0';
-    newselections->pubversion                                         = pubversion;
-    newselections->timewindows                                        = newselecttime;
-    /* Add new Selections to the beginning of of selections */
-    newselections->next = selections;
-    selections          = newselections;
-
-    starttime -= nextTimeStamp_ns;
-    endtime -= nextTimeStamp_ns;
   }
 
-  testPrintSelections (selections);
+  /* Run the traces on worker threads, never more threads than traces */
+  numThreads = config->numThreads;
+  if (numThreads <= 0)
+    numThreads = (int)sysconf (_SC_NPROCESSORS_ONLN);
+  if (numThreads < 1)
+    numThreads = 1;
 
-  /* Loop over each time interval */
-  for (i = 0; i < segments; i++)
-  {
-#ifdef DEBUG
-    printf ("index: %d\n", i);
-#endif
+  /* Threads beyond one per trace split the windows of each trace */
+  for (t = 0; t < store->numtraces; t++)
+    queue.jobs[t].numThreads = (numThreads > store->numtraces) ? numThreads / store->numtraces : 1;
+  if (numThreads > store->numtraces)
+    numThreads = store->numtraces;
 
-    /* Read miniSEED data within each time interval from buffer */
-    rv = mstl3_readbuffer_selection (&mstl, buffer, bufferLen,
-                                     splitVer, flags, tolerance,
-                                     selections, verbose);
-    if (rv < 0)
+  if (rv == 0 && numThreads > 1)
+  {
+    threads = (pthread_t *)malloc (sizeof (pthread_t) * numThreads);
+    if (threads == NULL)
+      printf ("something wrong when malloc worker threads\n");
+  }
+  if (rv == 0 && threads == NULL)
+  {
+    traceWorker (&queue);
+  }
+  else if (rv == 0)
+  {
+    for (t = 0; t < numThreads; t++)
     {
-      ms_log (2, "Cannot read miniSEED from buffer: %s\n", ms_errorstr (rv));
-      return -1;
+      if (pthread_create (&threads[t], NULL, traceWorker, &queue))
+      {
+        ms_log (2, "Cannot create worker thread\n");
+        break;
+      }
     }
+    /* Any trace left over by threads that failed to start runs here */
+    traceWorker (&queue);
+    while (t-- > 0)
+      pthread_join (threads[t], NULL);
+  }
+  free (threads);
 
-#ifdef DEBUG
-    mstl3_printtracelist (mstl, ISOMONTHDAY, 1, 1);
-#endif
+  /* Make sure everything is cleaned up */
+  for (t = 0; t < store->numtraces; t++)
+  {
+    if (queue.jobs[t].rv)
+      rv = -1;
+    free (queue.jobs[t].outputBase);
+  }
+  free (queue.jobs);
+
+  return rv;
+}
+
+/* Decode the file once, then compute the windows of every source ID
+ * with traverseSampleStore(). The decoded file lives in the given arena,
+ * which the caller resets afterwards, or in a private one when NULL. */
+int
+traverseTimeWindow (const char *mseedfile, const char *outputPrefix, const TraverseConfig *config,
+                    Arena *arena)
+{
+  uint32_t flags = 0;
+  int8_t verbose = 0;
+  int rv         = 0;
+
+  Arena localArena;
+  SampleStore store;
+
+  /* Set bit flag to validate CRC */
+  flags |= MSF_VALIDATECRC;
 
-    //selections->timewindows = selections->timewindows->next;
+  if (arena == NULL)
+  {
+    initArena (&localArena, ARENABLOCKSIZE);
+    arena = &localArena;
   }
 
-  return 0;
+  /* Read and decode the whole file once */
+  if (loadSampleStore (mseedfile, &store, flags, config->selections, verbose, arena,
+                       config->numThreads))
+  {
+    if (arena == &localArena)
+      freeArena (&localArena);
+    return -1;
+  }
+  if (store.numtraces == 0 && config->selections == NULL)
+  {
+    ms_log (2, "No traces found in file: %s\n", mseedfile);
+    rv = -1;
+  }
+  else
+  {
+    /* Nothing selected leaves nothing to write */
+    rv = traverseSampleStore (&store, outputPrefix, config);
+  }
+
+  freeSampleStore (&store);
+  if (arena == &localArena)
+    freeArena (&localArena);
+
+  return rv;
 }
@@ -1,9 +1,37 @@
 #ifndef TRAVERSE_H
 #define TRAVERSE_H
 
-int traverseTimeWindow (const char *mseedfile, const char *outputFileRMS, const char *outputFileJSON,
-                        int windowSize, int windowOverlap, int outputFormatFlag);
-int traverseTimeWindowLimited (const char *mseedfile, const char *outputFileRMS, const char *outputFileJSON,
-                               int windowSize, int windowOverlap);
+#include "arena.h"
+#include "sample_store.h"
+#include "window_writer.h"
+
+/* Most window settings computed in one run */
+#define MAXWINDOWSPECS 16
+
+/* One window setting */
+typedef struct WindowSpec
+{
+  int windowSize;    /* Time window size in seconds */
+  int windowOverlap; /* Overlap percentage between each window */
+} WindowSpec;
+
+/* Settings shared by every trace of a run */
+typedef struct TraverseConfig
+{
+  int windowSize;       /* Time window size in seconds */
+  int windowOverlap;    /* Overlap percentage between each window */
+  int outputFormatFlag; /* OUTPUT* bits of window_writer.h */
+  int numThreads;       /* Worker threads, 0 for one per CPU */
+  const WindowSink *sink; /* Where windows go, NULL for the output files */
+  const WindowSpec *windowSpecs; /* With several, computed together instead of windowSize */
+  int numWindowSpecs;
+  const MS3Selections *selections; /* Records and time ranges to process, NULL for all */
+  const double *percentiles; /* In percent, written after the other columns */
+  int numPercentiles;
+} TraverseConfig;
+
+int traverseSampleStore (const SampleStore *store, const char *outputPrefix, const TraverseConfig *config);
+int traverseTimeWindow (const char *mseedfile, const char *outputPrefix, const TraverseConfig *config,
+                        Arena *arena);
 
 #endif
@@ -0,0 +1,41 @@
+/* Print a .rmsb file in the .rms text layout, an example of the mapped
+ * reader in rms_reader.h. Build with `make rmsbdump`. */
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "rms_reader.h"
+
+int
+main (int argc, char **argv)
+{
+  RMSReader reader;
+  struct tm tm;
+  time_t first;
+  int64_t i;
+
+  if (argc != 2)
+  {
+    printf ("Usage: %s <input rmsb file>\n", argv[0]);
+    return -1;
+  }
+  if (openRMSReader (&reader, argv[1]))
+    return -1;
+
+  /* Same header line as the .rms output */
+  first = (time_t)(reader.header->timebase / 1000000000);
+  gmtime_r (&first, &tm);
+  printf ("\"%04d,%03d,%02d:%02d:%02d\",\"%s\",\"%s\",\"%s\",\"%s\"\r\n",
+          tm.tm_year + 1900, tm.tm_yday + 1, tm.tm_hour, tm.tm_min, tm.tm_sec,
+          reader.header->station, reader.header->network,
+          reader.header->channel, reader.header->location);
+
+  for (i = 0; i < reader.numwindows; i++)
+    printf ("%d,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf\r\n",
+            (int)(reader.timestamp[i] / 1000000000), reader.mean[i], reader.SD[i],
+            reader.min[i], reader.max[i], reader.minDemean[i], reader.maxDemean[i]);
+
+  closeRMSReader (&reader);
+
+  return 0;
+}
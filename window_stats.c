@@ -0,0 +1,41 @@
+#include <math.h>
+
+#include "window_stats.h"
+
+/* Round mean and SD to the hundredth place the same way getMeanAndSD()
+ * does, then derive the demeaned extrema from the rounded mean the same
+ * way getMinMaxAndDemean() does */
+void
+makeWindowStats (uint64_t count, double mean, double variance,
+                 double min, double max, WindowStats *stats)
+{
+  stats->count          = count;
+  stats->numPercentiles = 0;
+  if (count == 0)
+  {
+    stats->mean = stats->SD = stats->min = stats->max = 0.0;
+    stats->minDemean = stats->maxDemean = 0.0;
+    return;
+  }
+
+  /* Cancellation in running sums may leave a tiny negative variance */
+  if (variance < 0.0)
+    variance = 0.0;
+
+  stats->mean      = round (mean * 100) / 100;
+  stats->SD        = round (sqrt (variance) * 100) / 100;
+  stats->min       = min;
+  stats->max       = max;
+  stats->minDemean = min - stats->mean;
+  stats->maxDemean = max - stats->mean;
+}
+
+/* Windows holding too little data are left out of the outputs. This is
+ * shared with the library, so nothing is printed here; callers count
+ * them as COUNT_SHORTWINDOWS, reported by --stats. */
+int
+isWindowTooShort (uint64_t count, double samplingRate)
+{
+  /* If the duration of this trace is smaller than 20 seconds ignore this trace */
+  return (count * samplingRate < 20);
+}
@@ -0,0 +1,27 @@
+#ifndef WINDOW_STATS_H
+#define WINDOW_STATS_H
+
+#include <stdint.h>
+
+/* Most percentiles written per window */
+#define MAXPERCENTILES 8
+
+/* Statistics of one time window as written to the output files */
+typedef struct WindowStats
+{
+  uint64_t count; /* Samples in the window */
+  double mean;
+  double SD;
+  double min;
+  double max;
+  double minDemean;
+  double maxDemean;
+  int numPercentiles; /* Those asked for, written after the other columns */
+  double percentiles[MAXPERCENTILES];
+} WindowStats;
+
+void makeWindowStats (uint64_t count, double mean, double variance,
+                      double min, double max, WindowStats *stats);
+int isWindowTooShort (uint64_t count, double samplingRate);
+
+#endif
@@ -0,0 +1,562 @@
+/* fopencookie() */
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "rms_reader.h"
+#include "stage_stats.h"
+#include "window_writer.h"
+
+static nstime_t NSECS = 1000000000;
+
+static void
+write2RMS (TextBuffer *text, nstime_t timeStamp, const WindowStats *stats)
+{
+  int timeStampInSecond = timeStamp / NSECS;
+  const double values[] = {stats->mean, stats->SD, stats->min,
+                           stats->max, stats->minDemean, stats->maxDemean};
+  int i;
+
+  appendInt (text, timeStampInSecond);
+  for (i = 0; i < 6; i++)
+  {
+    appendText (text, ",", 1);
+    appendFixed2 (text, values[i]);
+  }
+  for (i = 0; i < stats->numPercentiles; i++)
+  {
+    appendText (text, ",", 1);
+    appendFixed2 (text, stats->percentiles[i]);
+  }
+  appendText (text, "\r\n", 2);
+}
+
+/* Position a JSON document written by closeWindowWriter() before its
+ * closing "]}", so further windows can be appended to it */
+static int
+reopenJSON (FILE *file)
+{
+  char tail[2];
+  long end;
+
+  if (fseek (file, -2, SEEK_END) || fread (tail, 1, 2, file) != 2 ||
+      memcmp (tail, "]}", 2) || (end = ftell (file) - 2) < 0 ||
+      ftruncate (fileno (file), end) || fseek (file, end, SEEK_SET))
+    return -1;
+
+  return 0;
+}
+
+static ssize_t
+writeGzip (void *cookie, const char *data, size_t size)
+{
+  return (size == 0 || gzwrite ((gzFile)cookie, data, size) == (int)size) ? (ssize_t)size : -1;
+}
+
+static int
+closeGzip (void *cookie)
+{
+  return (gzclose ((gzFile)cookie) == Z_OK) ? 0 : -1;
+}
+
+/* A stdio stream compressing what is written to it into a gzip file, so
+ * the text outputs are formatted the same either way */
+static FILE *
+openGzip (const char *fileName)
+{
+  cookie_io_functions_t functions = {NULL, writeGzip, NULL, closeGzip};
+  gzFile gz                       = gzopen (fileName, "wb");
+  FILE *file;
+
+  if (gz == NULL)
+    return NULL;
+  if ((file = fopencookie (gz, "w", functions)) == NULL)
+    gzclose (gz);
+
+  return file;
+}
+
+/* Open "<outputBase>.rms", ".json", ".rmsb" and ".npy" as selected by
+ * the OUTPUT* bits of outputFormatFlag, the text outputs as ".rms.gz"
+ * and ".json.gz" with OUTPUTGZIP */
+int
+openWindowWriter (WindowWriter *writer, const char *sid, const char *outputBase,
+                  int outputFormatFlag)
+{
+  return resumeWindowWriter (writer, sid, outputBase, outputFormatFlag, -1, NSTUNSET);
+}
+
+/* Reopen the text outputs an earlier run closed after writing windows
+ * windows, the first at timeStampFirst, and append to them. A negative
+ * windows count creates the outputs instead. Binary outputs are written
+ * whole on close and cannot be resumed. */
+int
+resumeWindowWriter (WindowWriter *writer, const char *sid, const char *outputBase,
+                    int outputFormatFlag, int64_t windows, nstime_t timeStampFirst)
+{
+  static const struct
+  {
+    int flag;
+    const char *extension;
+    const char *mode;
+  } outputs[] = {
+      {OUTPUTRMS, ".rms", "w"},
+      {OUTPUTJSON, ".json", "w"},
+      {OUTPUTBINARY, ".rmsb", "wb"},
+      {OUTPUTNPY, ".npy", "wb"},
+  };
+  FILE **files[] = {&writer->fptrRMS, &writer->fptrJSON, &writer->fptrBinary, &writer->fptrNPY};
+  char fileName[1024];
+  int i;
+
+  int resume = (windows >= 0);
+
+  memset (writer, 0, sizeof (WindowWriter));
+  writer->outputFormatFlag = outputFormatFlag;
+  if (resume && (outputFormatFlag & (OUTPUTBINARY | OUTPUTNPY | OUTPUTGZIP)))
+  {
+    ms_log (2, "Binary and compressed outputs cannot be resumed\n");
+    return -1;
+  }
+
+  /* Parse network, station, location and channel from SID */
+  if (ms_sid2nslc (sid, writer->network, writer->station, writer->location, writer->channel))
+  {
+    printf ("Error returned ms_sid2nslc()\n");
+    return -1;
+  }
+
+  /* Open the output files */
+  for (i = 0; i < (int)(sizeof (outputs) / sizeof (outputs[0])); i++)
+  {
+    if (!(outputFormatFlag & outputs[i].flag))
+      continue;
+
+    snprintf (fileName, sizeof (fileName), "%s%s", outputBase, outputs[i].extension);
+    if ((outputs[i].flag & (OUTPUTRMS | OUTPUTJSON)) && (outputFormatFlag & OUTPUTGZIP))
+    {
+      strncat (fileName, ".gz", sizeof (fileName) - strlen (fileName) - 1);
+      *files[i] = openGzip (fileName);
+    }
+    else if (!resume)
+      *files[i] = fopen (fileName, outputs[i].mode);
+    else if (outputs[i].flag == OUTPUTRMS)
+      *files[i] = fopen (fileName, "a");
+    else if ((*files[i] = fopen (fileName, "r+")) && reopenJSON (*files[i]))
+    {
+      printf ("File %s was not completed by an earlier run\n", fileName);
+      fclose (*files[i]);
+      *files[i] = NULL;
+    }
+    if (*files[i] == NULL)
+    {
+      printf ("Error opening file %s\n", fileName);
+      while (i-- > 0)
+      {
+        if (*files[i])
+          fclose (*files[i]);
+        *files[i] = NULL;
+      }
+      return -1;
+    }
+  }
+
+  if (resume)
+  {
+    writer->windows        = windows;
+    writer->timeStampFirst = timeStampFirst;
+  }
+
+  /* Text outputs are formatted into buffers of their own */
+  writer->timeCache.dayStart = NSTUNSET;
+  if ((writer->fptrRMS && initTextBuffer (&writer->textRMS, writer->fptrRMS)) ||
+      (writer->fptrJSON && initTextBuffer (&writer->textJSON, writer->fptrJSON)))
+  {
+    ms_log (2, "Cannot allocate output buffers\n");
+    free (writer->textRMS.data);
+    for (i = 0; i < (int)(sizeof (files) / sizeof (files[0])); i++)
+    {
+      if (*files[i])
+        fclose (*files[i]);
+      *files[i] = NULL;
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Format the .rms or the .json text of one source ID into a stream of
+ * the caller, e.g. a server response, left open by closeWindowWriter().
+ * A channel without windows leaves nothing in the stream. */
+int
+attachWindowWriter (WindowWriter *writer, const char *sid, int outputFormatFlag, FILE *file)
+{
+  memset (writer, 0, sizeof (WindowWriter));
+  writer->outputFormatFlag = outputFormatFlag;
+  writer->attached         = 1;
+  if (outputFormatFlag != OUTPUTRMS && outputFormatFlag != OUTPUTJSON)
+  {
+    ms_log (2, "Only one text output can be written to a stream\n");
+    return -1;
+  }
+
+  if (ms_sid2nslc (sid, writer->network, writer->station, writer->location, writer->channel))
+  {
+    printf ("Error returned ms_sid2nslc()\n");
+    return -1;
+  }
+
+  writer->timeCache.dayStart = NSTUNSET;
+  if (outputFormatFlag == OUTPUTRMS)
+    writer->fptrRMS = file;
+  else
+    writer->fptrJSON = file;
+  if (initTextBuffer ((writer->fptrRMS) ? &writer->textRMS : &writer->textJSON, file))
+  {
+    ms_log (2, "Cannot allocate output buffers\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Keep a window for the binary outputs, growing the columns as needed */
+static int
+appendColumns (WindowWriter *writer, nstime_t timeStamp, const WindowStats *stats)
+{
+  const double values[6] = {stats->mean, stats->SD, stats->min, stats->max,
+                            stats->minDemean, stats->maxDemean};
+  int64_t capacity;
+  void *grown;
+  int c;
+
+  if (writer->windows == writer->capacity)
+  {
+    capacity = (writer->capacity) ? writer->capacity * 2 : 1024;
+    if ((grown = realloc (writer->timestamps, sizeof (nstime_t) * capacity)) == NULL)
+      return -1;
+    writer->timestamps = (nstime_t *)grown;
+    for (c = 0; c < 6; c++)
+    {
+      if ((grown = realloc (writer->columns[c], sizeof (double) * capacity)) == NULL)
+        return -1;
+      writer->columns[c] = (double *)grown;
+    }
+    writer->capacity = capacity;
+  }
+
+  writer->timestamps[writer->windows] = timeStamp;
+  for (c = 0; c < 6; c++)
+    writer->columns[c][writer->windows] = values[c];
+
+  return 0;
+}
+
+/* Write one window, preceded by the file headers for the first one */
+int
+writeWindow (WindowWriter *writer, nstime_t timeStamp, const WindowStats *stats)
+{
+  StageTimer timer;
+
+  startStage (&timer);
+
+  /* The beginning of the output file */
+  if (writer->windows == 0)
+  {
+    char temp[30];
+    if (!ms_nstime2timestr (timeStamp, temp, SEEDORDINAL, NONE))
+    {
+      ms_log (2, "Cannot create time stamp strings\n");
+      return -1;
+    }
+    if (writer->fptrRMS)
+      appendFormat (&writer->textRMS, "\"%s\",\"%s\",\"%s\",\"%s\",\"%s\"\r\n",
+                    temp, writer->station, writer->network, writer->channel, writer->location);
+    if (writer->fptrJSON)
+      appendFormat (&writer->textJSON, "{\"network\":\"%s\",\"station\":\"%s\",\"location\":\"%s\",\"channel\":\"%s\",\"data\":[",
+                    writer->network, writer->station, writer->location, writer->channel);
+
+    /* Record the time of the first window, used by RMS file */
+    writer->timeStampFirst = timeStamp;
+  }
+
+  /* Output timestamp, mean and standard deviation to output files */
+  if (writer->fptrRMS)
+    write2RMS (&writer->textRMS, timeStamp - writer->timeStampFirst, stats);
+
+  if (writer->fptrJSON)
+  {
+    static const char *keys[] = {"\",\"mean\":", ",\"rms\":", ",\"min\":",
+                                 ",\"max\":", ",\"minDemean\":", ",\"maxDemean\":"};
+    const double values[]     = {stats->mean, stats->SD, stats->min,
+                                 stats->max, stats->minDemean, stats->maxDemean};
+    TextBuffer *text          = &writer->textJSON;
+    int i;
+
+    /* Create time stamp string */
+    const char *timeStampStr = getISOTimeString (&writer->timeCache, timeStamp);
+    if (timeStampStr == NULL)
+    {
+      ms_log (2, "Cannot create time stamp strings\n");
+      return -1;
+    }
+    if (writer->windows == 0)
+      appendText (text, "{\"timestamp\":\"", 14);
+    else
+      appendText (text, ",{\"timestamp\":\"", 15);
+    appendText (text, timeStampStr, strlen (timeStampStr));
+    for (i = 0; i < 6; i++)
+    {
+      appendText (text, keys[i], strlen (keys[i]));
+      appendFixed2 (text, values[i]);
+    }
+    if (stats->numPercentiles > 0)
+    {
+      appendText (text, ",\"percentiles\":[", 16);
+      for (i = 0; i < stats->numPercentiles; i++)
+      {
+        if (i > 0)
+          appendText (text, ",", 1);
+        appendFixed2 (text, stats->percentiles[i]);
+      }
+      appendText (text, "]", 1);
+    }
+    appendText (text, "}", 1);
+  }
+
+  if ((writer->fptrBinary || writer->fptrNPY) && appendColumns (writer, timeStamp, stats))
+  {
+    ms_log (2, "Cannot allocate binary output columns\n");
+    return -1;
+  }
+
+  writer->windows++;
+  endStage (&timer, STAGE_FORMAT);
+  countStage (COUNT_WINDOWS, 1);
+
+  return 0;
+}
+
+/* Push written windows out to the files, for readers following them.
+ * Binary outputs are only complete once the writer is closed. */
+void
+flushWindowWriter (WindowWriter *writer)
+{
+  StageTimer timer;
+
+  startStage (&timer);
+  if (writer->fptrRMS)
+  {
+    flushTextBuffer (&writer->textRMS);
+    fflush (writer->fptrRMS);
+  }
+  if (writer->fptrJSON)
+  {
+    flushTextBuffer (&writer->textJSON);
+    fflush (writer->fptrJSON);
+  }
+  endStage (&timer, STAGE_WRITE);
+}
+
+/* Write the .rmsb header and one contiguous array per column */
+static int
+writeBinary (WindowWriter *writer, FILE *file)
+{
+  RMSBHeader header;
+  int64_t i;
+  int c;
+
+  memset (&header, 0, sizeof (RMSBHeader));
+  memcpy (header.magic, RMSBMAGIC, 4);
+  header.version    = RMSBVERSION;
+  header.headersize = sizeof (RMSBHeader);
+  header.byteorder  = RMSBBYTEORDER;
+  header.numcolumns = RMSBCOLUMNS;
+  header.numwindows = writer->windows;
+  header.timebase   = writer->timeStampFirst;
+  memcpy (header.network, writer->network, sizeof (writer->network));
+  memcpy (header.station, writer->station, sizeof (writer->station));
+  memcpy (header.location, writer->location, sizeof (writer->location));
+  memcpy (header.channel, writer->channel, sizeof (writer->channel));
+
+  /* Time stamps are stored relative to the time base */
+  for (i = 0; i < writer->windows; i++)
+    writer->timestamps[i] -= writer->timeStampFirst;
+
+  if (fwrite (&header, sizeof (RMSBHeader), 1, file) != 1 ||
+      fwrite (writer->timestamps, sizeof (nstime_t), writer->windows, file) != (size_t)writer->windows)
+    return -1;
+  for (c = 0; c < 6; c++)
+  {
+    if (fwrite (writer->columns[c], sizeof (double), writer->windows, file) != (size_t)writer->windows)
+      return -1;
+  }
+
+  for (i = 0; i < writer->windows; i++)
+    writer->timestamps[i] += writer->timeStampFirst;
+
+  return 0;
+}
+
+/* Write a NumPy .npy file holding a structured array of one record per
+ * window, with the time stamps as datetime64[ns] */
+static int
+writeNPY (WindowWriter *writer, FILE *file)
+{
+  static const char *names[] = {"mean", "SD", "min", "max", "minDemean", "maxDemean"};
+  const uint16_t one         = 1;
+  char order                 = (*(const uint8_t *)&one) ? '<' : '>';
+  char header[512];
+  double row[7];
+  int length, c;
+  int64_t i;
+
+  length = snprintf (header, sizeof (header), "{'descr': [('timestamp', '%cM8[ns]')", order);
+  for (c = 0; c < 6; c++)
+    length += snprintf (header + length, sizeof (header) - length, ", ('%s', '%cf8')", names[c], order);
+  length += snprintf (header + length, sizeof (header) - length,
+                      "], 'fortran_order': False, 'shape': (%" PRId64 ",), }", writer->windows);
+
+  /* Pad with spaces and a newline so the data starts 64 byte aligned */
+  while ((10 + length + 1) % 64)
+    header[length++] = ' ';
+  header[length++] = '\n';
+
+  if (fwrite ("\x93NUMPY\x01\x00", 1, 8, file) != 8 ||
+      fputc (length & 0xff, file) == EOF || fputc (length >> 8, file) == EOF ||
+      fwrite (header, 1, length, file) != (size_t)length)
+    return -1;
+
+  for (i = 0; i < writer->windows; i++)
+  {
+    memcpy (&row[0], &writer->timestamps[i], sizeof (double));
+    for (c = 0; c < 6; c++)
+      row[c + 1] = writer->columns[c][i];
+    if (fwrite (row, sizeof (row), 1, file) != 1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Terminate the JSON document, write the binary outputs and close the
+ * output files. Returns 0 on success and -1 when an output could not be
+ * written completely. */
+int
+closeWindowWriter (WindowWriter *writer)
+{
+  StageTimer timer;
+  int rv = 0;
+  int c;
+
+  startStage (&timer);
+
+  if (writer->fptrJSON)
+  {
+    if (!writer->attached || writer->windows > 0)
+      appendText (&writer->textJSON, "]}", 2);
+    if (freeTextBuffer (&writer->textJSON) | (!writer->attached && fclose (writer->fptrJSON)))
+      rv = -1;
+  }
+  if (writer->fptrRMS)
+  {
+    if (freeTextBuffer (&writer->textRMS) | (!writer->attached && fclose (writer->fptrRMS)))
+      rv = -1;
+  }
+  if (writer->fptrBinary)
+  {
+    if (writeBinary (writer, writer->fptrBinary) | fclose (writer->fptrBinary))
+      rv = -1;
+  }
+  if (writer->fptrNPY)
+  {
+    if (writeNPY (writer, writer->fptrNPY) | fclose (writer->fptrNPY))
+      rv = -1;
+  }
+  endStage (&timer, STAGE_WRITE);
+  if (rv)
+    ms_log (2, "Cannot write the outputs of %s.%s.%s.%s\n",
+            writer->network, writer->station, writer->location, writer->channel);
+
+  free (writer->timestamps);
+  for (c = 0; c < 6; c++)
+    free (writer->columns[c]);
+
+  writer->fptrRMS    = NULL;
+  writer->fptrJSON   = NULL;
+  writer->fptrBinary = NULL;
+  writer->fptrNPY    = NULL;
+  writer->timestamps = NULL;
+  memset (writer->columns, 0, sizeof (writer->columns));
+  writer->capacity = 0;
+
+  return rv;
+}
+
+/* Handle of the file sink for outputs resumed as by resumeWindowWriter(),
+ * or created when windows is negative */
+WindowWriter *
+resumeFileSink (const FileSinkOptions *options, const char *sid, const char *outputBase,
+                int64_t windows, nstime_t timeStampFirst)
+{
+  WindowWriter *writer = (WindowWriter *)malloc (sizeof (WindowWriter));
+
+  if (writer == NULL)
+  {
+    ms_log (2, "Cannot allocate window writer\n");
+    return NULL;
+  }
+  if (resumeWindowWriter (writer, sid, outputBase, options->outputFormatFlag, windows, timeStampFirst))
+  {
+    free (writer);
+    return NULL;
+  }
+  writer->flush = options->flush;
+
+  return writer;
+}
+
+static void *
+openFileSink (void *userdata, const char *sid, const char *outputBase)
+{
+  return resumeFileSink ((const FileSinkOptions *)userdata, sid, outputBase, -1, NSTUNSET);
+}
+
+static int
+writeFileSink (void *channel, nstime_t timeStamp, const WindowStats *stats)
+{
+  WindowWriter *writer = (WindowWriter *)channel;
+  int rv               = writeWindow (writer, timeStamp, stats);
+
+  if (rv == 0 && writer->flush)
+    flushWindowWriter (writer);
+
+  return rv;
+}
+
+static int
+closeFileSink (void *channel)
+{
+  int rv = closeWindowWriter ((WindowWriter *)channel);
+
+  free (channel);
+
+  return rv;
+}
+
+/* Set up a sink writing "<outputBase>.rms" etc. through a WindowWriter
+ * per source ID. The options must outlive the sink. */
+void
+makeFileSink (WindowSink *sink, FileSinkOptions *options)
+{
+  sink->open     = openFileSink;
+  sink->write    = writeFileSink;
+  sink->close    = closeFileSink;
+  sink->userdata = options;
+}
+
@@ -0,0 +1,77 @@
+#ifndef WINDOW_WRITER_H
+#define WINDOW_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "libmseed.h"
+
+#include "text_buffer.h"
+#include "window_stats.h"
+
+/* Output formats, combined as a bit mask */
+#define OUTPUTRMS 1    /* .rms text */
+#define OUTPUTJSON 2   /* .json text */
+#define OUTPUTBINARY 4 /* .rmsb columnar binary, see rms_reader.h */
+#define OUTPUTNPY 8    /* .npy structured array */
+#define OUTPUTGZIP 16  /* The text outputs gzip compressed, .rms.gz and .json.gz */
+
+/* The outputs of one source ID. Text outputs are written window by
+ * window, binary outputs are kept as columns and written on close. */
+typedef struct WindowWriter
+{
+  int outputFormatFlag; /* OUTPUT* bits */
+  int flush;            /* Flushed after every window by the file sink */
+  int attached;         /* Text goes to a stream of the caller, left open */
+  FILE *fptrRMS;
+  FILE *fptrJSON;
+  FILE *fptrBinary;
+  FILE *fptrNPY;
+  TextBuffer textRMS;  /* Formatted text on its way to fptrRMS */
+  TextBuffer textJSON; /* Formatted text on its way to fptrJSON */
+  TimeStringCache timeCache;
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[31];
+  int64_t windows;         /* Windows written so far */
+  nstime_t timeStampFirst; /* Time stamp of the first window written */
+  int64_t capacity;        /* Windows the columns have room for */
+  nstime_t *timestamps;
+  double *columns[6]; /* mean, SD, min, max, minDemean, maxDemean */
+} WindowWriter;
+
+/* Where the windows of each source ID go: output files for the program,
+ * callbacks or arrays for library users (see ms2rms.h). open() is called
+ * once per source ID before its first window and returns the handle
+ * passed to write() and close(), NULL on error. Windows of one source ID
+ * arrive in time order, different source IDs may be written from
+ * different threads. */
+typedef struct WindowSink
+{
+  void *(*open) (void *userdata, const char *sid, const char *outputBase);
+  int (*write) (void *channel, nstime_t timeStamp, const WindowStats *stats);
+  int (*close) (void *channel);
+  void *userdata;
+} WindowSink;
+
+/* Settings of the sink writing WindowWriter output files */
+typedef struct FileSinkOptions
+{
+  int outputFormatFlag; /* OUTPUT* bits */
+  int flush;            /* Flush the text outputs after every window */
+} FileSinkOptions;
+
+int openWindowWriter (WindowWriter *writer, const char *sid, const char *outputBase,
+                      int outputFormatFlag);
+int resumeWindowWriter (WindowWriter *writer, const char *sid, const char *outputBase,
+                        int outputFormatFlag, int64_t windows, nstime_t timeStampFirst);
+int attachWindowWriter (WindowWriter *writer, const char *sid, int outputFormatFlag, FILE *file);
+int writeWindow (WindowWriter *writer, nstime_t timeStamp, const WindowStats *stats);
+void flushWindowWriter (WindowWriter *writer);
+int closeWindowWriter (WindowWriter *writer);
+void makeFileSink (WindowSink *sink, FileSinkOptions *options);
+WindowWriter *resumeFileSink (const FileSinkOptions *options, const char *sid, const char *outputBase,
+                              int64_t windows, nstime_t timeStampFirst);
+
+#endif
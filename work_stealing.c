@@ -0,0 +1,177 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmseed.h"
+
+#include "work_stealing.h"
+
+/* Items of one worker. The owner takes items from the head, thieves take
+ * them from the tail. Items are coarse (whole files), so a mutex per
+ * deque costs nothing next to the work itself. */
+typedef struct WorkDeque
+{
+  pthread_mutex_t lock;
+  void **items;
+  int head;
+  int tail;
+} WorkDeque;
+
+typedef struct WorkPool
+{
+  WorkDeque *deques;
+  int numWorkers;
+  WorkFunction function;
+  void *context;
+  WorkerStats *stats;
+} WorkPool;
+
+typedef struct WorkerArg
+{
+  WorkPool *pool;
+  int worker;
+} WorkerArg;
+
+static void *
+takeOwn (WorkDeque *deque)
+{
+  void *item = NULL;
+
+  pthread_mutex_lock (&deque->lock);
+  if (deque->head < deque->tail)
+    item = deque->items[deque->head++];
+  pthread_mutex_unlock (&deque->lock);
+
+  return item;
+}
+
+static void *
+steal (WorkDeque *deque)
+{
+  void *item = NULL;
+
+  pthread_mutex_lock (&deque->lock);
+  if (deque->head < deque->tail)
+    item = deque->items[--deque->tail];
+  pthread_mutex_unlock (&deque->lock);
+
+  return item;
+}
+
+static void *
+workStealingWorker (void *arg)
+{
+  WorkPool *pool = ((WorkerArg *)arg)->pool;
+  int worker     = ((WorkerArg *)arg)->worker;
+  void *item;
+  int victim;
+
+  for (;;)
+  {
+    item = takeOwn (&pool->deques[worker]);
+
+    /* Own deque is empty, look for work on the other workers in turn.
+     * No items are ever added after the start, so a full round without
+     * finding anything means the run is over. */
+    for (victim = 1; item == NULL && victim < pool->numWorkers; victim++)
+    {
+      item = steal (&pool->deques[(worker + victim) % pool->numWorkers]);
+      if (item)
+        pool->stats[worker].stolen++;
+    }
+    if (item == NULL)
+      break;
+
+    pool->function (item, worker, pool->context);
+    pool->stats[worker].processed++;
+  }
+
+  return NULL;
+}
+
+/* Run every item on a fixed pool of workers with work stealing.
+ * Items are dealt out round-robin in the given order, so passing them
+ * sorted by decreasing cost starts every worker on its largest item and
+ * leaves the small ones at the tail for idle workers to steal. */
+int
+runWorkStealing (void **items, int numitems, int numWorkers,
+                 WorkFunction function, void *context, WorkerStats *stats)
+{
+  WorkPool pool;
+  WorkerArg *args    = NULL;
+  pthread_t *threads = NULL;
+  int started        = 0;
+  int rv             = 0;
+  int i;
+
+  if (numWorkers < 1)
+    numWorkers = 1;
+  if (numWorkers > numitems && numitems > 0)
+    numWorkers = numitems;
+
+  memset (stats, 0, sizeof (WorkerStats) * numWorkers);
+  pool.numWorkers = numWorkers;
+  pool.function   = function;
+  pool.context    = context;
+  pool.stats      = stats;
+  pool.deques     = (WorkDeque *)calloc (numWorkers, sizeof (WorkDeque));
+  args            = (WorkerArg *)calloc (numWorkers, sizeof (WorkerArg));
+  threads         = (pthread_t *)calloc (numWorkers, sizeof (pthread_t));
+  if (pool.deques == NULL || args == NULL || threads == NULL)
+  {
+    ms_log (2, "Cannot allocate work stealing pool\n");
+    free (pool.deques);
+    free (args);
+    free (threads);
+    return -1;
+  }
+
+  for (i = 0; i < numWorkers; i++)
+  {
+    pthread_mutex_init (&pool.deques[i].lock, NULL);
+    pool.deques[i].items = (void **)malloc (sizeof (void *) * (numitems / numWorkers + 1));
+    if (pool.deques[i].items == NULL)
+    {
+      ms_log (2, "Cannot allocate work stealing deque\n");
+      numWorkers = i + 1;
+      rv         = -1;
+      goto cleanup;
+    }
+  }
+  for (i = 0; i < numitems; i++)
+  {
+    WorkDeque *deque            = &pool.deques[i % numWorkers];
+    deque->items[deque->tail++] = items[i];
+  }
+
+  /* The calling thread is worker 0 */
+  for (i = 1; i < numWorkers; i++)
+  {
+    args[i].pool   = &pool;
+    args[i].worker = i;
+    if (pthread_create (&threads[i], NULL, workStealingWorker, &args[i]))
+    {
+      ms_log (2, "Cannot create worker thread, its items will be stolen\n");
+      break;
+    }
+    started++;
+  }
+  args[0].pool   = &pool;
+  args[0].worker = 0;
+  workStealingWorker (&args[0]);
+  for (i = 1; i <= started; i++)
+    pthread_join (threads[i], NULL);
+
+cleanup:
+  for (i = 0; i < numWorkers; i++)
+  {
+    pthread_mutex_destroy (&pool.deques[i].lock);
+    free (pool.deques[i].items);
+  }
+  free (pool.deques);
+  free (args);
+  free (threads);
+
+  return rv;
+}
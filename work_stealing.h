@@ -0,0 +1,19 @@
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <stdint.h>
+
+/* Called once per item on the worker thread that took it */
+typedef void (*WorkFunction) (void *item, int worker, void *context);
+
+/* Per-worker counters reported after a run */
+typedef struct WorkerStats
+{
+  int64_t processed; /* Items run by this worker */
+  int64_t stolen;    /* Items this worker took from another worker */
+} WorkerStats;
+
+int runWorkStealing (void **items, int numitems, int numWorkers,
+                     WorkFunction function, void *context, WorkerStats *stats);
+
+#endif